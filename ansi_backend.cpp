@@ -0,0 +1,417 @@
+#include "backend.h"
+#include "utf8.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+using namespace ui;
+
+//Set by SIGWINCH, so the size is only asked for when it may have changed.
+static volatile std::sig_atomic_t size_changed = 1;
+static void on_sigwinch(int)
+{
+    size_changed = 1;
+}
+
+//Whether the terminal takes 24-bit colours, as those that do say in
+//  $COLORTERM.
+static bool colorterm_truecolor()
+{
+    const char* colorterm = std::getenv("COLORTERM");
+    return colorterm and (std::strcmp(colorterm,"truecolor")==0
+            or std::strcmp(colorterm,"24bit")==0);
+}
+
+//Time to wait for the rest of an escape sequence (as set_escdelay for ncurses).
+static const int esc_delay_ms = 25;
+
+Ansi_backend::Ansi_backend(int out_fd, int in_fd)
+    :m_out_fd{out_fd}, m_in_fd{in_fd}, m_truecolor{colorterm_truecolor()}
+{
+    if(isatty(m_in_fd)) {
+        //As ncurses' cbreak and noecho: keys are available immediately.
+        termios tty;
+        if(tcgetattr(m_in_fd,&tty)!=0)
+            throw ui::Exception{"Ansi_backend: Unable to get terminal settings."};
+        m_saved_tty = std::make_unique<termios>(tty);
+        tty.c_lflag &= ~(ICANON|ECHO);
+        tty.c_cc[VMIN] = 1;
+        tty.c_cc[VTIME] = 0;
+        if(tcsetattr(m_in_fd,TCSAFLUSH,&tty)!=0)
+            throw ui::Exception{"Ansi_backend: Unable to set terminal settings."};
+    }
+    struct sigaction sa{}, old{};
+    sa.sa_handler = on_sigwinch;
+    sa.sa_flags = SA_RESTART; //Waits in poll() are interrupted regardless.
+    if(sigaction(SIGWINCH,&sa,&old)==0)
+        m_saved_sigwinch = std::make_unique<struct sigaction>(old);
+    size_changed = 1;
+    update_size();
+    reserve(0);
+    append("\x1b[?1049h\x1b[0m\x1b[2J"); //Alternate screen, cleared.
+    flush();
+}
+Ansi_backend::Ansi_backend(int out_fd, int height, int width)
+    :m_out_fd{out_fd}, m_in_fd{-1}, m_fixed_size{true},
+    m_height{height}, m_width{width}, m_truecolor{colorterm_truecolor()}
+{
+    if(height<0 or width<0)
+        throw Bad_dimensions{"Ansi_backend: Negative height/width supplied."};
+    reserve(0);
+    append("\x1b[?1049h\x1b[0m\x1b[2J");
+    flush();
+}
+Ansi_backend::~Ansi_backend()
+{
+    try {
+        append("\x1b[0m\x1b[?1049l"); //Restore the normal screen.
+        flush();
+    }
+    catch(...) {} //Nothing more can be done about the terminal.
+    if(m_saved_tty)
+        tcsetattr(m_in_fd,TCSAFLUSH,m_saved_tty.get());
+    if(m_saved_sigwinch)
+        sigaction(SIGWINCH,m_saved_sigwinch.get(),nullptr);
+}
+void Ansi_backend::update_size() const
+{
+    if(m_fixed_size or not size_changed)
+        return;
+    size_changed = 0;
+    winsize ws{};
+    if(ioctl(m_out_fd,TIOCGWINSZ,&ws)==0 and ws.ws_row>0 and ws.ws_col>0) {
+        m_height = ws.ws_row;
+        m_width = ws.ws_col;
+    }
+    else { //Not a terminal, fall back on the environment (as ncurses does).
+        const char* lines = std::getenv("LINES");
+        const char* columns = std::getenv("COLUMNS");
+        if(lines and std::atoi(lines)>0)
+            m_height = std::atoi(lines);
+        if(columns and std::atoi(columns)>0)
+            m_width = std::atoi(columns);
+    }
+}
+int Ansi_backend::height() const
+{
+    update_size();
+    return m_height;
+}
+int Ansi_backend::width() const
+{
+    update_size();
+    return m_width;
+}
+void Ansi_backend::reserve(std::size_t n)
+{
+    //Enough for a frame with a move and attribute change for every cell.
+    std::size_t frame_size = static_cast<std::size_t>(m_height)*m_width*16+256;
+    std::size_t needed = std::max(m_out_len+n,frame_size);
+    if(needed>m_out.size())
+        m_out.resize(std::max(needed,m_out.size()*2));
+}
+void Ansi_backend::append(const char* s, std::size_t n)
+{
+    reserve(n);
+    std::memcpy(m_out.data()+m_out_len,s,n);
+    m_out_len += n;
+}
+void Ansi_backend::append(const char* s)
+{
+    append(s,std::strlen(s));
+}
+void Ansi_backend::append_number(int n)
+{
+    char digits[12];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0'+n%10;
+        n /= 10;
+    } while(n>0);
+    append(digits+i,sizeof(digits)-i);
+}
+void Ansi_backend::clear()
+{
+    append("\x1b[0m\x1b[2J");
+    m_sgr = Sgr{};
+    m_x = m_y = -1;
+}
+void Ansi_backend::move(int x, int y)
+{
+    m_want_x = x;
+    m_want_y = y;
+}
+void Ansi_backend::apply_move()
+{
+    if(m_want_x==m_x and m_want_y==m_y)
+        return;
+    append("\x1b[");
+    if(m_want_y==m_y and m_x>=0 and m_want_x>m_x) { //Forward on the row.
+        append_number(m_want_x-m_x);
+        append("C");
+    }
+    else {
+        append_number(m_want_y+1);
+        append(";");
+        append_number(m_want_x+1);
+        append("H");
+    }
+    m_x = m_want_x;
+    m_y = m_want_y;
+}
+void Ansi_backend::set_attrib(Attrib attrib)
+{
+    m_want_attrib = attrib;
+}
+namespace {
+//The foreground and boldness of each value of Colour, made at compile time.
+//  Colour::black to Colour::grey are the 8 terminal colours in order, the
+//  rest are the same colours in bold. Anything else is Colour::normal.
+struct Basic_sgr {
+    int fg; //-1 for the default.
+    bool bold;
+};
+struct Basic_sgr_table {
+    Basic_sgr entry[attrib::colour_mask+1];
+};
+constexpr Basic_sgr_table make_basic_sgr_table()
+{
+    Basic_sgr_table t{};
+    for(int c=0; c<=attrib::colour_mask; ++c)
+        t.entry[c] = c==0 or not is_colour(Colour(c))? Basic_sgr{-1,false}
+            : Basic_sgr{(c-1)%8,c>8};
+    return t;
+}
+constexpr Basic_sgr_table basic_sgr = make_basic_sgr_table();
+}
+Ansi_backend::Sgr Ansi_backend::to_sgr(Attrib attrib)
+{
+    Sgr res;
+    const Basic_sgr& basic = basic_sgr.entry[attrib&attrib::colour_mask];
+    if(basic.fg>=0)
+        res.fg = Term_colour::index(basic.fg);
+    if(attrib&attrib::fg_mask)
+        res.fg = attrib::fg(attrib);
+    res.bg = attrib::bg(attrib);
+    res.bold = basic.bold or (attrib&attrib::bold);
+    res.dim = attrib&attrib::dim;
+    res.reverse = attrib&attrib::standout;
+    return res;
+}
+void Ansi_backend::apply_sgr()
+{
+    Sgr want = to_sgr(m_want_attrib);
+    if(not m_truecolor) {
+        want.fg = want.fg.nearest_index();
+        want.bg = want.bg.nearest_index();
+    }
+    Sgr& have = m_sgr;
+    //Parameters to output, separated by ';'.
+    char params[64];
+    int len = 0;
+    auto add = [&](int p) {
+        if(len>0)
+            params[len++] = ';';
+        if(p>=100)
+            params[len++] = '0'+p/100;
+        if(p>=10)
+            params[len++] = '0'+p/10%10;
+        params[len++] = '0'+p%10;
+    };
+    //base is 30 for the foreground, 40 for the background.
+    auto add_colour = [&](Term_colour c, int base) {
+        if(c.is_default())
+            add(base+9);
+        else if(c.is_index() and c.number()<8)
+            add(base+c.number());
+        else if(c.is_index() and c.number()<16)
+            add(base+60+c.number()-8);
+        else if(c.is_index()) {
+            add(base+8);
+            add(5);
+            add(c.number());
+        }
+        else {
+            add(base+8);
+            add(2);
+            add(c.red());
+            add(c.green());
+            add(c.blue());
+        }
+    };
+    if((have.bold and not want.bold) or (have.dim and not want.dim)) {
+        add(22); //Turns off both bold and dim.
+        have.bold = have.dim = false;
+    }
+    if(want.bold and not have.bold)
+        add(1);
+    if(want.dim and not have.dim)
+        add(2);
+    if(want.reverse!=have.reverse)
+        add(want.reverse? 7 : 27);
+    if(want.fg!=have.fg)
+        add_colour(want.fg,30);
+    if(want.bg!=have.bg)
+        add_colour(want.bg,40);
+    if(len==0)
+        return;
+    have = want;
+    append("\x1b[");
+    append(params,len);
+    append("m");
+}
+void Ansi_backend::write(const wchar_t* s, int n)
+{
+    apply_move();
+    apply_sgr();
+    reserve(n*4);
+    char* out = m_out.data()+m_out_len;
+    for(int i=0; i<n; ++i)
+        out += utf8::encode(s[i],out);
+    m_out_len = out-m_out.data();
+    m_x += n;
+    m_want_x = m_x;
+    if(m_x>=m_width) //The terminal may have wrapped, so position unknown.
+        m_x = m_y = -1;
+}
+bool Ansi_backend::scroll(int top, int bottom, int n)
+{
+    //Setting the scroll region (DECSTBM) homes the cursor, as does resetting
+    //  it afterwards.
+    append("\x1b[");
+    append_number(top+1);
+    append(";");
+    append_number(bottom);
+    append("r\x1b[");
+    append_number(std::abs(n));
+    append(n>0? "S\x1b[r" : "T\x1b[r");
+    m_x = m_y = -1;
+    return true;
+}
+void Ansi_backend::flush()
+{
+    apply_move();
+    write_all(m_out.data(),m_out_len);
+    m_bytes_sent += m_out_len;
+    m_out_len = 0;
+}
+void Ansi_backend::write_all(const char* s, std::size_t n)
+{
+    while(n>0) { //Normally one write(), unless interrupted.
+        ssize_t res = ::write(m_out_fd,s,n);
+        if(res<0 and errno==EINTR)
+            continue;
+        if(res<=0)
+            throw ui::Exception{"Ansi_backend: Unable to write to terminal."};
+        s += res;
+        n -= res;
+    }
+}
+int Ansi_backend::read_byte(int timeout_ms, bool resized)
+{
+    if(not m_pending.empty()) {
+        int ch = m_pending.front();
+        m_pending.pop_front();
+        return ch;
+    }
+    if(m_in_fd<0)
+        throw ui::Exception{"Ansi_backend: No input available."};
+    if(timeout_ms>=0) {
+        //Signals cut the wait short, so wait again for the time remaining.
+        using Clock = std::chrono::steady_clock;
+        const auto deadline = Clock::now()+std::chrono::milliseconds{
+            timeout_ms};
+        pollfd p{m_in_fd,POLLIN,0};
+        int res;
+        while((res = poll(&p,1,timeout_ms))<0 and errno==EINTR) {
+            if(resized and size_changed)
+                return key_resize;
+            timeout_ms = std::max<long>(0,std::chrono::duration_cast<
+                    std::chrono::milliseconds>(deadline-Clock::now()).count());
+        }
+        if(res<=0)
+            return -1;
+    }
+    unsigned char ch;
+    while(true) {
+        ssize_t res = ::read(m_in_fd,&ch,1);
+        if(res==1)
+            return ch;
+        if(res<0 and errno==EINTR)
+            continue;
+        throw ui::Exception{"Ansi_backend: Unable to read from terminal."};
+    }
+}
+int Ansi_backend::read_key(int timeout_ms)
+{
+    int ch = read_byte(timeout_ms,true);
+    if(ch==key_resize)
+        return key_resize;
+    if(ch<0)
+        return no_key;
+    if(ch!=27)
+        return ch;
+    //Escape sequences (ESC [ or ESC O), otherwise escape on its own.
+    int intro = read_byte(esc_delay_ms);
+    if(intro!='[' and intro!='O') {
+        if(intro>=0)
+            m_pending.push_back(intro);
+        return 27;
+    }
+    int number = 0;
+    int final = read_byte(esc_delay_ms);
+    if(final<0) { //Not a sequence, but escape and then the intro typed.
+        m_pending.push_back(intro);
+        return 27;
+    }
+    while(final>='0' and final<='9') {
+        number = number*10+(final-'0');
+        final = read_byte(esc_delay_ms);
+    }
+    while(final==';' or (final>='0' and final<='9')) //Skip modifiers.
+        final = read_byte(esc_delay_ms);
+    switch(final) {
+    case 'A':
+        return key_up;
+    case 'B':
+        return key_down;
+    case 'C':
+        return key_right;
+    case 'D':
+        return key_left;
+    case 'H':
+        return key_home;
+    case 'F':
+        return key_end;
+    case 'P': case 'Q': case 'R': case 'S':
+        return key_f0+1+(final-'P');
+    case '~':
+        switch(number) {
+        case 1: case 7:
+            return key_home;
+        case 2:
+            return key_insert;
+        case 3:
+            return key_delete;
+        case 4: case 8:
+            return key_end;
+        case 5:
+            return key_page_up;
+        case 6:
+            return key_page_down;
+        case 15:
+            return key_f0+5;
+        case 17: case 18: case 19: case 20: case 21:
+            return key_f0+6+(number-17);
+        case 23: case 24:
+            return key_f0+11+(number-23);
+        }
+    }
+    return key_unknown;
+}
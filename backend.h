@@ -0,0 +1,239 @@
+//Terminals that Display can draw to.
+//  Display only uses the Backend interface, so it can draw to ncurses or to
+//  an in-memory grid (for tests and benchmarks) without any other change.
+#ifndef UI_BACKEND_H
+#define UI_BACKEND_H
+#include "ui.h"
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+struct termios;
+struct sigaction;
+
+namespace ui {
+
+class Backend {
+public:
+    //Values returned by read_key() for keys that are not a byte of input.
+    enum Key_code {
+        no_key=-1, //Nothing typed within the timeout.
+        //The terminal was resized while waiting, which is only reported
+        //  if there is a timeout.
+        key_resize=-2,
+        key_up=256, key_down, key_left, key_right, key_backspace, key_delete,
+        key_home, key_end, key_page_up, key_page_down, key_insert,
+        key_f0, //key_f0+n is Fn.
+        key_unknown=key_f0+64
+    };
+    virtual ~Backend() = default;
+    //Size of the terminal in cells.
+    virtual int height() const = 0;
+    virtual int width() const = 0;
+    //Forget what is on the terminal, so the next frame repaints all of it.
+    virtual void clear() = 0;
+    virtual void move(int x, int y) = 0;
+    //Attributes (Colour and attrib flags) used by following writes.
+    virtual void set_attrib(Attrib attrib) = 0;
+    //Write n cells starting at the cursor, leaving the cursor after them.
+    virtual void write(const wchar_t* s, int n) = 0;
+    //Move rows top to before bottom up n rows (down if n is negative), as
+    //  scrolling a region of the terminal does. The rows uncovered may hold
+    //  anything, and the cursor may move. Returns false, having done nothing,
+    //  if the terminal cannot scroll.
+    virtual bool scroll(int /*top*/, int /*bottom*/, int /*n*/)
+    {   return false;   }
+    //Show everything written since the last flush.
+    virtual void flush() = 0;
+    //Wait for input for up to timeout_ms (for ever if negative). Returns a
+    //  byte of UTF-8 input (0-255), a Key_code, no_key or key_resize.
+    virtual int read_key(int timeout_ms=-1) = 0;
+    //Whether read_key can be called while another thread outputs.
+    virtual bool concurrent_input() const
+    {   return false;   }
+    //Bytes output to the terminal so far, or 0 if not known.
+    virtual std::size_t bytes_sent() const
+    {   return 0;   }
+};
+
+//Colour pairs, as curses has, assigned as they are first needed. Once all
+//  are in use the least recently used is reassigned, so cells still shown
+//  in it change colour.
+class Colour_pairs {
+public:
+    //Pairs first to before end may be assigned.
+    Colour_pairs(int first=1, int end=1);
+    //The pair showing fg on bg (curses colour numbers, -1 the default), 0
+    //  if there are none to assign. assigned is set if it was assigned to
+    //  them by this call, so needs setting up.
+    int find(int fg, int bg, bool& assigned);
+    int size() const
+    {   return m_index.size();  }
+    //Times a pair was reassigned to other colours.
+    long reassigned() const
+    {   return m_reassigned;    }
+private:
+    struct Entry {
+        std::uint32_t key;
+        int pair;
+    };
+    std::list<Entry> m_used; //The most recently used first.
+    std::unordered_map<std::uint32_t,std::list<Entry>::iterator> m_index;
+    int m_next, m_end; //Pairs not yet assigned.
+    long m_reassigned{0};
+};
+
+class Ncurses_backend : public Backend {
+public:
+    Ncurses_backend();
+    ~Ncurses_backend();
+    Ncurses_backend(const Ncurses_backend&) = delete;
+    Ncurses_backend& operator=(const Ncurses_backend&) = delete;
+
+    int height() const override;
+    int width() const override;
+    void clear() override;
+    void move(int x, int y) override;
+    //Colours other than those of Colour are shown in the nearest the
+    //  terminal has, in pairs assigned as needed (see Colour_pairs).
+    void set_attrib(Attrib attrib) override;
+    void write(const wchar_t* s, int n) override;
+    bool scroll(int top, int bottom, int n) override;
+    void flush() override;
+    int read_key(int timeout_ms=-1) override;
+    const Colour_pairs& colour_pairs() const
+    {   return m_pairs; }
+private:
+    //The curses colour number nearest c.
+    int curses_colour(Term_colour c) const;
+
+    int m_colours{8}; //The terminal has.
+    Colour_pairs m_pairs;
+};
+
+//Keeps the screen in memory and counts what is done to it.
+//  Input is taken from a queue filled by push_input/push_key. If it is empty
+//  read_key() waits for the timeout, or throws if there is none.
+class Headless_backend : public Backend {
+public:
+    //Number of each type of operation performed.
+    struct Counters {
+        long frames{0}; //Calls to flush.
+        long clears{0};
+        long moves{0};
+        long attrib_changes{0};
+        long writes{0};
+        long cells{0}; //Cells written.
+        long scrolls{0};
+    };
+    explicit Headless_backend(int height=24, int width=80);
+
+    int height() const override
+    {   return m_screen.height();   }
+    int width() const override
+    {   return m_screen.width();    }
+    void clear() override;
+    void move(int x, int y) override;
+    void set_attrib(Attrib attrib) override;
+    void write(const wchar_t* s, int n) override;
+    //Uncovered rows are blanked.
+    bool scroll(int top, int bottom, int n) override;
+    void flush() override;
+    int read_key(int timeout_ms=-1) override;
+    bool concurrent_input() const override
+    {   return true;    }
+
+    //Change the size of the terminal (clears it).
+    void resize(int height, int width);
+    //Queue UTF-8 input as if it were typed.
+    void push_input(const std::string& s);
+    void push_key(int key)
+    {   m_input.push_back(key); }
+    //With the cursor where it was when last flushed.
+    const Screen_buffer& screen() const
+    {   return m_screen;    }
+    //Row y of the screen as UTF-8 (without attributes).
+    std::string row(int y) const;
+    //Every row, separated by '\n'.
+    std::string text() const;
+    const Counters& counters() const
+    {   return m_counters;  }
+    void reset_counters()
+    {   m_counters = Counters{};    }
+private:
+    Screen_buffer m_screen;
+    int m_x{0}, m_y{0};
+    Attrib m_attrib{0};
+    std::deque<int> m_input;
+    Counters m_counters;
+};
+
+//Writes xterm compatible escape sequences directly, without terminfo.
+//  Each frame is built in a buffer and output with one write(). Cursor moves
+//  and attribute changes are only output when needed, so the output for a
+//  series of frames is always the same (it can be compared with a file).
+class Ansi_backend : public Backend {
+public:
+    //Uses the terminal on the given file descriptors.
+    explicit Ansi_backend(int out_fd=1, int in_fd=0);
+    //Writes to out_fd assuming a terminal of the given size. No input.
+    Ansi_backend(int out_fd, int height, int width);
+    ~Ansi_backend();
+    Ansi_backend(const Ansi_backend&) = delete;
+    Ansi_backend& operator=(const Ansi_backend&) = delete;
+
+    int height() const override;
+    int width() const override;
+    void clear() override;
+    void move(int x, int y) override;
+    //Colours other than those of Colour are sent as 256-colour or, if
+    //  $COLORTERM is truecolor or 24bit, 24-bit RGB escape sequences.
+    void set_attrib(Attrib attrib) override;
+    void write(const wchar_t* s, int n) override;
+    bool scroll(int top, int bottom, int n) override;
+    void flush() override;
+    int read_key(int timeout_ms=-1) override;
+    //Input and output use separate file descriptors.
+    bool concurrent_input() const override
+    {   return true;    }
+    std::size_t bytes_sent() const override
+    {   return m_bytes_sent;    }
+private:
+    //Terminal text attributes (SGR state).
+    struct Sgr {
+        Term_colour fg, bg;
+        bool bold{false}, dim{false}, reverse{false};
+    };
+    static Sgr to_sgr(Attrib attrib);
+    void update_size() const;
+    void reserve(std::size_t n); //Ensure n more bytes fit in m_out.
+    void append(const char* s, std::size_t n);
+    void append(const char* s);
+    void append_number(int n);
+    void apply_move(); //Output the cursor move requested, if needed.
+    void apply_sgr(); //Output the attribute change requested, if needed.
+    void write_all(const char* s, std::size_t n);
+    //-1 if none within timeout, or key_resize if resized while waiting
+    //  and resized is true.
+    int read_byte(int timeout_ms, bool resized=false);
+
+    int m_out_fd, m_in_fd;
+    bool m_fixed_size{false};
+    mutable int m_height{24}, m_width{80};
+    std::unique_ptr<termios> m_saved_tty; //Settings to restore, if changed.
+    //SIGWINCH handler to restore, if replaced.
+    std::unique_ptr<struct sigaction> m_saved_sigwinch;
+    std::vector<char> m_out; //Frame being built.
+    std::size_t m_out_len{0};
+    std::size_t m_bytes_sent{0};
+    int m_x{-1}, m_y{-1}; //Cursor position on the terminal, -1 if unknown.
+    int m_want_x{0}, m_want_y{0}; //Requested cursor position.
+    Sgr m_sgr; //Attributes on the terminal.
+    Attrib m_want_attrib{0};
+    bool m_truecolor{false}; //Whether to send 24-bit colours as they are.
+    std::deque<int> m_pending; //Input read ahead while parsing.
+};
+
+}//End namespace ui.
+#endif
@@ -1,17 +1,15 @@
 #include "ui.h"
-#include "utf8.h"
+#include "backend.h"
+#include "level_file.h"
+#include <algorithm>
 #include <iostream>
-#include <fstream>
-
-struct Point {
-    int x{0}, y{0};
-    Point(int xx, int yy)
-        :x{xx}, y{yy} {}
-};
+#include <cstring>
+#include <string>
 
 void mock_battle(ui::Display& t)
 {
-    t.level_view().render(9,6,'x',ui::Colour::magenta);
+    auto actors = t.level_view().layer("actors");
+    t.level_view().render(actors,9,6,'x',ui::Colour::magenta);
     t.show_changes();
     auto r = t.get_answer("Which direction to [hjkl]? ");
     if (r=="h" or r=="j" or r=="k" or r=="l") {
@@ -20,18 +18,20 @@ void mock_battle(ui::Display& t)
     }
     else
         t.queue_message("Invalid direction.");
+    t.level_view().erase(actors,9,6);
 }
 
-void show_inventory(ui::Display& t)
+//Pages through the list overlay until a key other than those for paging.
+void show_list(ui::Display& t)
 {
     t.set_show_overlay(true);
     t.list_overlay().first_page();
     while(true) {
         t.show_changes();
-        auto k = t.get_key();
-        if(k=="h" or k=="k")
+        auto k = t.get_key_event();
+        if(k=='h' or k=='k' or k==ui::Key::page_up)
             t.list_overlay().prev_page();
-        else if(k=="j" or k=="l" or k=="\n")
+        else if(k=='j' or k=='l' or k=='\n' or k==ui::Key::page_down)
             t.list_overlay().next_page();
         else
             break;
@@ -39,45 +39,84 @@ void show_inventory(ui::Display& t)
     t.set_show_overlay(false);
 }
 
-int main()
+//Lists the messages shown so far, most recent first.
+void show_history(ui::Display& t)
+{
+    const auto& log = t.message_log();
+    auto& overlay = t.list_overlay();
+    overlay.set_title("Messages");
+    overlay.set_provider(log.history_size(),
+            [&log](int i, ui::List_overlay::Provided_item& item) {
+                auto msg = log.history(i);
+                item.text.assign(msg.text.data(),msg.text.size());
+                if(msg.count>1)
+                    item.text += " x"+std::to_string(msg.count);
+            });
+    show_list(t);
+    overlay.set_provider(0,{});
+    overlay.set_title("Inventory");
+}
+
+enum class Action {
+    left, right, down, up, battle, inventory, coins, command, history, quit
+};
+
+constexpr ui::Key_binding<Action> bindings[]{
+    {'h',Action::left}, {ui::Key::left,Action::left},
+    {'l',Action::right}, {ui::Key::right,Action::right},
+    {'j',Action::down}, {ui::Key::down,Action::down},
+    {'k',Action::up}, {ui::Key::up,Action::up},
+    {'b',Action::battle}, {'i',Action::inventory}, {U'£',Action::coins},
+    {'#',Action::command}, {ui::ctrl('p'),Action::history},
+    {'q',Action::quit}, {27,Action::quit}
+};
+
+//With --ansi escape sequences are output directly instead of using ncurses,
+//  and with --threaded they are output on a thread of their own. With
+//  --spectate SOCKET the game can be watched with the spectate client.
+int main(int argc, char* argv[])
 try {
-    std::vector<std::string> test_grid;
-    std::vector<Point> coins;
-    std::vector<Point> doors;
-    Point player{0,0};
-    //Load level.
-    std::ifstream is{"demo_level.txt"};
-    is.imbue(std::locale{""});
-    {
-        std::string ln;
-        int y=0;
-        while(getline(is,ln)) {
-            test_grid.push_back(ln);
-            int x=0;
-            for(int i=0; i<ln.size(); ++x) {
-                int offset = utf8::offset_next(ln[i]);
-                std::string p = ln.substr(i,offset);
-                if(p=="£")
-                    coins.push_back(Point{x,y});
-                else if(p=="+")
-                    doors.push_back(Point{x,y});
-                else if(p=="@") {
-                    player = Point{x,y};
-                    test_grid[y][x] = '.';
-                }
-                i += offset;
-            }
-            ++y;
+    bool ansi = false, threaded = false;
+    std::string socket;
+    for(int i=1; i<argc; ++i) {
+        if(std::strcmp(argv[i],"--ansi")==0)
+            ansi = true;
+        else if(std::strcmp(argv[i],"--threaded")==0)
+            threaded = true;
+        else if(std::strcmp(argv[i],"--spectate")==0 and i+1<argc)
+            socket = argv[++i];
+        else {
+            std::cerr << "usage: " << argv[0]
+                << " [--ansi] [--threaded] [--spectate SOCKET]\n";
+            return 2;
         }
     }
-    //Run display.
-    auto t = ui::Display();
+    auto t = ansi? ui::Display(std::make_unique<ui::Ansi_backend>())
+        : ui::Display();
+    t.set_threaded(threaded);
+    if(not socket.empty())
+        t.spectate(socket);
     t.queue_message("Welcome to the demo.cpp for ui::Display.");
-    t.level_view().resize(test_grid);
-    t.status_bar().add("Health");
-    t.status_bar().add("£");
-    t.status_bar().set("£","150");
-    t.status_bar().set("Health","10/10",ui::Colour::green);
+    //Load level.
+    auto& lv = t.level_view();
+    auto markers = ui::load_level("demo_level.txt",lv,{u8"£","+","@"});
+    auto items = lv.add_layer("items",1);
+    auto actors = lv.add_layer("actors",2);
+    for(auto p : markers[u8"£"]) { //Coins lie on the floor.
+        lv.render(p.x,p.y,'.');
+        lv.render(items,p.x,p.y,u8"£",ui::Colour::yellow);
+    }
+    for(auto p : markers["+"])
+        lv.render(items,p.x,p.y,"+",ui::Colour::brown);
+    ui::Position player;
+    if(not markers["@"].empty()) {
+        player = markers["@"].front();
+        lv.render(player.x,player.y,'.');
+    }
+    auto health = t.status_bar().add("Health");
+    auto gold = t.status_bar().add("£");
+    t.status_bar().set(gold,"150");
+    t.status_bar().set(health,"10/10",ui::Colour::green);
     t.status_bar().set_title("Demo");
     t.list_overlay().set_title("Inventory");
     t.list_overlay().push_heading("Consumables");
@@ -92,48 +131,73 @@ try {
     t.list_overlay().push_heading("Extra");
     for(int i=0; i<15; ++i)
         t.list_overlay().push_item("? - Unrecognised item.");
+    //Commands for get_long_answer to complete.
+    ui::Completion_index commands{{"demo","help","inventory","quit"}};
+    for(const auto& i : itms)
+        commands.add("modprobe "+i);
 
-    while(true) {
-        t.level_view().clear();
-        t.level_view().render(test_grid);
-        for(auto p : coins)
-            t.level_view().render(p.x,p.y,u8"£",ui::Colour::yellow);
-        for(auto p : doors)
-            t.level_view().render(p.x,p.y,"+",ui::Colour::brown);
-        t.level_view().render(player.x,player.y,'@',ui::Colour::white);
-        t.level_view().set_focus(player.x,player.y);
-        t.show_changes();
-        auto key = t.get_key();
-        while(t.messages_count()>1) {
-            if(key==" " or key=="\n") {
+    const ui::Key_map<Action> keys{bindings};
+    lv.render(actors,player.x,player.y,'@',ui::Colour::white);
+    lv.set_focus(player.x,player.y);
+    //Coins glint, redrawn between key presses.
+    bool glint = false;
+    t.add_timer(500,[&] {
+        glint = not glint;
+        for(auto p : markers[u8"£"])
+            lv.render(items,p.x,p.y,u8"£",
+                    glint? ui::Colour::white : ui::Colour::yellow);
+        return true;
+    });
+    t.run([&](ui::Key key) {
+        if(t.messages_count()>1) {
+            if(key==' ' or key=='\n')
                 t.next_message();
-                t.show_changes();
-            }
-            else if(key=="q")
-                break;
-            key = t.get_key();
+            if(key!='q')
+                return true;
         }
         t.next_message(); //Clear last message..
-        if((key=="l" or key=="Right") and player.x<t.level_view().width()-1)
-            player.x+=1;
-        else if((key=="h" or key=="Left") and player.x>0)
-            player.x-=1;
-        else if((key=="j" or key=="Down") and player.y<t.level_view().height()-1)
-            player.y+=1;
-        else if((key=="k" or key=="Up") and player.y>0)
-            player.y-=1;
-        else if(key=="b")
+        const Action* action = keys.find(key);
+        if(not action)
+            return true;
+        const ui::Position was = player;
+        switch(*action) {
+        case Action::left:
+            player.x = std::max(player.x-1,0);
+            break;
+        case Action::right:
+            player.x = std::min(player.x+1,lv.width()-1);
+            break;
+        case Action::down:
+            player.y = std::min(player.y+1,lv.height()-1);
+            break;
+        case Action::up:
+            player.y = std::max(player.y-1,0);
+            break;
+        case Action::battle:
             mock_battle(t);
-        else if(key=="i")
-            show_inventory(t);
-        else if(key==u8"£")
+            break;
+        case Action::inventory:
+            show_list(t);
+            break;
+        case Action::coins:
             t.queue_message("You have 150 coins.");
-        else if(key=="#") //Trivial example of get_long_answer.
-            t.status_bar().set_title(t.get_long_answer("# ",
-                        [](const std::string& s) {return "demo";}));
-        else if(key=="q" or key=="Esc")
             break;
-    }
+        case Action::command: //Example of get_long_answer.
+            t.status_bar().set_title(t.get_long_answer("# ",commands));
+            break;
+        case Action::history:
+            show_history(t);
+            break;
+        case Action::quit:
+            return false;
+        }
+        if(player.x!=was.x or player.y!=was.y) {
+            lv.erase(actors,was.x,was.y);
+            lv.render(actors,player.x,player.y,'@',ui::Colour::white);
+            lv.set_focus(player.x,player.y);
+        }
+        return true;
+    });
 }
 catch (std::exception& e) {
     std::cerr<<e.what()<<'\n';
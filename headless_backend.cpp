@@ -0,0 +1,90 @@
+#include "backend.h"
+#include "utf8.h"
+#include <chrono>
+#include <thread>
+using namespace ui;
+
+Headless_backend::Headless_backend(int height, int width)
+{
+    resize(height,width);
+}
+void Headless_backend::clear()
+{
+    ++m_counters.clears;
+}
+void Headless_backend::move(int x, int y)
+{
+    ++m_counters.moves;
+    m_x = x;
+    m_y = y;
+}
+void Headless_backend::set_attrib(Attrib attrib)
+{
+    ++m_counters.attrib_changes;
+    m_attrib = attrib;
+}
+void Headless_backend::write(const wchar_t* s, int n)
+{
+    ++m_counters.writes;
+    m_counters.cells += n;
+    for(int i=0; i<n; ++i)
+        m_screen.put(m_x++,m_y,s[i],m_attrib);
+}
+bool Headless_backend::scroll(int top, int bottom, int n)
+{
+    ++m_counters.scrolls;
+    const int width = m_screen.width();
+    for(int i=0; i<bottom-top; ++i) {
+        const int y = n>0? top+i : bottom-1-i; //Never overwrite a source.
+        for(int x=0; x<width; ++x) {
+            const int from = y+n;
+            m_screen.at(x,y) = from>=top and from<bottom? m_screen.at(x,from)
+                : Cell{};
+        }
+    }
+    return true;
+}
+void Headless_backend::flush()
+{
+    ++m_counters.frames;
+    m_screen.set_cursor(m_x,m_y);
+}
+int Headless_backend::read_key(int timeout_ms)
+{
+    if(m_input.empty()) {
+        if(timeout_ms<0)
+            throw ui::Exception{"Headless_backend: No input queued."};
+        std::this_thread::sleep_for(std::chrono::milliseconds{timeout_ms});
+        return no_key;
+    }
+    int key = m_input.front();
+    m_input.pop_front();
+    return key;
+}
+void Headless_backend::resize(int height, int width)
+{
+    m_screen.resize(height,width);
+}
+void Headless_backend::push_input(const std::string& s)
+{
+    for(char ch : s)
+        m_input.push_back(static_cast<unsigned char>(ch));
+}
+std::string Headless_backend::row(int y) const
+{
+    std::string res;
+    char buf[4];
+    for(int x=0; x<m_screen.width(); ++x)
+        res.append(buf,utf8::encode(m_screen.at(x,y).ch,buf));
+    return res;
+}
+std::string Headless_backend::text() const
+{
+    std::string res;
+    for(int y=0; y<m_screen.height(); ++y) {
+        if(y>0)
+            res += '\n';
+        res += row(y);
+    }
+    return res;
+}
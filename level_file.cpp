@@ -0,0 +1,191 @@
+#include "level_file.h"
+#include "utf8.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace ui;
+
+namespace {
+
+//Read-only mapping of a whole file.
+class Mapped_file {
+public:
+    explicit Mapped_file(const std::string& path)
+    {
+        int fd = open(path.c_str(),O_RDONLY);
+        struct stat st;
+        if(fd<0 or fstat(fd,&st)!=0) {
+            if(fd>=0)
+                close(fd);
+            throw ui::Exception{"load_level: Unable to open "+path+"."};
+        }
+        m_size = st.st_size;
+        if(m_size>0) {
+            void* p = mmap(nullptr,m_size,PROT_READ,MAP_PRIVATE,fd,0);
+            if(p==MAP_FAILED) {
+                close(fd);
+                throw ui::Exception{"load_level: Unable to map "+path+"."};
+            }
+            m_data = static_cast<const char*>(p);
+            madvise(p,m_size,MADV_SEQUENTIAL);
+        }
+        close(fd); //The mapping stays valid.
+    }
+    ~Mapped_file()
+    {
+        if(m_data)
+            munmap(const_cast<char*>(m_data),m_size);
+    }
+    Mapped_file(const Mapped_file&) = delete;
+    Mapped_file& operator=(const Mapped_file&) = delete;
+    const char* data() const
+    {   return m_data;  }
+    std::size_t size() const
+    {   return m_size;  }
+private:
+    const char* m_data{nullptr};
+    std::size_t m_size{0};
+};
+
+//The lines from begin to end, as decoded by one thread.
+struct Chunk {
+    const char* begin;
+    const char* end;
+    std::unique_ptr<char32_t[]> text; //Every line, one after another.
+    std::vector<std::size_t> line_ends; //Offset in text of each line's end.
+    int width{0}; //Longest line in code points.
+    //Markers found as (marker, x, line within the chunk).
+    struct Found {
+        int marker, x, line;
+    };
+    std::vector<Found> found;
+    int bad_line{-1}; //First line that is not valid UTF-8.
+};
+
+//The marker glyphs, with a table for the ASCII ones.
+struct Markers {
+    std::vector<char32_t> cps;
+    int ascii[0x80]; //Index in cps, or -1.
+    bool non_ascii{false};
+    //Index in cps of cp, or -1 if not a marker.
+    int find(char32_t cp) const
+    {
+        if(cp<0x80)
+            return ascii[cp];
+        if(not non_ascii)
+            return -1;
+        auto m = std::find(cps.begin(),cps.end(),cp);
+        return m==cps.end()? -1 : m-cps.begin();
+    }
+};
+
+void decode_chunk(Chunk& c, const Markers& markers)
+{
+    //Never more code points than bytes.
+    c.text.reset(new char32_t[c.end-c.begin]);
+    std::size_t len = 0;
+    for(const char* p=c.begin; p<c.end;) {
+        const char* nl = static_cast<const char*>(std::memchr(p,'\n',c.end-p));
+        const char* line_end = nl? nl : c.end;
+        const char* next = nl? nl+1 : c.end;
+        if(line_end>p and line_end[-1]=='\r')
+            --line_end;
+        std::size_t count;
+        if(not utf8::simd::valid_count(p,line_end-p,count)) {
+            c.bad_line = c.line_ends.size();
+            return;
+        }
+        char32_t* line = c.text.get()+len;
+        utf8::simd::decode_valid(p,line_end-p,line);
+        if(not markers.cps.empty())
+            for(std::size_t x=0; x<count; ++x) {
+                int m = markers.find(line[x]);
+                if(m>=0)
+                    c.found.push_back(Chunk::Found{m,static_cast<int>(x),
+                            static_cast<int>(c.line_ends.size())});
+            }
+        len += count;
+        c.line_ends.push_back(len);
+        c.width = std::max<int>(c.width,count);
+        p = next;
+    }
+}
+
+}
+
+Marker_index ui::load_level(const std::string& path, Level_view& view,
+        const std::vector<std::string>& markers, int threads)
+{
+    Markers marker_cps;
+    std::fill(std::begin(marker_cps.ascii),std::end(marker_cps.ascii),-1);
+    for(const auto& m : markers) {
+        char32_t cp;
+        if(m.empty() or utf8::decode_next(m.data(),m.size(),cp)!=m.size())
+            throw ui::Exception{"load_level: Marker is not a single code point."};
+        if(cp<0x80)
+            marker_cps.ascii[cp] = marker_cps.cps.size();
+        else
+            marker_cps.non_ascii = true;
+        marker_cps.cps.push_back(cp);
+    }
+    Mapped_file file{path};
+    //Split into similar sized chunks at line boundaries, leaving enough
+    //  in each to be worth a thread.
+    static const std::size_t min_chunk = 64*1024;
+    if(threads<=0)
+        threads = std::max(1u,std::thread::hardware_concurrency());
+    threads = std::max<std::size_t>(1,std::min<std::size_t>(threads,
+                file.size()/min_chunk));
+    std::vector<Chunk> chunks(threads);
+    const char* start = file.data();
+    const char* file_end = file.data()+file.size();
+    for(int i=0; i<threads; ++i) {
+        const char* end = file.data()+file.size()*(i+1)/threads;
+        if(end<file_end) {
+            auto nl = static_cast<const char*>(
+                    std::memchr(end,'\n',file_end-end));
+            end = nl? nl+1 : file_end;
+        }
+        chunks[i].begin = start;
+        chunks[i].end = std::max(start,end);
+        start = chunks[i].end;
+    }
+    std::vector<std::thread> workers;
+    for(int i=1; i<threads; ++i)
+        workers.emplace_back(decode_chunk,std::ref(chunks[i]),
+                std::cref(marker_cps));
+    decode_chunk(chunks[0],marker_cps);
+    for(auto& w : workers)
+        w.join();
+
+    int height = 0, width = 0;
+    for(const Chunk& c : chunks) {
+        if(c.bad_line>=0)
+            throw ui::Exception{"load_level: Badly formed UTF-8 on line "
+                +std::to_string(height+c.bad_line+1)+" of "+path+"."};
+        height += c.line_ends.size();
+        width = std::max(width,c.width);
+    }
+    view.resize(height,width);
+    view.clear();
+    Marker_index res;
+    for(const auto& m : markers)
+        res[m];
+    int y = 0;
+    for(const Chunk& c : chunks) {
+        std::size_t line_start = 0;
+        for(std::size_t line_end : c.line_ends) {
+            view.render(0,y++,c.text.get()+line_start,line_end-line_start);
+            line_start = line_end;
+        }
+        const int first_y = y-c.line_ends.size();
+        for(const auto& f : c.found)
+            res[markers[f.marker]].push_back(Position{f.x,first_y+f.line});
+    }
+    return res;
+}
@@ -0,0 +1,30 @@
+//Loading of levels from text files, one row of the level per line of UTF-8.
+//  The file is mapped into memory and split into runs of lines, each
+//  validated and decoded by its own thread. The rows are then rendered
+//  straight into a Level_view.
+#ifndef UI_LEVEL_FILE_H
+#define UI_LEVEL_FILE_H
+#include "ui.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ui {
+
+struct Position {
+    int x{0}, y{0};
+};
+
+//Positions of each marker glyph (UTF-8) in a level, in file order.
+using Marker_index = std::unordered_map<std::string,std::vector<Position>>;
+
+//Resizes view to fit the level in the file at path and renders it, replacing
+//  what was in view. Returns where each of markers (each a single code point)
+//  appears, every marker having an entry even if it was not found.
+//  Uses up to threads threads, by default one per processor.
+//  Throws ui::Exception if the file cannot be read or is not valid UTF-8.
+Marker_index load_level(const std::string& path, Level_view& view,
+        const std::vector<std::string>& markers={}, int threads=0);
+
+}
+#endif
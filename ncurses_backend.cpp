@@ -0,0 +1,211 @@
+#include "backend.h"
+#include <ncurses.h>
+#include <algorithm>
+#include <clocale>
+#undef scroll //wscrl(stdscr,1), which would hide Ncurses_backend::scroll.
+using namespace ui;
+
+namespace {
+//The colour pair and attributes of each value of Colour, made at compile
+//  time. Relies on (for the first 8 colours) that the integer value of the
+//  enum is the same as the colour pair number set up for it; the rest are
+//  the same pairs in bold. Anything else is Colour::normal.
+struct Basic_attrs {
+    short pair;
+    attr_t attrs;
+};
+struct Basic_attrs_table {
+    Basic_attrs entry[attrib::colour_mask+1];
+};
+constexpr Basic_attrs_table make_basic_attrs_table()
+{
+    Basic_attrs_table t{};
+    for(int c=0; c<=attrib::colour_mask; ++c)
+        t.entry[c] = not is_colour(Colour(c))? Basic_attrs{0,0}
+            : c<9? Basic_attrs{short(c),0} : Basic_attrs{short(c-8),A_BOLD};
+    return t;
+}
+constexpr Basic_attrs_table basic_attrs = make_basic_attrs_table();
+}
+
+Ncurses_backend::Ncurses_backend()
+{
+    setlocale(LC_ALL, ""); //Set locale.
+    if(initscr()==nullptr)
+        throw ui::Exception{"Unable to initialise ncurses"};
+    try {
+        int res = cbreak();
+        if(res==ERR)
+            throw ui::Exception{"Unable to initialise ncurses: cbreak"};
+        res = keypad(stdscr, TRUE);
+        if(res==ERR)
+            throw ui::Exception{"Unable to initialise ncurses: keypad"};
+        res = noecho();
+        if(res==ERR)
+            throw ui::Exception{"Unable to initialise ncurses: noecho"};
+        res = set_escdelay(25);
+        if(res==ERR)
+            throw ui::Exception{"Unable to initialise ncurses: esc delay."};
+        use_default_colors();
+        res = start_color(); //Setup all colors.
+        if(res==ERR)
+            throw ui::Exception{"Unable to initialise ncurses with colors."};
+        for(int i=0; i<8; ++i)
+            //Value of i+1 is same as the value for the colour in the enum.
+            init_pair(i+1,i,-1);
+        m_colours = COLORS;
+        //Pairs past those of Colour are assigned as colours need them.
+        //  attr_set takes a short.
+        m_pairs = Colour_pairs{9,std::min(COLOR_PAIRS,0x7FFF)};
+    }
+    catch(...) {
+        endwin();
+        throw;
+    }
+}
+Ncurses_backend::~Ncurses_backend()
+{
+    //Close curses.
+    endwin();
+}
+int Ncurses_backend::height() const
+{
+    return getmaxy(stdscr);
+}
+int Ncurses_backend::width() const
+{
+    return getmaxx(stdscr);
+}
+void Ncurses_backend::clear()
+{
+    clearok(stdscr,TRUE);
+}
+void Ncurses_backend::move(int x, int y)
+{
+    ::move(y,x);
+}
+void Ncurses_backend::set_attrib(Attrib attrib)
+{
+    const Basic_attrs& basic = basic_attrs.entry[attrib&attrib::colour_mask];
+    short pair = basic.pair;
+    attr_t attrs = basic.attrs;
+    if(attrib&(attrib::fg_mask|attrib::bg_mask)) {
+        const int fg = attrib&attrib::fg_mask?
+            curses_colour(attrib::fg(attrib)) : basic.pair-1;
+        const int bg = curses_colour(attrib::bg(attrib));
+        bool assigned;
+        pair = m_pairs.find(fg,bg,assigned);
+        if(assigned)
+            init_pair(pair,fg,bg);
+    }
+    if(attrib&attrib::bold)
+        attrs |= A_BOLD;
+    if(attrib&attrib::dim)
+        attrs |= A_DIM;
+    if(attrib&attrib::standout)
+        attrs |= A_STANDOUT;
+    attr_set(attrs,pair,nullptr);
+}
+int Ncurses_backend::curses_colour(Term_colour c) const
+{
+    if(c.is_default())
+        return -1;
+    if(m_colours>=256)
+        return c.nearest_index().number();
+    if(m_colours>=16 and c.is_index() and c.number()<16)
+        return c.number();
+    return c.nearest_basic();
+}
+void Ncurses_backend::write(const wchar_t* s, int n)
+{
+    addnwstr(s,n);
+}
+bool Ncurses_backend::scroll(int top, int bottom, int n)
+{
+    //Only moves the rows in stdscr, refresh() then finds that they can be
+    //  scrolled on the terminal.
+    if(setscrreg(top,bottom-1)==ERR)
+        return false;
+    scrollok(stdscr,TRUE);
+    const int res = scrl(n);
+    scrollok(stdscr,FALSE);
+    setscrreg(0,getmaxy(stdscr)-1);
+    return res!=ERR;
+}
+void Ncurses_backend::flush()
+{
+    ::refresh();
+}
+int Ncurses_backend::read_key(int timeout_ms)
+{
+    static_assert(KEY_MIN>255, "Unable to read UTF-8 input (if any)");
+    timeout(timeout_ms);
+    int ch = getch();
+    while(ch==KEY_RESIZE and timeout_ms<0) //Only reported with a timeout.
+        ch = getch();
+    if(ch==ERR)
+        return no_key;
+    if(ch==KEY_RESIZE)
+        return key_resize;
+    if(ch>=0 and ch<=255)
+        return ch;
+    switch(ch) {
+    case KEY_UP:
+        return key_up;
+    case KEY_DOWN:
+        return key_down;
+    case KEY_LEFT:
+        return key_left;
+    case KEY_RIGHT:
+        return key_right;
+    case KEY_BACKSPACE:
+        return key_backspace;
+    case KEY_DC:
+        return key_delete;
+    case KEY_HOME:
+        return key_home;
+    case KEY_END:
+        return key_end;
+    case KEY_PPAGE:
+        return key_page_up;
+    case KEY_NPAGE:
+        return key_page_down;
+    case KEY_IC:
+        return key_insert;
+    default:
+        if(ch>=KEY_F0 and ch<KEY_F(64))
+            return key_f0+(ch-KEY_F0);
+        return key_unknown;
+    }
+}
+
+Colour_pairs::Colour_pairs(int first, int end)
+    :m_next{first}, m_end{end}
+{}
+int Colour_pairs::find(int fg, int bg, bool& assigned)
+{
+    const std::uint32_t key = std::uint32_t(fg+1)<<16|std::uint32_t(bg+1);
+    auto found = m_index.find(key);
+    if(found!=m_index.end()) {
+        m_used.splice(m_used.begin(),m_used,found->second);
+        assigned = false;
+        return found->second->pair;
+    }
+    int pair;
+    if(m_next<m_end)
+        pair = m_next++;
+    else if(not m_used.empty()) {
+        pair = m_used.back().pair;
+        m_index.erase(m_used.back().key);
+        m_used.pop_back();
+        ++m_reassigned;
+    }
+    else {
+        assigned = false;
+        return 0;
+    }
+    m_used.push_front(Entry{key,pair});
+    m_index.emplace(key,m_used.begin());
+    assigned = true;
+    return pair;
+}
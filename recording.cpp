@@ -0,0 +1,556 @@
+#include "recording.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+using namespace ui;
+
+const char ui::recording_header[8]{'u','i','r','e','c','1','\n','\0'};
+
+namespace {
+
+const char (&magic)[8] = recording_header;
+const char index_magic[8]{'u','i','r','e','c','i','d','x'};
+const int footer_size = 5*8;
+enum Kind : unsigned char { keyframe=0, delta=1 };
+//Identical characters in a row stored once, if at least this many.
+const int min_repeat = 4;
+//Larger screens are taken to be a corrupt recording.
+const int max_side = 10000;
+//Most bytes a record's fields before and after its runs, and each cell of
+//  its runs, can take.
+const int max_fields = 5*10;
+const int max_cell = 3*5+10;
+
+//Write v at out, moving out past it.
+inline void put_varint(unsigned char*& out, std::uint64_t v)
+{
+    while(v>=0x80) {
+        *out++ = (v&0x7F)|0x80;
+        v >>= 7;
+    }
+    *out++ = v;
+}
+void put_u64(std::vector<unsigned char>& out, std::uint64_t v)
+{
+    for(int i=0; i<8; ++i)
+        out.push_back(v>>8*i&0xFF);
+}
+std::uint64_t get_u64(const unsigned char* p)
+{
+    std::uint64_t v = 0;
+    for(int i=0; i<8; ++i)
+        v |= std::uint64_t(p[i])<<8*i;
+    return v;
+}
+
+//Reads the varints of a record.
+class Record_reader {
+public:
+    Record_reader(const unsigned char* begin, const unsigned char* end)
+        :m_p{begin}, m_end{end}
+    {}
+    explicit Record_reader(const std::vector<unsigned char>& record)
+        :Record_reader{record.data(),record.data()+record.size()}
+    {}
+    std::uint64_t varint()
+    {
+        std::uint64_t v = 0;
+        for(int shift=0; shift<64; shift+=7) {
+            if(m_p==m_end)
+                break;
+            const unsigned char b = *m_p++;
+            v |= std::uint64_t(b&0x7F)<<shift;
+            if(not (b&0x80))
+                return v;
+        }
+        throw ui::Exception{"Recording: Badly formed record."};
+    }
+private:
+    const unsigned char* m_p;
+    const unsigned char* m_end;
+};
+
+//Write n cells sharing an attribute, the first being cell start, as runs at
+//  out. Identical characters are written once, if there are enough of them.
+//  last_end is the cell after the last run, and is updated.
+void put_cells(unsigned char*& out, const Cell* cells, int n,
+        std::size_t start, std::size_t& last_end)
+{
+    for(int x=0; x<n;) {
+        int same = x+1;
+        while(same<n and cells[same].ch==cells[x].ch)
+            ++same;
+        const bool repeat = same-x>=min_repeat;
+        int end = same;
+        if(not repeat) //Up to where repeated characters start.
+            while(end<n) {
+                int next = end+1;
+                while(next<n and cells[next].ch==cells[end].ch)
+                    ++next;
+                if(next-end>=min_repeat)
+                    break;
+                end = next;
+            }
+        put_varint(out,std::uint64_t(end-x)<<1|repeat);
+        put_varint(out,start+x-last_end);
+        put_varint(out,static_cast<std::uint64_t>(cells[x].attrib));
+        for(int i=x; i<(repeat? x+1 : end); ++i)
+            put_varint(out,static_cast<std::uint32_t>(cells[i].ch));
+        last_end = start+end;
+        x = end;
+    }
+}
+
+//Move rows top to before bottom of screen up n rows, blanking those
+//  uncovered.
+void scroll(Screen_buffer& screen, int top, int bottom, long n)
+{
+    const int width = screen.width();
+    for(int i=0; i<bottom-top; ++i) {
+        const int y = n>0? top+i : bottom-1-i; //Never overwrite a source.
+        const long from = y+n;
+        for(int x=0; x<width; ++x)
+            screen.at(x,y) = from>=top and from<bottom?
+                screen.at(x,from) : Cell{};
+    }
+}
+
+//Write the runs of cells in screen that differ from last (a blank screen
+//  if nullptr) at out, then update last to match. last_end is as for
+//  put_cells.
+void put_runs(unsigned char*& out, const Screen_buffer& screen,
+        Screen_buffer* last, std::size_t& last_end)
+{
+    const int width = screen.width();
+    const Cell blank{};
+    for(int y=0; y<screen.height() and width>0; ++y) {
+        const Cell* row = &screen.at(0,y);
+        Cell* last_row = last? &last->at(0,y) : nullptr;
+        if(last and std::equal(row,row+width,last_row))
+            continue;
+        auto changed = [&](int x) {
+            return last? row[x]!=last_row[x] : row[x]!=blank;
+        };
+        for(int x=0; x<width;) {
+            if(not changed(x)) {
+                ++x;
+                continue;
+            }
+            int end = x+1;
+            while(end<width and changed(end)
+                    and row[end].attrib==row[x].attrib)
+                ++end;
+            put_cells(out,row+x,end-x,std::size_t(y)*width+x,last_end);
+            x = end;
+        }
+        if(last)
+            std::copy(row,row+width,last_row);
+    }
+}
+
+}
+
+void Frame_encoder::begin_frame()
+{
+    m_delta_size = 0;
+    m_keyframe_size = 0;
+    m_screen = nullptr;
+    m_run_end = 0;
+    m_has_delta = m_width>=0;
+}
+void Frame_encoder::scroll(int top, int bottom, int n)
+{
+    if(not m_has_delta)
+        return;
+    unsigned char* out = room(m_delta,m_delta_size,4*10);
+    put_varint(out,1);
+    put_varint(out,top);
+    put_varint(out,bottom);
+    put_varint(out,n<0? (std::uint64_t(-std::int64_t(n))<<1)-1
+            : std::uint64_t(n)<<1);
+    m_delta_size = out-m_delta.data();
+}
+void Frame_encoder::put(int x, int y, const Cell* cells, int n)
+{
+    const std::size_t start = std::size_t(y)*m_width+x;
+    if(x<0 or y<0 or x+n>m_width or y>=m_height or start<m_run_end)
+        m_has_delta = false; //The screen was resized, so it will be a keyframe.
+    if(not m_has_delta or n<=0)
+        return;
+    unsigned char* out = room(m_delta,m_delta_size,std::size_t(n)*max_cell);
+    put_cells(out,cells,n,start,m_run_end);
+    m_delta_size = out-m_delta.data();
+}
+void Frame_encoder::put_changes(const Screen_buffer& screen,
+        Screen_buffer& last)
+{
+    if(screen.width()!=last.width() or screen.height()!=last.height()) {
+        last = screen;
+        m_has_delta = false;
+    }
+    if(not m_has_delta)
+        return;
+    unsigned char* out = room(m_delta,m_delta_size,
+            std::size_t(screen.width())*screen.height()*max_cell);
+    put_runs(out,screen,&last,m_run_end);
+    m_delta_size = out-m_delta.data();
+}
+void Frame_encoder::end_frame(const Screen_buffer& screen)
+{
+    if(screen.width()!=m_width or screen.height()!=m_height)
+        m_has_delta = false;
+    m_width = screen.width();
+    m_height = screen.height();
+    m_screen = &screen;
+    if(m_has_delta)
+        end_record(m_delta,m_delta_size);
+}
+const unsigned char* Frame_encoder::keyframe()
+{
+    if(m_keyframe_size==0 and m_screen) {
+        const Screen_buffer& screen = *m_screen;
+        unsigned char* out = room(m_keyframe,0,max_fields
+                +std::size_t(screen.width())*screen.height()*max_cell);
+        put_varint(out,screen.height());
+        put_varint(out,screen.width());
+        std::size_t last_end = 0;
+        put_runs(out,screen,nullptr,last_end);
+        m_keyframe_size = out-m_keyframe.data();
+        end_record(m_keyframe,m_keyframe_size);
+    }
+    return m_keyframe.data();
+}
+std::size_t Frame_encoder::keyframe_size()
+{
+    keyframe();
+    return m_keyframe_size;
+}
+unsigned char* Frame_encoder::room(std::vector<unsigned char>& buf,
+        std::size_t used, std::size_t n)
+{
+    if(buf.size()<used+n)
+        buf.resize(std::max(used+n,buf.size()*2));
+    return buf.data()+used;
+}
+void Frame_encoder::end_record(std::vector<unsigned char>& buf,
+        std::size_t& used)
+{
+    unsigned char* out = room(buf,used,max_fields);
+    put_varint(out,0);
+    put_varint(out,std::max(m_screen->cursor_x(),0));
+    put_varint(out,std::max(m_screen->cursor_y(),0));
+    used = out-buf.data();
+}
+
+std::size_t ui::write_record_header(unsigned char* out, bool key, long time,
+        std::size_t size)
+{
+    unsigned char time_field[10];
+    unsigned char* time_end = time_field;
+    put_varint(time_end,time);
+    unsigned char* p = out;
+    *p++ = key? keyframe : delta;
+    put_varint(p,time_end-time_field+size);
+    p = std::copy(time_field,time_end,p);
+    return p-out;
+}
+std::size_t ui::read_record_header(const unsigned char* data, std::size_t n,
+        int& kind, std::size_t& size)
+{
+    if(n<2)
+        return 0;
+    kind = data[0];
+    size = 0;
+    for(std::size_t i=1; i<n and i<=10; ++i) {
+        size |= std::size_t(data[i]&0x7F)<<7*(i-1);
+        if(not (data[i]&0x80))
+            return i+1;
+    }
+    if(n>10)
+        throw ui::Exception{"Recording: Badly formed record."};
+    return 0;
+}
+long ui::decode_frame(int kind, const unsigned char* data, std::size_t size,
+        Screen_buffer& screen)
+{
+    Record_reader r{data,data+size};
+    const long time = r.varint();
+    if(kind==keyframe) {
+        const std::uint64_t height = r.varint(), width = r.varint();
+        if(height>max_side or width>max_side)
+            throw ui::Exception{"Recording: Badly formed record."};
+        screen.resize(height,width);
+    }
+    else if(kind!=delta)
+        throw ui::Exception{"Recording: Badly formed record."};
+    const int width = screen.width(), height = screen.height();
+    const std::uint64_t cells = std::uint64_t(width)*height;
+    std::uint64_t pos = 0;
+    while(const std::uint64_t header = r.varint()) {
+        if(header==1) {
+            const std::uint64_t top = r.varint(), bottom = r.varint();
+            const std::uint64_t zigzag = r.varint();
+            const long n = zigzag&1? -long(zigzag>>1)-1 : long(zigzag>>1);
+            if(top>bottom or bottom>std::uint64_t(height))
+                throw ui::Exception{"Recording: Badly formed record."};
+            scroll(screen,top,bottom,n);
+            continue;
+        }
+        const std::uint64_t count = header>>1;
+        pos += r.varint();
+        const Attrib attrib = r.varint();
+        if(pos+count>cells or pos+count<pos)
+            throw ui::Exception{"Recording: Badly formed record."};
+        Cell* c = &screen.at(0,0)+pos;
+        if(header&1)
+            std::fill(c,c+count,Cell{static_cast<wchar_t>(r.varint()),attrib});
+        else
+            for(std::uint64_t i=0; i<count; ++i)
+                c[i] = Cell{static_cast<wchar_t>(r.varint()),attrib};
+        pos += count;
+    }
+    const int cursor_x = r.varint();
+    screen.set_cursor(cursor_x,r.varint());
+    return time;
+}
+
+Frame_recorder::Frame_recorder(const std::string& path, int keyframe_interval)
+    :m_file{std::fopen(path.c_str(),"wb")},
+    m_keyframe_interval{std::max(keyframe_interval,1)},
+    m_start{std::chrono::steady_clock::now()}
+{
+    if(not m_file)
+        throw ui::Exception{"Frame_recorder: Unable to create "+path+"."};
+    write(reinterpret_cast<const unsigned char*>(magic),sizeof(magic));
+}
+Frame_recorder::~Frame_recorder()
+{
+    try {
+        close();
+    }
+    catch(ui::Exception&) {
+        //Nothing can be done about it here. The recording can still be read
+        //  without its index.
+    }
+}
+void Frame_recorder::add(const Screen_buffer& screen)
+{
+    std::chrono::duration<double,std::milli> t =
+        std::chrono::steady_clock::now()-m_start;
+    add(screen,t.count());
+}
+void Frame_recorder::add(const Screen_buffer& screen, long time_ms)
+{
+    m_encoder.begin_frame();
+    m_encoder.put_changes(screen,m_last);
+    m_encoder.end_frame(screen);
+    add(m_encoder,time_ms);
+}
+void Frame_recorder::add(Frame_encoder& frame)
+{
+    std::chrono::duration<double,std::milli> t =
+        std::chrono::steady_clock::now()-m_start;
+    add(frame,t.count());
+}
+void Frame_recorder::add(Frame_encoder& frame, long time_ms)
+{
+    if(not m_file)
+        throw ui::Exception{"Frame_recorder: Recording has been closed."};
+    time_ms = std::max(time_ms,m_last_time);
+    const bool key = not frame.has_delta() or m_frames%m_keyframe_interval==0;
+    const unsigned char* data = key? frame.keyframe() : frame.delta();
+    const std::size_t size = key? frame.keyframe_size() : frame.delta_size();
+    unsigned char header[max_record_header];
+    const std::size_t header_size = write_record_header(header,key,
+            key? time_ms : time_ms-m_last_time,size);
+    if(key)
+        m_index.push_back(Index_entry{m_bytes,std::uint64_t(m_frames),
+                std::uint64_t(time_ms)});
+    write(header,header_size);
+    write(data,size);
+    if(key) //So a recording cut short loses little.
+        std::fflush(m_file.get());
+    ++m_frames;
+    m_last_time = time_ms;
+}
+void Frame_recorder::close()
+{
+    if(not m_file)
+        return;
+    std::vector<unsigned char> index;
+    for(const auto& e : m_index) {
+        put_u64(index,e.offset);
+        put_u64(index,e.frame);
+        put_u64(index,e.time);
+    }
+    put_u64(index,m_bytes);
+    put_u64(index,m_index.size());
+    put_u64(index,m_frames);
+    put_u64(index,m_last_time);
+    index.insert(index.end(),std::begin(index_magic),std::end(index_magic));
+    write(index.data(),index.size());
+    if(std::fclose(m_file.release())!=0)
+        throw ui::Exception{"Frame_recorder: Unable to write recording."};
+}
+double Frame_recorder::bytes_per_hour() const
+{
+    if(m_last_time<1000)
+        return 0;
+    return double(m_bytes)*3600000/m_last_time;
+}
+void Frame_recorder::write(const unsigned char* data, std::size_t n)
+{
+    if(std::fwrite(data,1,n,m_file.get())!=n)
+        throw ui::Exception{"Frame_recorder: Unable to write recording."};
+    m_bytes += n;
+}
+
+Recording::Recording(const std::string& path)
+    :m_file{std::fopen(path.c_str(),"rb")}
+{
+    if(not m_file)
+        throw ui::Exception{"Recording: Unable to open "+path+"."};
+    char header[sizeof(magic)];
+    if(std::fread(header,1,sizeof(header),m_file.get())!=sizeof(header)
+            or std::memcmp(header,magic,sizeof(magic))!=0)
+        throw ui::Exception{"Recording: "+path+" is not a recording."};
+    load_index();
+    if(m_index.empty() and m_frames>0)
+        throw ui::Exception{"Recording: "+path+" has no keyframes."};
+    m_pos = sizeof(magic);
+    std::fseek(m_file.get(),m_pos,SEEK_SET);
+}
+void Recording::load_index()
+{
+    std::FILE* f = m_file.get();
+    std::fseek(f,0,SEEK_END);
+    const long size = m_size = std::ftell(f);
+    unsigned char footer[footer_size];
+    if(size>=long(sizeof(magic))+footer_size
+            and std::fseek(f,size-footer_size,SEEK_SET)==0
+            and std::fread(footer,1,footer_size,f)==footer_size
+            and std::memcmp(footer+4*8,index_magic,8)==0) {
+        const std::uint64_t offset = get_u64(footer);
+        const std::uint64_t entries = get_u64(footer+8);
+        if(offset+entries*24+footer_size==std::uint64_t(size)) {
+            m_record.resize(entries*24);
+            std::fseek(f,offset,SEEK_SET);
+            if(std::fread(m_record.data(),1,m_record.size(),f)
+                    ==m_record.size()) {
+                for(std::uint64_t i=0; i<entries; ++i) {
+                    const unsigned char* e = m_record.data()+i*24;
+                    m_index.push_back(Index_entry{long(get_u64(e)),
+                            long(get_u64(e+8)),long(get_u64(e+16))});
+                }
+                m_frames = get_u64(footer+16);
+                m_duration = get_u64(footer+24);
+                m_data_end = offset;
+                return;
+            }
+        }
+    }
+    //No index, so read the time of every frame.
+    m_data_end = size;
+    m_pos = sizeof(magic);
+    std::fseek(f,m_pos,SEEK_SET);
+    long time = 0;
+    for(int kind; (kind = read_record())>=0;) {
+        const long start = m_pos-m_record_size;
+        const long t = Record_reader{m_record}.varint();
+        time = kind==keyframe? t : time+t;
+        if(kind==keyframe)
+            m_index.push_back(Index_entry{start,m_frames,time});
+        ++m_frames;
+    }
+    m_duration = time;
+}
+int Recording::read_record()
+{
+    std::FILE* f = m_file.get();
+    if(m_pos>=m_data_end)
+        return -1;
+    const int kind = std::fgetc(f);
+    std::size_t size = 0;
+    int header_size = 1;
+    for(int shift=0; ; shift+=7) {
+        const int b = std::fgetc(f);
+        ++header_size;
+        if(b==EOF or shift>=63)
+            return -1;
+        size |= std::size_t(b&0x7F)<<shift;
+        if(not (b&0x80))
+            break;
+    }
+    if(kind!=keyframe and kind!=delta)
+        throw ui::Exception{"Recording: Badly formed record."};
+    if(m_pos+header_size+long(size)>m_data_end)
+        return -1; //Cut short.
+    m_record.resize(size);
+    if(std::fread(m_record.data(),1,size,f)!=size)
+        return -1;
+    m_record_size = header_size+size;
+    m_pos += m_record_size;
+    return kind;
+}
+bool Recording::next()
+{
+    return step(std::numeric_limits<long>::max());
+}
+bool Recording::step(long until_time)
+{
+    const long start = m_pos;
+    const int kind = read_record();
+    Record_reader r{m_record};
+    const long t = kind<0? 0 : r.varint();
+    const long time = kind==keyframe? t : m_time+t;
+    if(kind<0 or (kind==delta and m_frame<0) or time>until_time) {
+        m_pos = start;
+        std::fseek(m_file.get(),m_pos,SEEK_SET);
+        if(kind==delta and m_frame<0)
+            throw ui::Exception{"Recording: Frame without a keyframe."};
+        return false;
+    }
+    decode_frame(kind,m_record.data(),m_record.size(),m_screen);
+    m_time = time;
+    ++m_frame;
+    return true;
+}
+void Recording::seek(long n)
+{
+    if(m_frames==0)
+        return;
+    n = std::max(0L,std::min(n,m_frames-1));
+    auto e = std::upper_bound(m_index.begin(),m_index.end(),n,
+            [](long n, const Index_entry& e) {
+                return n<e.frame;
+            });
+    --e; //The first frame is a keyframe.
+    if(m_frame<e->frame or m_frame>n)
+        go_to(*e);
+    while(m_frame<n and next())
+        ;
+}
+void Recording::seek_time(long time_ms)
+{
+    if(m_frames==0)
+        return;
+    auto e = std::upper_bound(m_index.begin(),m_index.end(),time_ms,
+            [](long t, const Index_entry& e) {
+                return t<e.time;
+            });
+    if(e!=m_index.begin())
+        --e;
+    if(m_frame<e->frame or m_time>time_ms)
+        go_to(*e);
+    if(m_frame<0)
+        next(); //Before the first frame shows it.
+    while(step(time_ms))
+        ;
+}
+void Recording::go_to(const Index_entry& e)
+{
+    m_pos = e.offset;
+    std::fseek(m_file.get(),m_pos,SEEK_SET);
+    m_frame = e.frame-1;
+    m_time = e.time;
+}
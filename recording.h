@@ -0,0 +1,241 @@
+//Recording of the frames shown by a Display, for bug reports and spectating.
+//  Each frame is stored as the cells that changed since the one before, with
+//  every so often a keyframe holding the whole screen. An index of the
+//  keyframes at the end of the file lets a Recording seek to any frame or
+//  time in O(log n), decoding at most the frames since the keyframe before.
+//
+//  The file is a header followed by one record per frame, all integers
+//  unsigned LEB128 varints unless noted:
+//      header:  "uirec1\n" and a zero byte.
+//      record:  kind (byte, 0 keyframe, 1 delta), size of the rest, then
+//               keyframe: time (ms), height, width, changes, cursor x, y
+//               delta:    time since the last frame (ms), changes, cursor
+//      changes: in order, each either a run of changed cells (against a
+//               blank screen for keyframes): (count<<1|repeat), cells
+//               skipped since the last run (row major), attribute, then one
+//               character repeated count times if repeat, else count
+//               characters; or rows top to before bottom scrolled up n rows
+//               (down if negative, the rows uncovered blank): 1, top,
+//               bottom, n zigzag encoded. A zero ends them.
+//  then the index, one (offset, frame, time) entry per keyframe, and a
+//  footer of (index offset, entries, frames, duration in ms, "uirecidx"),
+//  all as 64-bit little-endian integers. A recording cut short (say by a
+//  crash) has no index, and is scanned to build one when opened.
+#ifndef UI_RECORDING_H
+#define UI_RECORDING_H
+#include "ui.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ui {
+
+//What a recording starts with, as does what is sent to spectators.
+extern const char recording_header[8];
+
+//Encodes each frame as the changes made to the screen, for Frame_sinks to
+//  record or send on. Display feeds it from what it sends the terminal:
+//  begin_frame, then scroll and put as they are done, then end_frame with
+//  the screen as it is after them. So unchanged cells are never looked at,
+//  and the changes are encoded once however many sinks there are.
+class Frame_encoder {
+public:
+    void begin_frame();
+    //Rows top to before bottom moved up n rows (down if negative).
+    void scroll(int top, int bottom, int n);
+    //n cells sharing an attribute written from (x,y). Cells must be put in
+    //  order of position.
+    void put(int x, int y, const Cell* cells, int n);
+    //Put the cells of screen differing from last, then update last to
+    //  match. For screens not drawn by a Display.
+    void put_changes(const Screen_buffer& screen, Screen_buffer& last);
+    //screen must stay as it is until the frame has been taken (keyframe()
+    //  encodes it).
+    void end_frame(const Screen_buffer& screen);
+    //The screen of the frame ended last is now at screen, unchanged, so
+    //  its keyframe can still be taken.
+    void moved(const Screen_buffer& screen)
+    {   if(m_screen) m_screen = &screen;    }
+
+    //Whether the frame can be sent as changes to the one before. Not for
+    //  the first frame, or if the screen changed size.
+    bool has_delta() const
+    {   return m_has_delta;  }
+    //The frame as changes, and as the whole screen, the fields of the
+    //  record after its time (see the format above). The keyframe is only
+    //  encoded when first asked for, and is empty before the first frame.
+    //  Both are kept until the next frame.
+    const unsigned char* delta() const
+    {   return m_delta.data();  }
+    std::size_t delta_size() const
+    {   return m_delta_size;    }
+    const unsigned char* keyframe();
+    std::size_t keyframe_size();
+private:
+    //Room for n more bytes at the end of buf (with used bytes), returning
+    //  where they go.
+    static unsigned char* room(std::vector<unsigned char>& buf,
+            std::size_t used, std::size_t n);
+    //End the changes in buf with the cursor.
+    void end_record(std::vector<unsigned char>& buf, std::size_t& used);
+
+    std::vector<unsigned char> m_delta;
+    std::size_t m_delta_size{0};
+    std::vector<unsigned char> m_keyframe;
+    std::size_t m_keyframe_size{0};
+    const Screen_buffer* m_screen{nullptr}; //Of the frame, until taken.
+    int m_height{-1}, m_width{-1}; //Of the last frame.
+    std::size_t m_run_end{0}; //Cell after the last one put.
+    bool m_has_delta{false};
+};
+
+//Takes the frames shown by a Display (see Display::record and
+//  Display::spectate), on the thread drawing them.
+class Frame_sink {
+public:
+    virtual ~Frame_sink() = default;
+    //Take the frame just encoded.
+    virtual void add(Frame_encoder& frame) = 0;
+    //Do what is due while no frames are shown, such as sending what is
+    //  queued, last being the frame shown last. Called by Display::run
+    //  while it waits.
+    virtual void poll(Frame_encoder& /*last*/) {}
+};
+
+//Most bytes write_record_header can write.
+const int max_record_header = 1+2*10;
+//Write at out the kind, size and time of a record (a keyframe if key),
+//  the rest of its fields being size bytes. Returns the bytes written.
+std::size_t write_record_header(unsigned char* out, bool key, long time,
+        std::size_t size);
+//Read the kind and size of a record from the n bytes at data. Returns the
+//  bytes read, 0 if that is not all of them.
+std::size_t read_record_header(const unsigned char* data, std::size_t n,
+        int& kind, std::size_t& size);
+
+//Apply a record of kind (0 keyframe, 1 delta) read from a recording, its
+//  fields after the kind and size, to screen. Returns the time of the frame
+//  (since the last for a delta). Throws ui::Exception if badly formed.
+long decode_frame(int kind, const unsigned char* data, std::size_t size,
+        Screen_buffer& screen);
+
+class Frame_recorder : public Frame_sink {
+public:
+    //Creates the file at path, throwing ui::Exception if it cannot. A
+    //  keyframe is written every keyframe_interval frames, and whenever the
+    //  screen changes size.
+    explicit Frame_recorder(const std::string& path,
+            int keyframe_interval=256);
+    //Writes the index.
+    ~Frame_recorder();
+    Frame_recorder(const Frame_recorder&) = delete;
+    Frame_recorder& operator=(const Frame_recorder&) = delete;
+
+    //Record screen as shown now, comparing it with the last frame added.
+    void add(const Screen_buffer& screen);
+    //Record screen as shown time_ms after the recording started (never
+    //  before the last frame).
+    void add(const Screen_buffer& screen, long time_ms);
+    //Record a frame shown now. Cannot be mixed with adding screens.
+    void add(Frame_encoder& frame) override;
+    //Write the index and close the file. Nothing more may be recorded.
+    void close();
+
+    long frames() const
+    {   return m_frames;    }
+    long keyframes() const
+    {   return m_index.size();  }
+    //Time of the last frame, in ms from the start.
+    long duration_ms() const
+    {   return m_last_time;  }
+    //Size of the file so far.
+    std::size_t bytes() const
+    {   return m_bytes; }
+    //At the rate the file has grown so far, 0 before a second is recorded.
+    double bytes_per_hour() const;
+private:
+    struct Index_entry {
+        std::uint64_t offset, frame, time;
+    };
+    struct Close_file {
+        void operator()(std::FILE* f) const
+        {   std::fclose(f); }
+    };
+    void add(Frame_encoder& frame, long time_ms);
+    void write(const unsigned char* data, std::size_t n);
+
+    std::unique_ptr<std::FILE,Close_file> m_file;
+    int m_keyframe_interval;
+    std::chrono::steady_clock::time_point m_start;
+    Frame_encoder m_encoder; //For screens added.
+    Screen_buffer m_last; //The last screen added.
+    std::vector<Index_entry> m_index;
+    long m_frames{0};
+    long m_last_time{0};
+    std::size_t m_bytes{0};
+};
+
+//Reads a recording made by Frame_recorder, a frame at a time.
+class Recording {
+public:
+    //Throws ui::Exception if path cannot be read or is not a recording.
+    explicit Recording(const std::string& path);
+
+    long frames() const
+    {   return m_frames;    }
+    long duration_ms() const
+    {   return m_duration;  }
+    //Size of the file.
+    long bytes() const
+    {   return m_size;  }
+    //Move to the next frame. Returns false, leaving the frame as it was, if
+    //  there are no more.
+    bool next();
+    //Move to frame n (clamped to those recorded).
+    void seek(long n);
+    //Move to the last frame shown at or before time_ms.
+    void seek_time(long time_ms);
+    //The current frame, -1 before the first.
+    long frame() const
+    {   return m_frame; }
+    //When the current frame was shown, in ms from the start.
+    long time_ms() const
+    {   return m_time;  }
+    const Screen_buffer& screen() const
+    {   return m_screen;    }
+private:
+    struct Index_entry {
+        long offset, frame, time;
+    };
+    struct Close_file {
+        void operator()(std::FILE* f) const
+        {   std::fclose(f); }
+    };
+    //Read the index from the footer, or by scanning the records.
+    void load_index();
+    //Read the record at the file position into m_record. Returns its kind,
+    //  or -1 at the end (or a record cut short).
+    int read_record();
+    //Move to the next frame if it was shown by until_time.
+    bool step(long until_time);
+    //Seek to a keyframe, before its frame.
+    void go_to(const Index_entry& e);
+
+    std::unique_ptr<std::FILE,Close_file> m_file;
+    std::vector<Index_entry> m_index;
+    std::vector<unsigned char> m_record;
+    long m_frames{0};
+    long m_duration{0};
+    long m_size{0};
+    long m_data_end{0}; //Offset of the index, or the end of the file.
+    long m_pos{0}; //Offset of the next record.
+    long m_record_size{0}; //Of the last record read, with its header.
+    long m_frame{-1};
+    long m_time{0};
+    Screen_buffer m_screen;
+};
+
+}
+#endif
@@ -0,0 +1,71 @@
+//Plays a recording made by ui::Display::record on the terminal.
+//  Usage: replay FILE [SPEED [START_SECONDS]]
+//  SPEED scales time (2 plays twice as fast), frames due at once being shown
+//  only as the last of them. Space pauses, Left and Right move 10 seconds
+//  back and forward, and q or Esc quits. The size of the recording per hour
+//  of play is reported once done.
+#include "ui.h"
+#include "backend.h"
+#include "recording.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char* argv[])
+try {
+    if(argc<2) {
+        std::cerr<<"Usage: "<<argv[0]<<" FILE [SPEED [START_SECONDS]]\n";
+        return 2;
+    }
+    ui::Recording rec{argv[1]};
+    double speed = argc>2? std::atof(argv[2]) : 1;
+    if(speed<=0)
+        speed = 1;
+    const long start_ms = argc>3? std::atof(argv[3])*1000 : 0;
+    {
+        using Clock = std::chrono::steady_clock;
+        ui::Display d{std::make_unique<ui::Ansi_backend>()};
+        //Recorded time shown at wall time start.
+        long base_ms = start_ms;
+        auto start = Clock::now();
+        bool paused = false;
+        long shown = -1;
+        while(true) {
+            std::chrono::duration<double,std::milli> t = Clock::now()-start;
+            const long now_ms = paused? base_ms : base_ms+t.count()*speed;
+            rec.seek_time(now_ms);
+            if(rec.frame()!=shown) {
+                d.show_screen(rec.screen());
+                shown = rec.frame();
+            }
+            if(not paused and now_ms>=rec.duration_ms())
+                break;
+            ui::Key key;
+            if(not d.poll_key_event(key,1000/60))
+                continue;
+            if(key==ui::Key{'q'} or key==ui::Key{27})
+                break;
+            if(key==ui::Key{' '} or key==ui::Key::left
+                    or key==ui::Key::right) {
+                base_ms = now_ms;
+                start = Clock::now();
+                if(key==ui::Key{' '})
+                    paused = not paused;
+                else
+                    base_ms = std::max(0L,base_ms+(key==ui::Key::left?
+                                -10000 : 10000));
+            }
+        }
+    }
+    const double hours = rec.duration_ms()/3600000.0;
+    std::cerr<<rec.frames()<<" frames over "<<rec.duration_ms()/1000.0
+        <<"s";
+    if(hours>0)
+        std::cerr<<", "<<rec.bytes()/hours/1e6<<" MB per hour";
+    std::cerr<<'\n';
+}
+catch (std::exception& e) {
+    std::cerr<<e.what()<<'\n';
+    return 1;
+}
@@ -0,0 +1,42 @@
+//Watches a program showing its frames with ui::Display::spectate.
+//  Usage: spectate SOCKET
+//  Frames are shown as they arrive, those arriving together only as the
+//  last of them. q or Esc quits.
+#include "ui.h"
+#include "backend.h"
+#include "spectator.h"
+#include <iostream>
+#include <poll.h>
+
+int main(int argc, char* argv[])
+try {
+    if(argc!=2) {
+        std::cerr<<"Usage: "<<argv[0]<<" SOCKET\n";
+        return 2;
+    }
+    ui::Spectator_client client{argv[1]};
+    bool open = true;
+    {
+        ui::Display d{std::make_unique<ui::Ansi_backend>()};
+        long shown = 0;
+        while(open) {
+            pollfd p{client.fd(),POLLIN,0};
+            ::poll(&p,1,1000/60);
+            open = client.receive();
+            if(client.frames()!=shown) {
+                d.show_screen(client.screen());
+                shown = client.frames();
+            }
+            ui::Key key;
+            if(d.poll_key_event(key,0)
+                    and (key==ui::Key{'q'} or key==ui::Key{27}))
+                break;
+        }
+    }
+    std::cerr<<client.frames()<<" frames, "<<client.keyframes()
+        <<" keyframes"<<(open? "" : ", the program watched has ended")<<'\n';
+}
+catch (std::exception& e) {
+    std::cerr<<e.what()<<'\n';
+    return 1;
+}
@@ -0,0 +1,252 @@
+#include "spectator.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace ui;
+
+namespace {
+
+sockaddr_un socket_address(const std::string& path, const char* who)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if(path.empty() or path.size()>=sizeof(addr.sun_path))
+        throw ui::Exception{std::string{who}+": Bad socket path "+path+"."};
+    std::memcpy(addr.sun_path,path.c_str(),path.size()+1);
+    return addr;
+}
+
+}
+
+Spectator_server::Spectator_server(const std::string& path,
+        std::size_t max_queued)
+    :m_path{path}, m_fd{-1}, m_max_queued{max_queued},
+    m_start{std::chrono::steady_clock::now()},
+    m_header{std::make_shared<std::vector<unsigned char>>(
+            std::begin(recording_header),std::end(recording_header))}
+{
+    const sockaddr_un addr = socket_address(path,"Spectator_server");
+    struct stat st;
+    if(lstat(path.c_str(),&st)==0) {
+        if(not S_ISSOCK(st.st_mode))
+            throw ui::Exception{"Spectator_server: "+path
+                +" exists and is not a socket."};
+        unlink(path.c_str());
+    }
+    m_fd = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+    if(m_fd<0)
+        throw ui::Exception{"Spectator_server: Unable to create a socket."};
+    if(bind(m_fd,reinterpret_cast<const sockaddr*>(&addr),sizeof(addr))!=0
+            or listen(m_fd,SOMAXCONN)!=0) {
+        close(m_fd);
+        throw ui::Exception{"Spectator_server: Unable to listen on "+path+"."};
+    }
+}
+Spectator_server::~Spectator_server()
+{
+    for(auto& v : m_viewers)
+        close(v.fd);
+    close(m_fd);
+    unlink(m_path.c_str());
+}
+void Spectator_server::add(Frame_encoder& frame)
+{
+    accept_viewers();
+    std::chrono::duration<double,std::milli> t =
+        std::chrono::steady_clock::now()-m_start;
+    const long time = std::max(long(t.count()),m_last_time);
+    //Encoded when first needed, then shared by every viewer.
+    Record delta, key;
+    std::vector<bool> closed(m_viewers.size());
+    for(std::size_t i=0; i<m_viewers.size(); ++i) {
+        Viewer& v = m_viewers[i];
+        if(not send(v)) {
+            closed[i] = true;
+            continue;
+        }
+        if(v.queued>m_max_queued) {
+            //Keep the record being sent, as it has been started.
+            v.queue.erase(v.queue.begin()+(v.offset>0),v.queue.end());
+            v.queued = v.queue.empty()? 0 : v.queue.front()->size()-v.offset;
+            v.needs_keyframe = true;
+            ++m_drops;
+        }
+        if(v.needs_keyframe or not frame.has_delta()) {
+            if(not key)
+                key = make_record(true,time,frame.keyframe(),
+                        frame.keyframe_size());
+            queue(v,key);
+            v.needs_keyframe = false;
+            ++m_keyframes_sent;
+        }
+        else {
+            if(not delta)
+                delta = make_record(false,time-m_last_time,frame.delta(),
+                        frame.delta_size());
+            queue(v,delta);
+        }
+        closed[i] = not send(v);
+    }
+    remove_closed(closed);
+    m_last_time = time;
+    ++m_frames;
+}
+void Spectator_server::poll()
+{
+    accept_viewers();
+    std::vector<bool> closed(m_viewers.size());
+    for(std::size_t i=0; i<m_viewers.size(); ++i)
+        closed[i] = not send(m_viewers[i]);
+    remove_closed(closed);
+}
+void Spectator_server::poll(Frame_encoder& last)
+{
+    accept_viewers();
+    Record key;
+    std::vector<bool> closed(m_viewers.size());
+    for(std::size_t i=0; i<m_viewers.size(); ++i) {
+        Viewer& v = m_viewers[i];
+        if(v.needs_keyframe and last.keyframe_size()>0) {
+            //Shown at the time of the last frame, so the times of the
+            //  frames after it are as for every other viewer.
+            if(not key)
+                key = make_record(true,m_last_time,last.keyframe(),
+                        last.keyframe_size());
+            queue(v,key);
+            v.needs_keyframe = false;
+            ++m_keyframes_sent;
+        }
+        closed[i] = not send(v);
+    }
+    remove_closed(closed);
+}
+void Spectator_server::accept_viewers()
+{
+    while(true) {
+        const int fd = accept4(m_fd,nullptr,nullptr,
+                SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if(fd<0) {
+            if(errno==EINTR or errno==ECONNABORTED)
+                continue;
+            return; //None waiting, or out of file descriptors.
+        }
+        m_viewers.push_back(Viewer{fd});
+        queue(m_viewers.back(),m_header);
+    }
+}
+void Spectator_server::queue(Viewer& v, const Record& r)
+{
+    v.queue.push_back(r);
+    v.queued += r->size();
+}
+bool Spectator_server::send(Viewer& v)
+{
+    while(not v.queue.empty()) {
+        const std::vector<unsigned char>& r = *v.queue.front();
+        const ssize_t n = ::send(v.fd,r.data()+v.offset,r.size()-v.offset,
+                MSG_NOSIGNAL|MSG_DONTWAIT);
+        if(n<0) {
+            if(errno==EINTR)
+                continue;
+            return errno==EAGAIN or errno==EWOULDBLOCK;
+        }
+        v.offset += n;
+        v.queued -= n;
+        m_bytes_sent += n;
+        if(v.offset==r.size()) {
+            v.queue.pop_front();
+            v.offset = 0;
+        }
+    }
+    return true;
+}
+void Spectator_server::remove_closed(const std::vector<bool>& closed)
+{
+    std::size_t kept = 0;
+    for(std::size_t i=0; i<m_viewers.size(); ++i) {
+        if(closed[i])
+            close(m_viewers[i].fd);
+        else if(kept++!=i)
+            m_viewers[kept-1] = std::move(m_viewers[i]);
+    }
+    m_viewers.resize(kept,Viewer{-1});
+}
+Spectator_server::Record Spectator_server::make_record(bool key, long time,
+        const unsigned char* data, std::size_t size) const
+{
+    auto r = std::make_shared<std::vector<unsigned char>>(
+            max_record_header+size);
+    const std::size_t header_size = write_record_header(r->data(),key,time,
+            size);
+    std::copy(data,data+size,r->data()+header_size);
+    r->resize(header_size+size);
+    return r;
+}
+
+Spectator_client::Spectator_client(const std::string& path)
+{
+    const sockaddr_un addr = socket_address(path,"Spectator_client");
+    m_fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+    if(m_fd<0)
+        throw ui::Exception{"Spectator_client: Unable to create a socket."};
+    if(connect(m_fd,reinterpret_cast<const sockaddr*>(&addr),sizeof(addr))!=0
+            or fcntl(m_fd,F_SETFL,fcntl(m_fd,F_GETFL)|O_NONBLOCK)!=0) {
+        close(m_fd);
+        throw ui::Exception{"Spectator_client: Unable to connect to "+path
+            +"."};
+    }
+}
+Spectator_client::~Spectator_client()
+{
+    close(m_fd);
+}
+bool Spectator_client::receive()
+{
+    bool open = true;
+    while(true) {
+        unsigned char chunk[16*1024];
+        const ssize_t n = read(m_fd,chunk,sizeof(chunk));
+        if(n>0) {
+            m_buffer.insert(m_buffer.end(),chunk,chunk+n);
+            continue;
+        }
+        if(n<0 and errno==EINTR)
+            continue;
+        open = n<0 and (errno==EAGAIN or errno==EWOULDBLOCK);
+        break;
+    }
+    decode();
+    return open;
+}
+void Spectator_client::decode()
+{
+    const unsigned char* p = m_buffer.data();
+    const unsigned char* const end = p+m_buffer.size();
+    if(not m_header_read) {
+        if(end-p<long(sizeof(recording_header)))
+            return;
+        if(std::memcmp(p,recording_header,sizeof(recording_header))!=0)
+            throw ui::Exception{"Spectator_client: Not sent a recording."};
+        p += sizeof(recording_header);
+        m_header_read = true;
+    }
+    int kind;
+    std::size_t size;
+    while(const std::size_t header = read_record_header(p,end-p,kind,size)) {
+        if(std::size_t(end-p)<header+size)
+            break;
+        if(kind!=0 and m_keyframes==0)
+            throw ui::Exception{"Spectator_client: Frame without a keyframe."};
+        const long time = decode_frame(kind,p+header,size,m_screen);
+        m_time = kind==0? time : m_time+time;
+        m_keyframes += kind==0;
+        ++m_frames;
+        p += header+size;
+    }
+    m_buffer.erase(m_buffer.begin(),m_buffer.begin()+(p-m_buffer.data()));
+}
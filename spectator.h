@@ -0,0 +1,129 @@
+//Watching a Display from other processes. A Spectator_server, given the
+//  frames a Display shows (see Display::spectate), sends them to every
+//  viewer connected to a Unix domain socket, in the format of a recording
+//  without its index (see recording.h). Each frame's changes are encoded
+//  once and the same bytes queued for every viewer. Sending never blocks:
+//  a viewer that falls too far behind has what is queued for it dropped,
+//  and is sent a keyframe of the whole screen once it catches up.
+#ifndef UI_SPECTATOR_H
+#define UI_SPECTATOR_H
+#include "recording.h"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ui {
+
+class Spectator_server : public Frame_sink {
+public:
+    //Listens on a socket created at path, replacing any socket there.
+    //  Throws ui::Exception if it cannot. A viewer with more than
+    //  max_queued bytes waiting to be sent falls back to keyframes.
+    explicit Spectator_server(const std::string& path,
+            std::size_t max_queued=256*1024);
+    //Disconnects the viewers and removes the socket.
+    ~Spectator_server();
+    Spectator_server(const Spectator_server&) = delete;
+    Spectator_server& operator=(const Spectator_server&) = delete;
+
+    //Accept new viewers, then queue and send the frame to each.
+    void add(Frame_encoder& frame) override;
+    //Accept new viewers and send what is queued. Done by add(), so only
+    //  needed while no frames are shown. New viewers see nothing until the
+    //  next frame.
+    void poll();
+    //As poll(), sending viewers waiting for a keyframe one of last.
+    void poll(Frame_encoder& last) override;
+
+    int viewers() const
+    {   return m_viewers.size();    }
+    long frames() const
+    {   return m_frames;    }
+    //Frames sent as keyframes to a viewer, as it was new or behind.
+    long keyframes_sent() const
+    {   return m_keyframes_sent;    }
+    //Times a viewer had what was queued for it dropped.
+    long drops() const
+    {   return m_drops; }
+    //To all viewers.
+    std::size_t bytes_sent() const
+    {   return m_bytes_sent;    }
+private:
+    //A record encoded once, and queued for any number of viewers.
+    using Record = std::shared_ptr<const std::vector<unsigned char>>;
+    struct Viewer {
+        explicit Viewer(int fd)
+            :fd{fd} {}
+        int fd;
+        std::deque<Record> queue;
+        std::size_t offset{0}; //Sent of the first record queued.
+        std::size_t queued{0}; //Bytes waiting to be sent.
+        bool needs_keyframe{true};
+    };
+    void accept_viewers();
+    void queue(Viewer& v, const Record& r);
+    //Send what v's socket will take. Returns false if v has gone.
+    bool send(Viewer& v);
+    //Drop the viewers that have gone.
+    void remove_closed(const std::vector<bool>& closed);
+    Record make_record(bool key, long time, const unsigned char* data,
+            std::size_t size) const;
+
+    std::string m_path;
+    int m_fd;
+    std::size_t m_max_queued;
+    std::chrono::steady_clock::time_point m_start;
+    Record m_header; //Sent to every viewer first.
+    std::vector<Viewer> m_viewers;
+    long m_last_time{0};
+    long m_frames{0};
+    long m_keyframes_sent{0};
+    long m_drops{0};
+    std::size_t m_bytes_sent{0};
+};
+
+//A viewer of a Spectator_server, decoding the frames it sends.
+class Spectator_client {
+public:
+    //Connects to the server listening at path, throwing ui::Exception if
+    //  it cannot.
+    explicit Spectator_client(const std::string& path);
+    ~Spectator_client();
+    Spectator_client(const Spectator_client&) = delete;
+    Spectator_client& operator=(const Spectator_client&) = delete;
+
+    //Read what has been sent without waiting, decoding every whole frame.
+    //  Returns false once the server has gone. Throws ui::Exception if
+    //  what is sent is not frames.
+    bool receive();
+    //To wait on (say with poll) for more to receive.
+    int fd() const
+    {   return m_fd;    }
+    //Decoded so far.
+    long frames() const
+    {   return m_frames;    }
+    long keyframes() const
+    {   return m_keyframes; }
+    //When the last frame was shown, in ms from the server starting.
+    long time_ms() const
+    {   return m_time;  }
+    //As of the last frame.
+    const Screen_buffer& screen() const
+    {   return m_screen;    }
+private:
+    //Decode the whole frames in m_buffer, keeping the rest.
+    void decode();
+
+    int m_fd;
+    std::vector<unsigned char> m_buffer; //Received, not yet decoded.
+    bool m_header_read{false};
+    Screen_buffer m_screen;
+    long m_frames{0};
+    long m_keyframes{0};
+    long m_time{0};
+};
+
+}
+#endif
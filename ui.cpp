@@ -1,160 +1,1269 @@
 #include "ui.h"
+#include "backend.h"
+#include "recording.h"
+#include "spectator.h"
 #include "utf8.h"
-#include <ncurses.h>
 #include <algorithm>
-#include <locale>
-#include <codecvt>
+#include <atomic>
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <thread>
+#include <semaphore.h>
 using namespace ui;
 
-//Convert std::string to std::wstring.
-static std::wstring_convert<std::codecvt_utf8<wchar_t>,wchar_t> utf8_wchar;
+//Convert UTF-8 to std::wstring.
+inline static std::wstring to_wide(utf8::string_ref s) {
+    std::wstring res;
+    utf8::decode(s,res);
+    return res;
+}
 
-//Generate ncurses attribute for a colour.
-inline static int colour_attrib(Colour c) {
-    int c_no = static_cast<int>(c);
-    //Relies on (for the first 8 colours) that the integer value of the enum is
-    //  the same as the colour pair number in ncurses.
-    if(c_no<9)
-        return COLOR_PAIR(c_no);
-    else if(c_no<17)
-        return COLOR_PAIR(c_no-8)|A_BOLD;
-    else
-        throw ui::Exception{"ui: Unsupported colour found ("+std::to_string(c_no)+")."};
+//Number of bytes needed to encode ch as UTF-8.
+inline static int utf8_length(wchar_t ch) {
+    if(ch<0x80)
+        return 1;
+    else if(ch<0x800)
+        return 2;
+    else if(ch<0x10000)
+        return 3;
+    return 4;
 }
 
-Display::Display()
+#ifdef UI_FRAME_PROFILE
+static std::atomic<long> allocations{0};
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept
+{
+    allocations.fetch_add(1,std::memory_order_relaxed);
+    return std::malloc(n? n : 1);
+}
+void* operator new(std::size_t n)
+{
+    if(void* p = operator new(n,std::nothrow))
+        return p;
+    throw std::bad_alloc{};
+}
+void* operator new[](std::size_t n)
+{
+    return operator new(n);
+}
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept
+{
+    return operator new(n,std::nothrow);
+}
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept
 {
-    setlocale(LC_ALL, ""); //Set locale.
-    int res;
-    initscr();
-    if(res==ERR)
-        throw ui::Exception{"Unable to initialise ncurses"};
-    try {
-        res = cbreak();
-        if(res==ERR)
-            throw ui::Exception{"Unable to initialise ncurses: cbreak"};
-        res = keypad(stdscr, TRUE);
-        if(res==ERR)
-            throw ui::Exception{"Unable to initialise ncurses: keypad"};
-        res = noecho();
-        if(res==ERR)
-            throw ui::Exception{"Unable to initialise ncurses: noecho"};
-        res = set_escdelay(25);
-        if(res==ERR)
-            throw ui::Exception{"Unable to initialise ncurses: esc delay."};
-        use_default_colors();
-        res = start_color(); //Setup all colors.
-        if(res==ERR)
-            throw ui::Exception{"Unable to initialise ncurses with colors."};
-        for(int i=0; i<8; ++i)
-            //Value of i+1 is same as the value for the colour in the enum.
-            init_pair(i+1,i,-1);
-    }
-    catch(...) {
-        endwin();
-        throw;
+    std::free(p);
+}
+long ui::allocation_count()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+//Adds the time from its construction to its destruction to us, if on.
+class Profile_timer {
+public:
+    Profile_timer(bool on, double& us)
+        : m_us{on? &us : nullptr}
+    {
+        if(m_us)
+            m_start = std::chrono::steady_clock::now();
+    }
+    ~Profile_timer()
+    {
+        if(m_us)
+            *m_us += std::chrono::duration<double,std::micro>(
+                    std::chrono::steady_clock::now()-m_start).count();
     }
+    Profile_timer(const Profile_timer&) = delete;
+    Profile_timer& operator=(const Profile_timer&) = delete;
+private:
+    double* m_us;
+    std::chrono::steady_clock::time_point m_start;
+};
+//Instrumentation of Display, only compiled in with UI_FRAME_PROFILE.
+#define UI_PROFILE(...) __VA_ARGS__
+#define UI_PROFILE_TIME(field) Profile_timer profile_timer{ \
+    m_profiler.m_enabled,m_profiler.m_frame.field}
+#else
+long ui::allocation_count()
+{
+    return 0;
 }
-Display::~Display()
+#define UI_PROFILE(...)
+#define UI_PROFILE_TIME(field)
+#endif
+
+void Screen_buffer::resize(int height, int width)
 {
-    //Close curses.
-    endwin();
+    if(height<0 or width<0)
+        throw Bad_dimensions{"Screen_buffer::resize: Negative height/width."};
+    m_height = height;
+    m_width = width;
+    m_cells.assign(m_height*m_width,Cell{});
 }
-void Display::queue_message(const std::string msg)
+void Screen_buffer::fill(const Cell& c)
 {
-    messages.push_back(utf8_wchar.from_bytes(msg));
+    std::fill(m_cells.begin(),m_cells.end(),c);
 }
-void Display::show_changes()
+int Screen_buffer::put(int x, int y, const std::wstring& s, Attrib attrib)
 {
-    clear();
-    int width{0}, height{0};
-    getmaxyx(stdscr,height,width); //MACRO, see ncurses documentation.
-    show_message(width);
-    m_status_bar.refresh(0,height-1,1,width);
-    m_level_view.refresh(0,1,height-2,width);
-    if(m_show_overlay)
-        m_list_overlay.refresh(0,0,height-1,width);
-    ::refresh();
+    for(wchar_t ch : s)
+        put(x++,y,ch,attrib);
+    return x;
 }
-void Display::show_message(int width)
+void Screen_buffer::clear_to_eol(int x, int y)
 {
-    static const std::wstring more_text = L" --More--";
-    static const std::wstring ellipse = L"...";
-    if(not messages.empty()) {
-        if(messages[0].size()+more_text.size()>width) {
-            auto current_msg = messages[0];
-            int max_ch = width-more_text.size()-ellipse.size();
-            messages[0] = current_msg.substr(0,max_ch)+ellipse;
-            messages.insert(messages.begin()+1,current_msg.substr(max_ch));
+    for(; x<m_width; ++x)
+        put(x,y,L' ');
+}
+
+namespace {
+//The columns of the profiles Frame_profiler writes, one of us or count set.
+struct Profile_field {
+    const char* name;
+    double Frame_profile::* us;
+    long Frame_profile::* count;
+};
+const Profile_field profile_fields[]{
+    {"total_us",&Frame_profile::total_us,nullptr},
+    {"message_us",&Frame_profile::message_us,nullptr},
+    {"status_us",&Frame_profile::status_us,nullptr},
+    {"level_us",&Frame_profile::level_us,nullptr},
+    {"overlay_us",&Frame_profile::overlay_us,nullptr},
+    {"output_us",&Frame_profile::output_us,nullptr},
+    {"cells_visited",nullptr,&Frame_profile::cells_visited},
+    {"cells_emitted",nullptr,&Frame_profile::cells_emitted},
+    {"attrib_changes",nullptr,&Frame_profile::attrib_changes},
+    {"text_bytes",nullptr,&Frame_profile::text_bytes},
+    {"terminal_bytes",nullptr,&Frame_profile::terminal_bytes},
+    {"allocations",nullptr,&Frame_profile::allocations}
+};
+}
+
+Frame_profiler::Frame_profiler(std::size_t window)
+    : m_window_size{std::max<std::size_t>(window,1)}
+{}
+void Frame_profiler::dump_to(const std::string& path)
+{
+    m_dump.reset();
+    if(path.empty())
+        return;
+    const std::string json_ext = ".json";
+    const bool json = path.size()>=json_ext.size() and path.compare(
+            path.size()-json_ext.size(),json_ext.size(),json_ext)==0;
+    std::FILE* f = std::fopen(path.c_str(),"w");
+    if(not f)
+        throw ui::Exception{"Frame_profiler: Unable to create "+path+"."};
+    m_dump = std::unique_ptr<std::FILE,Close_dump>{f,Close_dump{json}};
+    m_dumped = 0;
+    if(json)
+        std::fputc('[',f);
+    else {
+        const char* sep = "";
+        for(const auto& field : profile_fields) {
+            std::fprintf(f,"%s%s",sep,field.name);
+            sep = ",";
         }
-        if(messages.size()>1)
-            messages[0] += more_text;
-        addwstr(messages[0].data());
+        std::fputc('\n',f);
     }
 }
-std::string Display::get_key()
+void Frame_profiler::clear()
 {
-    static_assert(KEY_MIN>255, "Unable to read UTF-8 input (if any)");
-    int ch = getch();
-    if(ch>127 and ch<=255) { //If part of a UTF-8 multi-byte sequence.
-        //Read UTF-8 input.
-        std::string res{static_cast<char>(ch)};
-        int mb_size = utf8::offset_next(res[0]);
-        for(int i=1; i<mb_size; ++i) {
-            res += static_cast<char>(getch());
+    m_last = Frame_profile{};
+    m_window.clear();
+    m_frames = 0;
+}
+void Frame_profiler::Close_dump::operator()(std::FILE* f) const
+{
+    if(json)
+        std::fputs("\n]\n",f);
+    std::fclose(f);
+}
+double Frame_profiler::percentile(std::vector<double>& values, double p)
+{
+    if(values.empty())
+        return 0;
+    //Nearest rank.
+    const double rank = std::ceil(p/100*values.size());
+    const std::size_t i = std::min<std::size_t>(std::max(rank,1.0),
+            values.size())-1;
+    std::nth_element(values.begin(),values.begin()+i,values.end());
+    return values[i];
+}
+void Frame_profiler::begin()
+{
+    m_frame = Frame_profile{};
+    m_start_allocations = allocation_count();
+    m_start = std::chrono::steady_clock::now();
+}
+void Frame_profiler::end(const Frame_stats& stats)
+{
+    m_frame.total_us = std::chrono::duration<double,std::micro>(
+            std::chrono::steady_clock::now()-m_start).count();
+    m_frame.allocations = allocation_count()-m_start_allocations;
+    m_frame.cells_visited = stats.visited;
+    m_frame.cells_emitted = stats.cells;
+    m_frame.attrib_changes = stats.attrib_changes;
+    m_frame.text_bytes = stats.text_bytes;
+    m_frame.terminal_bytes = stats.terminal_bytes;
+    add(m_frame);
+}
+void Frame_profiler::add(const Frame_profile& f)
+{
+    m_last = f;
+    if(m_window.size()<m_window_size)
+        m_window.push_back(f);
+    else
+        m_window[m_frames%m_window_size] = f;
+    ++m_frames;
+    if(not m_dump)
+        return;
+    std::FILE* out = m_dump.get();
+    const bool json = m_dump.get_deleter().json;
+    if(json)
+        std::fputs(m_dumped>0? ",\n{" : "\n{",out);
+    const char* sep = "";
+    for(const auto& field : profile_fields) {
+        if(json)
+            std::fprintf(out,"%s\"%s\":",sep,field.name);
+        else
+            std::fputs(sep,out);
+        if(field.us)
+            std::fprintf(out,"%.3f",f.*field.us);
+        else
+            std::fprintf(out,"%ld",f.*field.count);
+        sep = json? ", " : ",";
+    }
+    std::fputs(json? "}" : "\n",out);
+    ++m_dumped;
+}
+
+Message_log::Message_log(int max_pending, std::size_t history_bytes,
+        int max_history)
+{
+    if(max_pending<1 or history_bytes<1 or max_history<1)
+        throw ui::Exception{"Message_log: Capacities must be positive."};
+    m_pending.resize(max_pending);
+    m_arena.resize(history_bytes);
+    m_history.resize(max_history);
+}
+void Message_log::queue(utf8::string_ref msg)
+{
+    if(m_pending_count>0) { //Count a repeat of the last message.
+        Stored& last = m_history[(m_history_head+m_history_count-1)
+            %m_history.size()];
+        Pending& p = m_pending[(m_pending_head+m_pending_count-1)
+            %m_pending.size()];
+        bool repeat = last.length==msg.size() and utf8::string_ref{
+            &m_arena[last.pos%m_arena.size()],last.size}
+            ==utf8::string_ref{msg.data(),last.size};
+        if(repeat and last.size<last.length) {
+            //Only the start was kept, so compare all of it as pending.
+            std::wstring text;
+            utf8::decode(msg,text);
+            repeat = p.text.compare(0,p.length,text)==0;
+        }
+        if(repeat) {
+            ++last.count;
+            p.text.resize(p.length);
+            p.text += L" x";
+            p.text += std::to_wstring(++p.count);
+            return;
+        }
+    }
+    Pending& p = m_pending[(m_pending_head+m_pending_count)%m_pending.size()];
+    if(full()) {
+        m_pending_head = (m_pending_head+1)%m_pending.size();
+        --m_pending_count;
+    }
+    utf8::decode(msg,p.text);
+    p.length = p.text.size();
+    p.count = 1;
+    ++m_pending_count;
+
+    //Keep what fits of the text, starting it at the beginning of the arena
+    //  if it would run off the end.
+    std::size_t size = std::min(msg.size(),m_arena.size());
+    while(size<msg.size() and size>0 and (msg[size]&0xC0)==0x80)
+        --size;
+    const std::size_t at = m_arena_end%m_arena.size();
+    if(at+size>m_arena.size())
+        m_arena_end += m_arena.size()-at;
+    m_arena_end += size;
+    while(m_history_count>0 and (m_history_count==int(m_history.size())
+                or m_history[m_history_head].pos+m_arena.size()<m_arena_end)) {
+        m_history_head = (m_history_head+1)%m_history.size();
+        --m_history_count;
+    }
+    Stored& s = m_history[(m_history_head+m_history_count)%m_history.size()];
+    s.pos = m_arena_end-size;
+    s.size = size;
+    s.length = msg.size();
+    s.count = 1;
+    ++m_history_count;
+    std::copy(msg.begin(),msg.begin()+size,&m_arena[s.pos%m_arena.size()]);
+}
+void Message_log::pop()
+{
+    if(m_pending_count>0) {
+        m_pending_head = (m_pending_head+1)%m_pending.size();
+        --m_pending_count;
+    }
+}
+Message_log::Entry Message_log::history(int i) const
+{
+    if(i<0 or i>=m_history_count)
+        throw std::out_of_range{"Message_log::history: No such message."};
+    const Stored& s = m_history[(m_history_head+m_history_count-1-i)
+        %m_history.size()];
+    return Entry{utf8::string_ref{m_arena.data()+s.pos%m_arena.size(),s.size},
+        s.count};
+}
+
+Completion_index::Completion_index(const std::vector<std::string>& keys)
+{
+    for(const auto& k : keys)
+        add(k);
+}
+void Completion_index::add(utf8::string_ref key)
+{
+    if(key.empty())
+        return;
+    if(not utf8::valid(key))
+        throw std::runtime_error{"Completion_index::add: Badly formed UTF-8."};
+    if(m_arena.size()+key.size()>UINT32_MAX)
+        throw ui::Exception{"Completion_index::add: Too many keys."};
+    Key_range k{static_cast<std::uint32_t>(m_arena.size()),
+        static_cast<std::uint32_t>(key.size()),{}};
+    std::memcpy(k.start,key.data(),std::min(key.size(),sizeof k.start));
+    m_keys.push_back(k);
+    m_arena.append(key.data(),key.size());
+    m_sorted = false;
+}
+std::size_t Completion_index::size() const
+{
+    sort();
+    return m_keys.size();
+}
+utf8::string_ref Completion_index::key(std::size_t i) const
+{
+    sort();
+    return utf8::string_ref{m_arena.data()+m_keys[i].offset,m_keys[i].size};
+}
+void Completion_index::sort() const
+{
+    if(m_sorted)
+        return;
+    //By bytes, so a key sorts before those it is the start of.
+    const char* arena = m_arena.data();
+    auto less = [arena](const Key_range& a, const Key_range& b) {
+        int r = std::memcmp(arena+a.offset,arena+b.offset,
+                std::min(a.size,b.size));
+        return r<0 or (r==0 and a.size<b.size);
+    };
+    auto equal = [arena](const Key_range& a, const Key_range& b) {
+        return a.size==b.size
+            and std::memcmp(arena+a.offset,arena+b.offset,a.size)==0;
+    };
+    std::sort(m_keys.begin(),m_keys.end(),less);
+    m_keys.erase(std::unique(m_keys.begin(),m_keys.end(),equal),m_keys.end());
+    m_sorted = true;
+}
+
+Completion_index::Search::Search(const Completion_index& index)
+    :m_index{&index}
+{
+    m_steps.reserve(32);
+    m_text.reserve(64);
+    m_steps.push_back(Step{0,index.size(),0});
+}
+void Completion_index::Search::push(utf8::string_ref cp)
+{
+    const auto begin = m_index->m_keys.begin();
+    auto first = begin+m_steps.back().first;
+    auto last = begin+m_steps.back().last;
+    const char* arena = m_index->m_arena.data();
+    for(char c : cp) {
+        //The keys in the range share the text, so are sorted by the byte
+        //  after it (those without one first).
+        const std::size_t pos = m_text.size();
+        const int b = static_cast<unsigned char>(c);
+        auto byte_at = [arena,pos](const Key_range& k) {
+            if(k.size<=pos)
+                return -1;
+            return pos<sizeof k.start? int{k.start[pos]}
+                : static_cast<unsigned char>(arena[k.offset+pos]);
+        };
+        first = std::partition_point(first,last,[&](const Key_range& k) {
+            return byte_at(k)<b;
+        });
+        //There are usually few matches, so look for their end by doubling
+        //  the distance from first before the binary search.
+        auto matches = [&](const Key_range& k) {
+            return byte_at(k)==b;
+        };
+        std::size_t n = 1;
+        while(n<std::size_t(last-first) and matches(first[n]))
+            n *= 2;
+        last = std::partition_point(first+n/2,
+                first+std::min<std::size_t>(n,last-first),matches);
+        m_text += c;
+    }
+    m_steps.push_back(Step{std::size_t(first-begin),std::size_t(last-begin),
+            m_text.size()});
+}
+void Completion_index::Search::pop()
+{
+    if(m_steps.size()>1) {
+        m_steps.pop_back();
+        m_text.resize(m_steps.back().text_size);
+    }
+}
+
+//Draws the frames published by Display on a thread of its own.
+//  Frames are handed over in a triple buffer: Display fills one slot, this
+//  thread draws another, and the third holds the latest frame published.
+//  Each side swaps its slot with that one with an atomic exchange, so neither
+//  ever waits for the other, and a frame published before the last was
+//  drawn is replaced (dropped).
+class Display::Render_thread {
+public:
+    Render_thread(Backend& backend, Terminal terminal)
+        :m_backend(backend), m_terminal{std::move(terminal)},
+        m_height{backend.height()}, m_width{backend.width()}
+    {
+        if(sem_init(&m_ready,0,0)!=0)
+            throw ui::Exception{"Display: Unable to create render semaphore."};
+        m_thread = std::thread{&Render_thread::run,this};
+    }
+    ~Render_thread()
+    {
+        stop();
+        sem_destroy(&m_ready);
+    }
+    Render_thread(const Render_thread&) = delete;
+    Render_thread& operator=(const Render_thread&) = delete;
+
+    //Hand a copy of back, showing view, to the thread. Rethrows what stopped
+    //  the thread, if it failed.
+    void publish(const Screen_buffer& back, const Viewport& view, bool redraw)
+    {
+        if(m_failed)
+            std::rethrow_exception(m_error);
+        Frame& f = m_frames[m_write];
+        f.screen = back;
+        f.view = view;
+        f.number = ++m_published;
+        if(redraw) //Kept apart from the frame, which may be dropped.
+            m_redraw = true;
+        const int old = m_middle.exchange(m_write|fresh);
+        m_write = old&~fresh;
+        if(old&fresh) //Never drawn, and is now the slot to fill.
+            m_dropped.store(m_dropped.load()+1);
+        sem_post(&m_ready);
+    }
+    //Draw the last frame published, then stop the thread. Returns what is
+    //  on the terminal.
+    Terminal stop()
+    {
+        if(m_thread.joinable()) {
+            m_stop = true;
+            sem_post(&m_ready);
+            m_thread.join();
         }
+        return m_terminal;
+    }
+    //Have the thread poll the terminal's sinks (see Terminal::poll).
+    void poll()
+    {
+        m_poll = true;
+        sem_post(&m_ready);
+    }
+    //Wait for the last frame published to be drawn.
+    void wait()
+    {
+        while(m_drawn<m_published and not m_failed)
+            std::this_thread::sleep_for(std::chrono::microseconds{100});
+    }
+    //Of the last frame drawn.
+    Frame_stats stats() const
+    {
+        Frame_stats res;
+        res.cells = m_cells;
+        res.text_bytes = m_text_bytes;
+        res.terminal_bytes = m_terminal_bytes;
+        res.calls = m_calls;
+        res.visited = m_visited;
+        res.attrib_changes = m_attrib_changes;
         return res;
     }
+    //Size of the terminal when the last frame was drawn.
+    int height() const
+    {   return m_height;    }
+    int width() const
+    {   return m_width; }
+    long dropped() const
+    {   return m_dropped;   }
+private:
+    struct Frame {
+        Screen_buffer screen;
+        Viewport view;
+        long number{0};
+    };
+    static constexpr int fresh = 4; //Set on m_middle if not yet drawn.
+    void run()
+    {
+        try {
+            while(true) {
+                while(sem_wait(&m_ready)!=0 and errno==EINTR)
+                    ;
+                if(m_poll.exchange(false))
+                    m_terminal.poll();
+                draw_latest();
+                if(m_stop) { //Nothing is published after stopping.
+                    draw_latest();
+                    return;
+                }
+            }
+        }
+        catch(...) {
+            m_error = std::current_exception();
+            m_failed = true;
+        }
+    }
+    void draw_latest()
+    {
+        if(not (m_middle.load()&fresh))
+            return;
+        m_read = m_middle.exchange(m_read)&~fresh;
+        const Frame& f = m_frames[m_read];
+        const Frame_stats stats = m_terminal.flush(m_backend,f.screen,f.view,
+                m_redraw.exchange(false));
+        m_cells = stats.cells;
+        m_text_bytes = stats.text_bytes;
+        m_terminal_bytes = stats.terminal_bytes;
+        m_calls = stats.calls;
+        m_visited = stats.visited;
+        m_attrib_changes = stats.attrib_changes;
+        m_height = m_backend.height();
+        m_width = m_backend.width();
+        m_drawn = f.number;
+    }
+    Backend& m_backend;
+    Terminal m_terminal;
+    Frame m_frames[3];
+    int m_write{0}; //Slot being filled by Display.
+    int m_read{1}; //Slot being drawn.
+    std::atomic<int> m_middle{2};
+    std::atomic<bool> m_redraw{false}; //For the next frame drawn.
+    std::atomic<bool> m_poll{false}; //Whether to poll the sinks.
+    long m_published{0};
+    std::atomic<long> m_drawn{0}; //Number of the last frame drawn.
+    std::atomic<long> m_dropped{0};
+    std::atomic<int> m_cells{0}, m_calls{0};
+    std::atomic<int> m_visited{0}, m_attrib_changes{0};
+    std::atomic<std::size_t> m_text_bytes{0}, m_terminal_bytes{0};
+    std::atomic<int> m_height, m_width;
+    std::atomic<bool> m_stop{false}, m_failed{false};
+    std::exception_ptr m_error;
+    sem_t m_ready; //Posted when a frame is published or on stopping.
+    std::thread m_thread;
+};
+constexpr int Display::Render_thread::fresh;
+
+void Display::set_threaded(bool threaded)
+{
+    if(threaded==(m_render_thread!=nullptr))
+        return;
+    if(threaded) {
+        if(not m_backend->concurrent_input())
+            throw ui::Exception{"Display::set_threaded: The backend does not "
+                "allow input while another thread outputs."};
+        m_render_thread.reset(new Render_thread{*m_backend,
+                std::move(m_terminal)});
+    }
+    else {
+        m_terminal = m_render_thread->stop();
+        m_render_thread.reset();
+    }
+}
+void Display::wait_for_render()
+{
+    if(m_render_thread)
+        m_render_thread->wait();
+}
+long Display::frames_dropped() const
+{
+    return m_render_thread? m_render_thread->dropped() : 0;
+}
+
+Display::Display()
+    :Display{std::make_unique<Ncurses_backend>()}
+{
+}
+Display::Display(std::unique_ptr<Backend> backend)
+    :m_backend{std::move(backend)}
+{
+    if(not m_backend)
+        throw ui::Exception{"Display: No backend supplied."};
+}
+Display::~Display()
+{
+    m_render_thread.reset(); //It draws to m_backend.
+}
+Display::Display(Display&&) = default;
+Display& Display::operator=(Display&&) = default;
+std::string ui::key_name(Key k)
+{
+    if(k.modifiers()&Key::ctrl)
+        return std::string{'^'}+key_name(Key{k.code()});
     //Some special cases for neater names.
-    switch(ch) {
-    case '\n':
-        return "\n";
+    switch(k.code()) {
     case 27:
         return "Esc";
     case 127:
         return "Del";
-    case KEY_UP:
+    case Key::up:
         return "Up";
-    case KEY_DOWN:
+    case Key::down:
         return "Down";
-    case KEY_LEFT:
+    case Key::left:
         return "Left";
-    case KEY_RIGHT:
+    case Key::right:
         return "Right";
+    case Key::backspace:
+        return "Backspace";
+    case Key::delete_key:
+        return "Delete";
+    case Key::home:
+        return "Home";
+    case Key::end:
+        return "End";
+    case Key::page_up:
+        return "PageUp";
+    case Key::page_down:
+        return "PageDown";
+    case Key::insert:
+        return "Insert";
+    case Key::unknown:
+        return "Unknown";
     default:
-        return keyname(ch);
+        if(k.code()>=Key::f0)
+            return "F"+std::to_string(k.code()-Key::f0);
+        char bytes[4];
+        return std::string(bytes,utf8::encode(k.code(),bytes));
+    }
+}
+
+void Display::queue_message(utf8::string_ref msg)
+{
+    if(m_messages.full()) { //The message being shown is dropped.
+        m_message_offset = 0;
+        m_message_cut = std::wstring::npos;
+    }
+    m_messages.queue(msg);
+}
+void Display::next_message()
+{
+    if(m_message_cut!=std::wstring::npos)
+        m_message_offset = m_message_cut;
+    else {
+        m_messages.pop();
+        m_message_offset = 0;
+    }
+    m_message_cut = std::wstring::npos;
+}
+void Display::show_changes()
+{
+    UI_PROFILE(if(m_profiler.m_enabled) m_profiler.begin());
+    fit_terminal();
+    const int width{m_back.width()}, height{m_back.height()};
+    //Uncover what was under the overlay, blanking where no widget is.
+    if(m_overlay_drawn)
+        relayout();
+    {
+        UI_PROFILE_TIME(message_us);
+        show_message(width);
+        mark_rows(0,1);
+    }
+    {
+        UI_PROFILE_TIME(status_us);
+        if(m_status_bar.refresh(m_back,0,height-1,1,width))
+            mark_rows(height-1,height);
+    }
+    const Pane_rect level = place(m_level_rect);
+    //Scrolling moves whole rows, so only if no pane shares them.
+    bool scrollable = level.x==0 and level.width==width;
+    {
+        UI_PROFILE_TIME(level_us);
+        if(m_level_view.refresh(m_back,level.x,level.y,level.height,
+                    level.width))
+            mark_rows(level.y,level.y+level.height);
+        //The cursor stays at the focus of level_view().
+        const int cursor_x = m_back.cursor_x(), cursor_y = m_back.cursor_y();
+        for(auto& p : m_panes) {
+            const Pane_rect r = place(p.rect);
+            if(r.height==0 or r.width==0)
+                continue;
+            if(p.view->refresh(m_back,r.x,r.y,r.height,r.width))
+                mark_rows(r.y,r.y+r.height);
+            scrollable = scrollable and (r.y>=level.y+level.height
+                    or r.y+r.height<=level.y);
+        }
+        m_back.set_cursor(cursor_x,cursor_y);
+    }
+    m_back_view = scrollable? Viewport{level.y,level.y+level.height,
+        m_level_view.view_x(),m_level_view.view_y()} : Viewport{};
+    if(m_show_overlay) {
+        UI_PROFILE_TIME(overlay_us);
+        m_list_overlay.refresh(m_back,0,0,height-1,width);
+        mark_rows(0,height-1);
+    }
+    m_overlay_drawn = m_show_overlay;
+    {
+        UI_PROFILE_TIME(output_us);
+        present();
+    }
+    UI_PROFILE(if(m_profiler.m_enabled) m_profiler.end(m_frame_stats));
+}
+void Display::set_profiling(bool profile)
+{
+#ifdef UI_FRAME_PROFILE
+    m_profiler.m_enabled = profile;
+#else
+    (void)profile;
+#endif
+}
+void Display::fit_terminal()
+{
+    const int width = m_render_thread? m_render_thread->width()
+        : m_backend->width();
+    const int height = m_render_thread? m_render_thread->height()
+        : m_backend->height();
+    if(width!=m_back.width() or height!=m_back.height()) {
+        m_back.resize(height,width);
+        m_rows_changed.assign(height,1);
+        m_redraw = true;
+    }
+    if(m_redraw) {
+        m_level_view.invalidate();
+        m_status_bar.invalidate();
+        for(auto& p : m_panes)
+            p.view->invalidate();
+    }
+}
+void Display::present()
+{
+    if(m_render_thread) {
+        m_render_thread->publish(m_back,m_back_view,m_redraw);
+        m_frame_stats = m_render_thread->stats();
+    }
+    else
+        m_frame_stats = m_terminal.flush(*m_backend,m_back,m_back_view,
+                m_redraw,&m_rows_changed);
+    m_redraw = false;
+    std::fill(m_rows_changed.begin(),m_rows_changed.end(),0);
+}
+void Display::record(const std::string& path)
+{
+    //The render thread has the terminal, so stop it while changing that.
+    const bool was_threaded = threaded();
+    set_threaded(false);
+    m_recorder.reset();
+    if(not path.empty())
+        m_recorder = std::make_unique<Frame_recorder>(path);
+    set_sinks();
+    set_threaded(was_threaded);
+}
+void Display::spectate(const std::string& path)
+{
+    const bool was_threaded = threaded();
+    set_threaded(false);
+    m_spectators.reset();
+    if(not path.empty())
+        m_spectators = std::make_unique<Spectator_server>(path);
+    set_sinks();
+    set_threaded(was_threaded);
+}
+void Display::set_sinks()
+{
+    m_terminal.sinks.clear();
+    if(m_recorder)
+        m_terminal.sinks.push_back(m_recorder.get());
+    if(m_spectators)
+        m_terminal.sinks.push_back(m_spectators.get());
+    if(m_terminal.sinks.empty())
+        m_encoder.reset();
+    else if(not m_encoder)
+        m_encoder = std::make_unique<Frame_encoder>();
+    m_terminal.encoder = m_encoder.get();
+}
+void Display::poll_sinks()
+{
+    if(m_render_thread)
+        m_render_thread->poll();
+    else
+        m_terminal.poll();
+}
+void Display::show_screen(const Screen_buffer& screen)
+{
+    fit_terminal();
+    const int width = std::min(screen.width(),m_back.width());
+    for(int y=0; y<m_back.height(); ++y) {
+        int x = 0;
+        if(y<screen.height())
+            for(; x<width; ++x)
+                m_back.at(x,y) = screen.at(x,y);
+        m_back.clear_to_eol(x,y);
+    }
+    m_back.set_cursor(std::min(screen.cursor_x(),m_back.width()-1),
+            std::min(screen.cursor_y(),m_back.height()-1));
+    m_back_view = Viewport{};
+    //The widgets are drawn over it in full next time.
+    m_level_view.invalidate();
+    m_status_bar.invalidate();
+    for(auto& p : m_panes)
+        p.view->invalidate();
+    mark_rows(0,m_back.height());
+    present();
+}
+void Display::set_level_rect(const Pane_rect& rect)
+{
+    m_level_rect = rect;
+    relayout();
+}
+Level_view& Display::add_view(utf8::string_ref name, const Pane_rect& rect)
+{
+    for(const auto& p : m_panes)
+        if(p.name==name)
+            throw ui::Exception{"Display::add_view: A view named "
+                +name.str()+" has already been added."};
+    m_panes.push_back(Pane{name.str(),rect,std::make_unique<Level_view>()});
+    return *m_panes.back().view;
+}
+Level_view& Display::view(utf8::string_ref name)
+{
+    return *pane(name,"Display::view").view;
+}
+void Display::set_view_rect(utf8::string_ref name, const Pane_rect& rect)
+{
+    pane(name,"Display::set_view_rect").rect = rect;
+    relayout();
+}
+void Display::remove_view(utf8::string_ref name)
+{
+    Pane& p = pane(name,"Display::remove_view");
+    m_panes.erase(m_panes.begin()+(&p-m_panes.data()));
+    relayout();
+}
+Display::Pane& Display::pane(utf8::string_ref name, const char* who)
+{
+    for(auto& p : m_panes)
+        if(p.name==name)
+            return p;
+    throw ui::Exception{std::string{who}+": No view named "+name.str()+"."};
+}
+Pane_rect Display::place(const Pane_rect& rect) const
+{
+    const int height = m_back.height(), width = m_back.width();
+    const int x = rect.x<0? width+rect.x : rect.x;
+    const int y = rect.y<0? height+rect.y : rect.y;
+    const int right = rect.width>0? x+rect.width : width+rect.width;
+    const int bottom = rect.height>0? y+rect.height : height+rect.height;
+    Pane_rect r;
+    r.x = std::min(std::max(x,0),width);
+    r.y = std::min(std::max(y,0),height);
+    r.width = std::max(std::min(right,width)-r.x,0);
+    r.height = std::max(std::min(bottom,height)-r.y,0);
+    return r;
+}
+void Display::mark_rows(int top, int bottom)
+{
+    top = std::max(top,0);
+    bottom = std::min<int>(bottom,m_rows_changed.size());
+    if(top<bottom)
+        std::fill(m_rows_changed.begin()+top,m_rows_changed.begin()+bottom,1);
+}
+void Display::relayout()
+{
+    //Only what differs from the terminal is sent, so this costs the cells
+    //  that moved.
+    m_back.fill(Cell{});
+    mark_rows(0,m_back.height());
+    m_level_view.invalidate();
+    m_status_bar.invalidate();
+    for(auto& p : m_panes)
+        p.view->invalidate();
+}
+Frame_stats Display::Terminal::flush(Backend& backend,
+        const Screen_buffer& back, const Viewport& view, bool redraw,
+        const std::vector<char>* rows)
+{
+    Frame_stats stats;
+    const std::size_t bytes_sent = backend.bytes_sent();
+    if(front.width()!=back.width() or front.height()!=back.height()) {
+        front.resize(back.height(),back.width());
+        redraw = true;
+    }
+    if(redraw) {
+        //No cell on the screen is known, so every one differs from back.
+        front.fill(Cell{L'\0',-1});
+        backend.clear();
+        rows = nullptr;
+    }
+    if(encoder)
+        encoder->begin_frame();
+    auto compared = [&](int y) {
+        return not rows or (y<int(rows->size()) and (*rows)[y]);
+    };
+    //Rows are only scrolled if all of the view is being compared.
+    bool whole_view = view.top>=0 and view.top<view.bottom;
+    for(int y=view.top; whole_view and y<view.bottom; ++y)
+        whole_view = compared(y);
+    if(redraw)
+        front_view = view;
+    else if(whole_view and scroll(backend,view))
+        ++stats.calls;
+    Attrib attrib = 0;
+    backend.set_attrib(attrib);
+    for(int y=0; y<back.height(); ++y)
+        if(compared(y)) {
+            flush_row(backend,back,y,attrib,stats);
+            stats.visited += back.width();
+        }
+    backend.set_attrib(0);
+    backend.move(back.cursor_x(),back.cursor_y());
+    backend.flush();
+    stats.terminal_bytes = backend.bytes_sent()-bytes_sent;
+    if(encoder) {
+        front.set_cursor(back.cursor_x(),back.cursor_y());
+        encoder->end_frame(front);
+        for(auto sink : sinks)
+            sink->add(*encoder);
+    }
+    return stats;
+}
+void Display::Terminal::poll()
+{
+    if(not encoder)
+        return;
+    encoder->moved(front); //Which moves with the Terminal.
+    for(auto sink : sinks)
+        sink->poll(*encoder);
+}
+bool Display::Terminal::scroll(Backend& backend, const Viewport& view)
+{
+    const Viewport old = front_view;
+    front_view = view;
+    const int dy = view.y-old.y, rows = view.bottom-view.top;
+    if(dy==0 or view.x!=old.x or view.top!=old.top or view.bottom!=old.bottom
+            or std::abs(dy)>=rows or view.top<0 or view.bottom>front.height()
+            or front.width()==0 or not backend.scroll(view.top,view.bottom,dy))
+        return false;
+    //Move front's rows as the terminal's were, the uncovered ones unknown.
+    const int width = front.width();
+    auto row = [&](int y) {
+        return &front.at(0,y);
+    };
+    if(dy>0) {
+        for(int y=view.top; y<view.bottom-dy; ++y)
+            std::copy(row(y+dy),row(y+dy)+width,row(y));
+        for(int y=view.bottom-dy; y<view.bottom; ++y)
+            std::fill(row(y),row(y)+width,Cell{L'\0',-1});
+    }
+    else {
+        for(int y=view.bottom-1; y>=view.top-dy; --y)
+            std::copy(row(y+dy),row(y+dy)+width,row(y));
+        for(int y=view.top; y<view.top-dy; ++y)
+            std::fill(row(y),row(y)+width,Cell{L'\0',-1});
+    }
+    if(encoder)
+        encoder->scroll(view.top,view.bottom,dy);
+    return true;
+}
+void Display::Terminal::flush_row(Backend& backend, const Screen_buffer& back,
+        int y, Attrib& attrib, Frame_stats& stats)
+{
+    //Unchanged cells between changed ones are rewritten if there are fewer
+    //  than this, as that is cheaper than moving the cursor.
+    static const int max_gap = 4;
+    const int width = back.width();
+    int cursor_x = -1; //Where the last run left the cursor.
+    for(int x=0; x<width;) {
+        if(back.at(x,y)==front.at(x,y)) {
+            ++x;
+            continue;
+        }
+        //Extend the run over cells sharing its attribute, up to the last
+        //  changed one.
+        const Attrib run_attrib = back.at(x,y).attrib;
+        int end = x+1;
+        for(int i=end; i<width and i-end<max_gap
+                and back.at(i,y).attrib==run_attrib; ++i) {
+            if(back.at(i,y)!=front.at(i,y))
+                end = i+1;
+        }
+        run.clear();
+        for(int i=x; i<end; ++i) {
+            const Cell& c = back.at(i,y);
+            run += c.ch;
+            stats.text_bytes += utf8_length(c.ch);
+            front.at(i,y) = c;
+        }
+        if(cursor_x!=x) {
+            backend.move(x,y);
+            ++stats.calls;
+        }
+        if(run_attrib!=attrib) {
+            attrib = run_attrib;
+            backend.set_attrib(attrib);
+            ++stats.calls;
+            ++stats.attrib_changes;
+        }
+        backend.write(run.data(),run.size());
+        ++stats.calls;
+        if(encoder)
+            encoder->put(x,y,&back.at(x,y),end-x);
+        stats.cells += end-x;
+        cursor_x = x = end;
+    }
+}
+void Display::show_message(int width)
+{
+    static const std::wstring more_text = L" --More--";
+    static const std::wstring ellipse = L"...";
+    m_back.clear_to_eol(0,0);
+    m_message_cut = std::wstring::npos;
+    if(m_messages.pending()==0)
+        return;
+    //Show what is left of the first message, cutting it short if it will
+    //  not fit with the --More--.
+    const std::wstring& msg = m_messages.front();
+    std::size_t end = msg.size();
+    if(end-m_message_offset+more_text.size()>width) {
+        const int max_ch = width-more_text.size()-ellipse.size();
+        m_message_cut = end = m_message_offset+std::max(max_ch,1);
+    }
+    int x = 0;
+    for(std::size_t i=m_message_offset; i<end; ++i)
+        m_back.put(x++,0,msg[i]);
+    if(m_message_cut!=std::wstring::npos)
+        x = m_back.put(x,0,ellipse);
+    if(messages_count()>1)
+        m_back.put(x,0,more_text);
+}
+std::string Display::get_key()
+{
+    return key_name(get_key_event());
+}
+Key Display::get_key_event()
+{
+    return to_key(m_backend->read_key());
+}
+Key Display::to_key(int ch)
+{
+    static_assert(Key::unknown-Key::up==Backend::key_unknown-Backend::key_up,
+            "Key::Special and Backend::Key_code differ");
+    if(ch>127 and ch<=255) { //If part of a UTF-8 multi-byte sequence.
+        char bytes[4]{static_cast<char>(ch)};
+        if(not utf8::starts_code_point(bytes[0]))
+            return Key{};
+        const int mb_size = utf8::offset_next(bytes[0]);
+        for(int i=1; i<mb_size; ++i)
+            bytes[i] = static_cast<char>(m_backend->read_key());
+        char32_t cp;
+        try {
+            utf8::decode_next(bytes,mb_size,cp);
+        }
+        catch(std::runtime_error&) {
+            return Key{};
+        }
+        return Key{cp};
+    }
+    if(ch>=Backend::key_up)
+        return Key{Key::up+(ch-Backend::key_up)};
+    if(ch<32 and ch!='\n' and ch!=27) //Control characters.
+        return ctrl(ch+'@');
+    return Key(ch);
+}
+bool Display::poll_key_event(Key& key, int timeout_ms)
+{
+    //Only the first byte of a key is waited for.
+    int ch = m_backend->read_key(timeout_ms);
+    if(ch==Backend::key_resize)
+        m_resized = true;
+    if(ch==Backend::no_key or ch==Backend::key_resize)
+        return false;
+    key = to_key(ch);
+    return true;
+}
+void Display::run(const std::function<bool(Key)>& on_key, int max_fps)
+{
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    //While spectated, how often to wake to let viewers in and send them
+    //  what they are waiting for, as nothing else does between frames.
+    const int spectator_poll_ms = 50;
+    const Clock::duration frame_time = max_fps>0?
+        duration_cast<Clock::duration>(std::chrono::seconds{1})/max_fps
+        : Clock::duration{0};
+    Clock::time_point last_frame = Clock::now()-frame_time;
+    Clock::time_point first_key; //Time the keys not yet shown were read.
+    bool keys_read = false;
+    bool changed = true;
+    while(true) {
+        if(changed and Clock::now()-last_frame>=frame_time) {
+            show_changes();
+            last_frame = Clock::now();
+            changed = false;
+            if(keys_read) {
+                const double us = std::chrono::duration<double,std::micro>(
+                        last_frame-first_key).count();
+                auto& l = m_input_latency;
+                l.last_us = us;
+                l.max_us = std::max(l.max_us,us);
+                l.mean_us += (us-l.mean_us)/++l.frames;
+                keys_read = false;
+            }
+        }
+        //Wait for keys until the next frame or timer is due.
+        auto wake = changed? last_frame+frame_time : Clock::time_point::max();
+        for(const Timer& t : m_timers)
+            if(not t.removed)
+                wake = std::min(wake,t.due);
+        int timeout_ms = -1;
+        if(wake!=Clock::time_point::max()) {
+            auto us = duration_cast<microseconds>(wake-Clock::now()).count();
+            timeout_ms = std::max<long>(0,(us+999)/1000);
+        }
+        if(m_spectators and (timeout_ms<0 or timeout_ms>spectator_poll_ms))
+            timeout_ms = spectator_poll_ms;
+        Key key;
+        if(poll_key_event(key,timeout_ms)) {
+            if(not keys_read) {
+                first_key = Clock::now();
+                keys_read = true;
+            }
+            do {
+                if(not on_key(key))
+                    return;
+            } while(poll_key_event(key,0));
+            changed = true;
+        }
+        else if(m_spectators)
+            poll_sinks();
+        if(m_resized) {
+            m_resized = false;
+            changed = true;
+        }
+        if(run_timers())
+            changed = true;
+    }
+}
+int Display::add_timer(int interval_ms, std::function<bool()> f)
+{
+    if(interval_ms<=0)
+        throw ui::Exception{"Display::add_timer: Interval must be positive."};
+    const Clock::duration interval = std::chrono::milliseconds{interval_ms};
+    m_timers.push_back(Timer{m_next_timer_id,Clock::now()+interval,interval,
+            std::move(f),false});
+    return m_next_timer_id++;
+}
+void Display::remove_timer(int id)
+{
+    //Removed from the list by run_timers, as it may be running.
+    for(Timer& t : m_timers)
+        if(t.id==id)
+            t.removed = true;
+}
+bool Display::run_timers()
+{
+    bool ran = false;
+    const auto now = Clock::now();
+    for(auto t=m_timers.begin(); t!=m_timers.end();) {
+        if(not t->removed and t->due<=now) {
+            ran = true;
+            t->due += t->interval;
+            if(t->due<now) //Skip those missed rather than catch up.
+                t->due = now+t->interval;
+            if(not t->f())
+                t->removed = true;
+        }
+        if(t->removed)
+            t = m_timers.erase(t);
+        else
+            ++t;
     }
+    return ran;
 }
 std::string Display::get_answer(std::string msg)
 {
-    move(0,0);
-    clrtoeol();
-    std::wstring w_msg = utf8_wchar.from_bytes(msg);
-    addwstr(w_msg.data());
+    fit_terminal();
+    m_back.clear_to_eol(0,0);
+    int end = m_back.put(0,0,to_wide(msg));
+    m_back.set_cursor(end,0);
+    mark_rows(0,1);
+    present();
     return get_key();
 }
+void Display::put_answer(int x, const std::wstring& line, std::size_t typed,
+        int& end)
+{
+    //Skip the cells already showing the start of the line.
+    std::size_t i = 0;
+    for(; i<line.size() and x+int(i)<m_back.width(); ++i)
+        if(m_back.at(x+i,0)!=Cell{line[i],i<typed? 0 : attrib::dim})
+            break;
+    for(std::size_t j=i; j<line.size(); ++j)
+        m_back.put(x+j,0,line[j],j<typed? 0 : attrib::dim);
+    for(int j=x+line.size(); j<end; ++j)
+        m_back.put(j,0,L' ');
+    end = x+line.size();
+}
 std::string Display::get_long_answer(std::string prompt,
         std::function<std::string(std::string)> autocompleter)
 {
-    move(0,0);
-    clrtoeol();
-    addstr(prompt.data());
+    fit_terminal();
+    m_back.clear_to_eol(0,0);
+    const int prompt_end = m_back.put(0,0,to_wide(prompt));
     std::string res; //Typed text.
     std::string completed; //Autocompletion.
+    std::wstring line;
+    int end = prompt_end;
     while(true) {
-        move(0,prompt.size());
-        clrtoeol();
-        addstr(res.data());
-        if(not completed.empty()) {
-            auto more = completed.substr(res.size());
-            attron(A_DIM); //Have the completion more faded than the typed text.
-            addstr(more.data());
-            attroff(A_DIM);
-            move(0,prompt.size()+res.size()); //Curse before the completion.
-        }
-        int ch = getch();
-        if(ch==KEY_BACKSPACE or ch==KEY_DC or ch==127) {
+        //Only the cells that changed since the last keypress are output.
+        utf8::decode(completed.empty()? res : completed,line);
+        const std::size_t typed = utf8::size(res);
+        put_answer(prompt_end,line,typed,end);
+        m_back.set_cursor(prompt_end+typed,0); //Cursor before the completion.
+        mark_rows(0,1);
+        present();
+        int ch = m_backend->read_key();
+        if(ch==Backend::key_backspace or ch==Backend::key_delete or ch==127) {
             //Find the start of the last code point and erase the last UTF-8
             //code point.
             for(int i=res.size()-1; i>=0; --i) {
@@ -175,7 +1284,7 @@ std::string Display::get_long_answer(std::string prompt,
             res += static_cast<char>(ch);
             auto offset = utf8::offset_next(static_cast<char>(ch));
             for(int i=1; i<offset; ++i) //Get the rest of the code-point.
-                res += static_cast<char>(getch());
+                res += static_cast<char>(m_backend->read_key());
             if(autocompleter) {
                 completed = autocompleter(res);
                 if(completed.find(res)!=0)
@@ -185,52 +1294,603 @@ std::string Display::get_long_answer(std::string prompt,
     }
     return completed.empty()?res:completed;
 }
+std::string Display::get_long_answer(const std::string& prompt,
+        const Completion_index& index)
+{
+    fit_terminal();
+    m_back.clear_to_eol(0,0);
+    const int prompt_end = m_back.put(0,0,to_wide(prompt));
+    Completion_index::Search search{index};
+    std::size_t shown = 0; //Match shown.
+    bool cycled = false; //Show a match before anything is typed.
+    std::wstring line;
+    int end = prompt_end;
+    while(true) {
+        const bool matched = search.count()>0
+            and (search.size()>0 or cycled);
+        utf8::decode(matched? search.match(shown) : search.text(),line);
+        put_answer(prompt_end,line,search.size(),end);
+        m_back.set_cursor(prompt_end+search.size(),0);
+        mark_rows(0,1);
+        present();
+        const Key key = get_key_event();
+        if(key=='\n')
+            return matched? search.match(shown).str() : search.text();
+        else if(key==Key::backspace or key==Key::delete_key or key==127) {
+            search.pop();
+            shown = 0;
+        }
+        else if(key==ctrl('i') or key==Key::down or key==Key::up) { //Tab.
+            if(search.count()>0) {
+                const std::size_t n = search.count();
+                //The first cycles to the first match.
+                if(cycled or search.size()>0)
+                    shown = (key==Key::up? shown+n-1 : shown+1)%n;
+                cycled = true;
+            }
+        }
+        else if(key==Key::right) {
+            if(matched) { //Type the rest of the match.
+                const utf8::string_ref match = search.match(shown);
+                for(std::size_t i=search.text().size(); i<match.size();) {
+                    const std::size_t n = utf8::offset_next(match[i]);
+                    search.push(utf8::string_ref{match.data()+i,n});
+                    i += n;
+                }
+                shown = 0; //The shortest match, so the one taken.
+            }
+        }
+        else if(not key.special() and not key.modifiers() and key.code()>=32) {
+            char bytes[4];
+            search.push(utf8::string_ref{bytes,
+                    std::size_t(utf8::encode(key.code(),bytes))});
+            shown = 0;
+        }
+    }
+}
+
+constexpr int Level_view::tile_size;
+constexpr Level_view::Packed_cell Level_view::blank;
+constexpr int Level_view::ascii_colours;
+constexpr Level_view::Packed_cell Level_view::not_interned;
+constexpr Level_view::Packed_cell Level_view::extended;
 
+void Level_view::resize(int height, int width)
+{
+    if(height<0 or width<0)
+        throw Bad_dimensions{
+            "Level_view::resize: Negative height/width supplied."};
+    const int tiles_x = (width+tile_size-1)/tile_size;
+    const int tiles_y = (height+tile_size-1)/tile_size;
+    std::vector<Tile> tiles(static_cast<std::size_t>(tiles_x)*tiles_y);
+    for(int ty=0; ty<std::min(tiles_y,m_tiles_y); ++ty)
+        for(int tx=0; tx<std::min(tiles_x,m_tiles_x); ++tx) {
+            const int old_index = ty*m_tiles_x+tx;
+            Tile& t = m_tiles[old_index];
+            //Blank what is now outside the level on the edge tiles.
+            const int max_x = std::min(width-tx*tile_size,tile_size);
+            const int max_y = std::min(height-ty*tile_size,tile_size);
+            if((max_x<tile_size or max_y<tile_size) and load_tile(old_index)) {
+                for(int y=0; y<tile_size; ++y)
+                    for(int x=y<max_y? max_x : 0; x<tile_size; ++x)
+                        t.cells[y*tile_size+x] = blank;
+                t.changed = true;
+            }
+            tiles[ty*tiles_x+tx] = std::move(t);
+            t = Tile{};
+        }
+    for(const Tile& t : m_tiles) //Those dropped.
+        if(t.slot>=0)
+            m_free_slots.push_back(t.slot);
+    m_tiles = std::move(tiles);
+    m_tiles_x = tiles_x;
+    m_tiles_y = tiles_y;
+    m_width = width;
+    m_height = height;
+    m_resident.clear();
+    for(int i=0; i<m_tiles.size(); ++i)
+        if(not m_tiles[i].cells.empty())
+            m_resident.push_back(i);
+    //Drop layer and extended cells outside the level.
+    auto drop_outside = [&](std::unordered_map<std::uint64_t,Cell>& cells) {
+        for(auto p=cells.begin(); p!=cells.end();) {
+            if(static_cast<std::uint32_t>(p->first)>=width
+                    or (p->first>>32)>=height)
+                p = cells.erase(p);
+            else
+                ++p;
+        }
+    };
+    for(auto& l : m_layers)
+        drop_outside(l.cells);
+    drop_outside(m_extended);
+    evict_tiles();
+    invalidate();
+}
 void Level_view::resize(const std::vector<std::string>& grid)
 {
     int max_len = 0;
     for(const auto& s : grid)
-        if(utf8::size(s)>max_len)
-            max_len = s.size();
+        max_len = std::max<int>(max_len,utf8::size(s));
     resize(grid.size(),max_len);
 }
 void Level_view::render(const std::vector<std::string>& grid)
 {
     for(int y=0; y<grid.size(); ++y) {
-        int line_start = y*m_width;
-        std::wstring ln = utf8_wchar.from_bytes(grid[y].data());
-        for(int x=0; x<ln.size(); ++x) {
-            m_grid.at(line_start+x) = ln[x];
-            m_attribs.at(line_start+x) = 0;
+        const char* p = grid[y].data();
+        const char* end = p+grid[y].size();
+        for(int x=0; p<end; ++x) {
+            char32_t cp;
+            p += utf8::decode_next(p,end-p,cp);
+            set_cell(x,y,intern(cp,0));
         }
     }
 }
 void Level_view::render(int x, int y, char ch, Colour c)
 {
-    wchar_t wch = utf8_wchar.from_bytes(ch)[0];
-    render(x,y,wch,c);
+    char32_t cp;
+    utf8::decode_next(&ch,1,cp);
+    render(x,y,static_cast<wchar_t>(cp),c);
 }
-void Level_view::render(int x, int y, const std::string& ch, Colour c)
+void Level_view::render(int x, int y, utf8::string_ref ch, Colour c)
 {
-    if(utf8::size(ch)>1)
-        throw ui::Exception{"Too long std::string for Level_view::render (required length is 1)."};
-    wchar_t wch = utf8_wchar.from_bytes(ch)[0];
-    render(x,y,wch,c);
+    char32_t cp;
+    if(ch.empty() or utf8::decode_next(ch.data(),ch.size(),cp)!=ch.size())
+        throw ui::Exception{"Level_view::render: Not a single code point (required length is 1)."};
+    render(x,y,static_cast<wchar_t>(cp),c);
 }
 void Level_view::render(int x, int y, wchar_t ch, Colour c)
 {
-    int position = y*m_width+x;
-    m_grid.at(position) = ch;
-    m_attribs.at(position) = colour_attrib(c);
+    set_cell(x,y,intern(ch,colour_attrib(c)));
+}
+void Level_view::render(int x, int y, wchar_t ch, Attrib a)
+{
+    if(not (a&(attrib::fg_mask|attrib::bg_mask))) {
+        set_cell(x,y,intern(ch,a));
+        return;
+    }
+    set_cell(x,y,extended);
+    m_extended[position_key(x,y)] = Cell{ch,a};
+}
+void Level_view::render(int x, int y, const char32_t* row, int n, Colour c)
+{
+    if(x<0 or y<0 or n<0 or y>=m_height or x+n>m_width)
+        throw std::out_of_range{"Level_view::render: Row outside the level."};
+    const Attrib attrib = colour_attrib(c);
+    while(n>0) { //The part in each tile.
+        const int index = tile_index(x,y);
+        const int len = std::min(n,tile_size-x%tile_size);
+        Tile& t = m_tiles[index];
+        if(t.cells.empty() and not load_tile(index)) {
+            const bool blank_run = attrib==0 and std::all_of(row,row+len,
+                    [](char32_t ch) { return ch==U' '; });
+            if(not blank_run)
+                allocate_tile(index);
+        }
+        if(not t.cells.empty()) {
+            Packed_cell* cells = t.cells.data()+y%tile_size*tile_size
+                +x%tile_size;
+            for(int i=0; i<len; ++i) {
+                cells[i] = intern(row[i],attrib);
+                mark_dirty(x+i,y);
+            }
+            t.changed = true;
+            evict_tiles(index);
+        }
+        x += len;
+        row += len;
+        n -= len;
+    }
+}
+namespace {
+
+//Access to entities however they are laid out.
+struct Entity_records {
+    const Entity* e;
+    int x(std::size_t i) const
+    {   return e[i].x;  }
+    int y(std::size_t i) const
+    {   return e[i].y;  }
+    char32_t glyph(std::size_t i) const
+    {   return e[i].glyph;  }
+    Colour colour(std::size_t i) const
+    {   return e[i].colour; }
+};
+struct Entity_columns {
+    const Entity_arrays& e;
+    int x(std::size_t i) const
+    {   return e.x[i];  }
+    int y(std::size_t i) const
+    {   return e.y[i];  }
+    char32_t glyph(std::size_t i) const
+    {   return e.glyph[i];  }
+    Colour colour(std::size_t i) const
+    {   return e.colour? e.colour[i] : Colour::normal;  }
+};
+
+}
+
+void Level_view::render(const Entity* entities, std::size_t n)
+{
+    render_entities(Entity_records{entities},n);
+}
+void Level_view::render(const Entity_arrays& entities)
+{
+    render_entities(Entity_columns{entities},entities.n);
+}
+void Level_view::render(Layer l, const Entity* entities, std::size_t n)
+{
+    render_entities(layer_data(l),Entity_records{entities},n);
+}
+void Level_view::render(Layer l, const Entity_arrays& entities)
+{
+    render_entities(layer_data(l),Entity_columns{entities},entities.n);
+}
+template<class Entities>
+void Level_view::check_entities(const Entities& e, std::size_t n) const
+{
+    //One pass with no early exit, so it vectorises.
+    bool ok = true;
+    for(std::size_t i=0; i<n; ++i) {
+        ok &= static_cast<unsigned>(e.x(i))<static_cast<unsigned>(m_width)
+            and static_cast<unsigned>(e.y(i))<static_cast<unsigned>(m_height)
+            and e.glyph(i)<=0x10FFFF and is_colour(e.colour(i));
+    }
+    if(ok)
+        return;
+    for(std::size_t i=0; i<n; ++i) {
+        if(not is_colour(e.colour(i)))
+            throw ui::Exception{"ui: Unsupported colour found ("
+                +std::to_string(static_cast<int>(e.colour(i)))+")."};
+        if(e.glyph(i)>0x10FFFF)
+            throw ui::Exception{"Level_view::render: Entity glyph is not a code point."};
+    }
+    throw std::out_of_range{"Level_view::render: Entity outside the level."};
+}
+template<class Entities>
+void Level_view::render_entities(const Entities& e, std::size_t n)
+{
+    check_entities(e,n);
+    //Palette entries of the glyph and colour pairs in this batch, as there
+    //  are normally only a few.
+    struct Cached {
+        char32_t glyph;
+        Colour colour;
+        Packed_cell cell;
+    };
+    Cached cache[64];
+    for(auto& c : cache)
+        c.glyph = 0xFFFFFFFF; //Not a code point.
+    //The tile of each entity, and its cell with its offset in the tile.
+    m_batch_tiles.resize(n);
+    m_batch_cells.resize(n);
+    for(std::size_t i=0; i<n; ++i) {
+        const int x = e.x(i), y = e.y(i);
+        const char32_t glyph = e.glyph(i);
+        const Colour colour = e.colour(i);
+        Cached& c = cache[(glyph*7+static_cast<int>(colour))%64];
+        if(c.glyph!=glyph or c.colour!=colour)
+            c = Cached{glyph,colour,intern(glyph,colour_attrib(colour))};
+        m_batch_tiles[i] = tile_index(x,y);
+        m_batch_cells[i] = static_cast<std::uint32_t>(
+                y%tile_size*tile_size+x%tile_size)<<16 | c.cell;
+        mark_dirty(x,y);
+    }
+    auto write = [this](int index, const std::uint32_t* cell,
+            const std::uint32_t* end) {
+        if(not load_tile(index))
+            allocate_tile(index);
+        Tile& t = m_tiles[index];
+        for(; cell<end; ++cell) {
+            Packed_cell& c = t.cells[*cell>>16];
+            if(c==extended) { //No longer needed, as set_cell finds.
+                const int offset = *cell>>16;
+                m_extended.erase(position_key(
+                            index%m_tiles_x*tile_size+offset%tile_size,
+                            index/m_tiles_x*tile_size+offset/tile_size));
+            }
+            c = *cell&0xFFFF;
+        }
+        t.changed = true;
+        evict_tiles(index);
+    };
+    //With a big level (or one partly on disk), visit each tile once by
+    //  (stable) counting sort on tile, if there are not too many tiles.
+    if((m_max_tiles>0 or m_tiles.size()>=256) and m_tiles.size()<=4*n) {
+        m_batch_counts.assign(m_tiles.size()+1,0);
+        for(std::size_t i=0; i<n; ++i)
+            ++m_batch_counts[m_batch_tiles[i]+1];
+        for(std::size_t t=1; t<m_batch_counts.size(); ++t)
+            m_batch_counts[t] += m_batch_counts[t-1];
+        m_batch_sorted.resize(n);
+        for(std::size_t i=0; i<n; ++i)
+            m_batch_sorted[m_batch_counts[m_batch_tiles[i]]++] = m_batch_cells[i];
+        //Each count is now the end of its tile's cells.
+        std::uint32_t start = 0;
+        for(std::size_t t=0; t<m_tiles.size(); ++t) {
+            const std::uint32_t end = m_batch_counts[t];
+            if(end>start)
+                write(t,&m_batch_sorted[start],m_batch_sorted.data()+end);
+            start = end;
+        }
+        return;
+    }
+    for(std::size_t i=0; i<n;) { //Runs in the same tile.
+        std::size_t end = i+1;
+        while(end<n and m_batch_tiles[end]==m_batch_tiles[i])
+            ++end;
+        write(m_batch_tiles[i],&m_batch_cells[i],m_batch_cells.data()+end);
+        i = end;
+    }
+}
+template<class Entities>
+void Level_view::render_entities(Layer_data& l, const Entities& e,
+        std::size_t n)
+{
+    check_entities(e,n);
+    l.cells.reserve(l.cells.size()+n);
+    for(std::size_t i=0; i<n; ++i) {
+        const int x = e.x(i), y = e.y(i);
+        l.cells[position_key(x,y)] = Cell{static_cast<wchar_t>(e.glyph(i)),
+            colour_attrib(e.colour(i))};
+        mark_layer_dirty(l,x,y);
+    }
+}
+Cell Level_view::at(int x, int y)
+{
+    if(x<0 or y<0 or x>=m_width or y>=m_height)
+        throw std::out_of_range{"Level_view::at: Position outside the level."};
+    const int index = tile_index(x,y);
+    const Packed_cell* cells = load_tile(index);
+    Cell res = unpack(cells? cells[y%tile_size*tile_size+x%tile_size] : blank,
+            x,y);
+    evict_tiles(index);
+    return res;
+}
+void Level_view::set_cell(int x, int y, Packed_cell c)
+{
+    if(x<0 or y<0 or x>=m_width or y>=m_height)
+        throw std::out_of_range{"Level_view::render: Position outside the level."};
+    const int index = tile_index(x,y);
+    Tile& t = m_tiles[index];
+    if(t.cells.empty() and not load_tile(index)) {
+        if(c==blank)
+            return; //Unallocated tiles are already blank.
+        allocate_tile(index);
+    }
+    Packed_cell& cell = t.cells[y%tile_size*tile_size+x%tile_size];
+    if(cell==extended and c!=extended)
+        m_extended.erase(position_key(x,y));
+    cell = c;
+    t.changed = true;
+    mark_dirty(x,y);
+    evict_tiles(index);
+}
+Level_view::Layer Level_view::add_layer(utf8::string_ref name, int z)
+{
+    for(const auto& l : m_layers)
+        if(l.name==name)
+            throw ui::Exception{"Level_view::add_layer: Layer "+name.str()
+                +" already exists."};
+    m_layers.push_back(Layer_data{name.str(),z,{},{}});
+    const int index = m_layers.size()-1;
+    //After those with the same z, so it is drawn over them.
+    auto pos = std::find_if(m_layer_order.begin(),m_layer_order.end(),
+            [&](int i) { return m_layers[i].z<=z; });
+    m_layer_order.insert(pos,index);
+    invalidate();
+    return Layer{index};
+}
+Level_view::Layer Level_view::layer(utf8::string_ref name) const
+{
+    for(int i=0; i<m_layers.size(); ++i)
+        if(m_layers[i].name==name)
+            return Layer{i};
+    throw ui::Exception{"Level_view::layer: No layer called "+name.str()+"."};
+}
+Level_view::Layer_data& Level_view::layer_data(Layer l)
+{
+    if(l.index<0 or l.index>=m_layers.size())
+        throw ui::Exception{"Level_view: Unknown layer."};
+    return m_layers[l.index];
+}
+void Level_view::render(Layer l, int x, int y, char ch, Colour c)
+{
+    char32_t cp;
+    utf8::decode_next(&ch,1,cp);
+    render(l,x,y,static_cast<wchar_t>(cp),c);
+}
+void Level_view::render(Layer l, int x, int y, utf8::string_ref ch, Colour c)
+{
+    char32_t cp;
+    if(ch.empty() or utf8::decode_next(ch.data(),ch.size(),cp)!=ch.size())
+        throw ui::Exception{"Level_view::render: Not a single code point (required length is 1)."};
+    render(l,x,y,static_cast<wchar_t>(cp),c);
+}
+void Level_view::render(Layer l, int x, int y, wchar_t ch, Colour c)
+{
+    render(l,x,y,ch,colour_attrib(c));
+}
+void Level_view::render(Layer l, int x, int y, wchar_t ch, Attrib a)
+{
+    if(x<0 or y<0 or x>=m_width or y>=m_height)
+        throw std::out_of_range{"Level_view::render: Position outside the level."};
+    Layer_data& data = layer_data(l);
+    data.cells[position_key(x,y)] = Cell{ch,a};
+    mark_layer_dirty(data,x,y);
+}
+void Level_view::erase(Layer l, int x, int y)
+{
+    Layer_data& data = layer_data(l);
+    if(data.cells.erase(position_key(x,y))>0)
+        mark_layer_dirty(data,x,y);
+}
+void Level_view::clear(Layer l)
+{
+    Layer_data& data = layer_data(l);
+    for(const auto& p : data.cells)
+        mark_layer_dirty(data,static_cast<std::uint32_t>(p.first),p.first>>32);
+    data.cells.clear();
+}
+Cell Level_view::composite(int x, int y)
+{
+    if(not m_layer_order.empty()) {
+        const std::uint64_t key = position_key(x,y);
+        for(int i : m_layer_order) {
+            auto p = m_layers[i].cells.find(key);
+            if(p!=m_layers[i].cells.end())
+                return p->second;
+        }
+    }
+    const Packed_cell* cells = load_tile(tile_index(x,y));
+    return unpack(cells? cells[y%tile_size*tile_size+x%tile_size] : blank,
+            x,y);
 }
 void Level_view::clear()
 {
-    for(int i=0; i<m_grid.size(); ++i) {
-        m_grid[i] = ' ';
-        m_attribs[i] = 0;
+    m_tiles.assign(m_tiles.size(),Tile{});
+    m_resident.clear();
+    m_free_slots.clear();
+    m_store_slots = 0;
+    //Nothing uses the rest of the palette now.
+    m_palette.resize(1);
+    m_palette_index.clear();
+    m_ascii_index.clear();
+    m_extended.clear();
+    invalidate();
+}
+void Level_view::set_backing_store(const std::string& path, int max_tiles)
+{
+    if(max_tiles<1)
+        throw ui::Exception{"Level_view::set_backing_store: At least one tile must be kept in memory."};
+    //Anything stored in the old one is needed first.
+    for(int i=0; i<m_tiles.size(); ++i)
+        if(m_tiles[i].slot>=0) {
+            load_tile(i);
+            m_tiles[i].slot = -1;
+            m_tiles[i].changed = true;
+        }
+    m_store.reset(path.empty()? std::tmpfile()
+            : std::fopen(path.c_str(),"w+b"));
+    if(not m_store)
+        throw ui::Exception{"Level_view::set_backing_store: Unable to open "
+            +(path.empty()? std::string{"temporary file"} : path)+"."};
+    m_free_slots.clear();
+    m_store_slots = 0;
+    m_max_tiles = max_tiles;
+    evict_tiles();
+}
+const Level_view::Packed_cell* Level_view::load_tile(int index)
+{
+    Tile& t = m_tiles[index];
+    if(not t.cells.empty())
+        return t.cells.data();
+    if(t.slot<0)
+        return nullptr;
+    t.cells.resize(tile_size*tile_size);
+    const std::size_t bytes = t.cells.size()*sizeof(Packed_cell);
+    if(std::fseek(m_store.get(),t.slot*bytes,SEEK_SET)!=0
+            or std::fread(t.cells.data(),1,bytes,m_store.get())!=bytes)
+        throw ui::Exception{"Level_view: Unable to read from the backing store."};
+    t.changed = false;
+    m_resident.push_back(index);
+    return t.cells.data();
+}
+void Level_view::allocate_tile(int index)
+{
+    m_tiles[index].cells.assign(tile_size*tile_size,blank);
+    m_resident.push_back(index);
+}
+void Level_view::evict_tiles(int keep)
+{
+    if(m_max_tiles==0)
+        return;
+    const int focus_tx = focus_x/tile_size, focus_ty = focus_y/tile_size;
+    //The tiles last refreshed (they are likely to be drawn again).
+    const bool has_view = m_last_view[4]>0 and m_last_view[5]>0;
+    const int view_tx0 = m_last_view[0]/tile_size;
+    const int view_ty0 = m_last_view[1]/tile_size;
+    const int view_tx1 = (m_last_view[0]+m_last_view[5]-1)/tile_size;
+    const int view_ty1 = (m_last_view[1]+m_last_view[4]-1)/tile_size;
+    while(m_resident.size()>m_max_tiles) {
+        //Furthest from the focus first.
+        int furthest = -1, max_distance = -1;
+        for(int i=0; i<m_resident.size(); ++i) {
+            const int index = m_resident[i];
+            const int tx = index%m_tiles_x, ty = index/m_tiles_x;
+            if(index==keep or (has_view and tx>=view_tx0 and tx<=view_tx1
+                        and ty>=view_ty0 and ty<=view_ty1))
+                continue;
+            const int distance = std::max(std::abs(tx-focus_tx),
+                    std::abs(ty-focus_ty));
+            if(distance>max_distance) {
+                max_distance = distance;
+                furthest = i;
+            }
+        }
+        if(furthest<0)
+            return; //Everything left is needed.
+        Tile& t = m_tiles[m_resident[furthest]];
+        if(t.changed or t.slot<0) {
+            if(t.slot<0) {
+                if(m_free_slots.empty())
+                    t.slot = m_store_slots++;
+                else {
+                    t.slot = m_free_slots.back();
+                    m_free_slots.pop_back();
+                }
+            }
+            const std::size_t bytes = t.cells.size()*sizeof(Packed_cell);
+            if(std::fseek(m_store.get(),t.slot*bytes,SEEK_SET)!=0
+                    or std::fwrite(t.cells.data(),1,bytes,m_store.get())!=bytes)
+                throw ui::Exception{"Level_view: Unable to write to the backing store."};
+        }
+        std::vector<Packed_cell>{}.swap(t.cells); //Release the memory.
+        m_resident[furthest] = m_resident.back();
+        m_resident.pop_back();
+    }
+}
+Level_view::Packed_cell Level_view::intern_new(wchar_t ch, Attrib attrib)
+{
+    const bool ascii = ch>=0 and ch<0x80 and attrib>=0 and attrib<ascii_colours;
+    if(ascii) {
+        if(m_ascii_index.empty())
+            m_ascii_index.assign(0x80*ascii_colours,not_interned);
+        Packed_cell p = m_ascii_index[ch*ascii_colours+attrib];
+        if(p!=not_interned)
+            return p;
     }
+    const Cell key{ch,attrib};
+    Packed_cell p;
+    auto it = m_palette_index.find(key);
+    if(it!=m_palette_index.end())
+        p = it->second;
+    else if(ch==L' ' and attrib==0)
+        p = blank;
+    else {
+        if(m_palette.size()>=extended)
+            throw ui::Exception{"Level_view: Too many different glyph and colour combinations."};
+        p = m_palette.size();
+        m_palette.push_back(Cell{ch,attrib});
+        m_palette_index.emplace(key,p);
+    }
+    if(ascii)
+        m_ascii_index[ch*ascii_colours+attrib] = p;
+    return p;
+}
+std::size_t Level_view::memory_used() const
+{
+    //Approximate for the hash table, as its nodes are not visible.
+    return m_resident.size()*tile_size*tile_size*sizeof(Packed_cell)
+        +m_tiles.capacity()*sizeof(Tile)
+        +m_palette.capacity()*sizeof(Cell)
+        +m_palette_index.size()*(sizeof(Cell)+sizeof(Packed_cell)
+                +2*sizeof(void*))
+        +m_ascii_index.capacity()*sizeof(Packed_cell)
+        +m_extended.size()*(sizeof(std::uint64_t)+sizeof(Cell)
+                +2*sizeof(void*));
 }
-void Level_view::refresh(int screen_min_x,
+bool Level_view::refresh(Screen_buffer& screen, int screen_min_x,
         int screen_min_y, int height, int width)
 {
     if(screen_min_x<0 or screen_min_y<0 or height<0 or width<0)
@@ -250,132 +1910,275 @@ void Level_view::refresh(int screen_min_x,
     }
     int max_x{std::min(start_x+width,m_width)};
     int max_y{std::min(start_y+height,m_height)};
-    for(int y=start_y; y<max_y; ++y) {
-        const int screen_y = y-start_y+screen_min_y;
-        move(screen_y,screen_min_x);
-        for(int x=start_x; x<max_x; ++x) {
-            int position = y*m_width+x;
-            attron(m_attribs[position]);
-            //Place UTF-8 character on the screen.
-            cchar_t c{};
-            c.chars[0] = m_grid[position];
-            add_wch(&c);
-            attroff(m_attribs[position]);
+    const int view[6]{start_x,start_y,screen_min_x,screen_min_y,height,width};
+    if(not std::equal(view,view+6,m_last_view)) {
+        std::copy(view,view+6,m_last_view);
+        invalidate();
+    }
+    bool drew = m_all_dirty or not m_dirty.empty();
+    if(m_all_dirty) {
+        //Blank the whole area, as the level may not cover it.
+        for(int y=0; y<height; ++y)
+            for(int x=0; x<width; ++x)
+                screen.put(x+screen_min_x,y+screen_min_y,L' ');
+        for(int y=start_y; y<max_y; ++y) {
+            const int screen_y = y-start_y+screen_min_y;
+            for(int x=start_x; x<max_x;) {
+                const int tile_end = std::min(max_x,(x/tile_size+1)*tile_size);
+                const Packed_cell* cells = load_tile(tile_index(x,y));
+                if(not cells) { //Never rendered to, so blank.
+                    x = tile_end;
+                    continue;
+                }
+                const Packed_cell* row = cells+y%tile_size*tile_size;
+                for(; x<tile_end; ++x) {
+                    const Cell& c = unpack(row[x%tile_size],x,y);
+                    screen.put(x-start_x+screen_min_x,screen_y,c.ch,c.attrib);
+                }
+            }
+        }
+        //Then each layer over it, lowest first.
+        const std::size_t view_size = std::size_t(max_x-start_x)*(max_y-start_y);
+        for(auto i=m_layer_order.rbegin(); i!=m_layer_order.rend(); ++i) {
+            const Layer_data& l = m_layers[*i];
+            if(l.cells.size()<view_size) {
+                for(const auto& p : l.cells) {
+                    const int x = static_cast<std::uint32_t>(p.first);
+                    const int y = p.first>>32;
+                    if(x>=start_x and x<max_x and y>=start_y and y<max_y)
+                        screen.put(x-start_x+screen_min_x,
+                                y-start_y+screen_min_y,p.second.ch,
+                                p.second.attrib);
+                }
+            }
+            else { //Fewer to look up by position.
+                for(int y=start_y; y<max_y; ++y)
+                    for(int x=start_x; x<max_x; ++x) {
+                        auto p = l.cells.find(position_key(x,y));
+                        if(p!=l.cells.end())
+                            screen.put(x-start_x+screen_min_x,
+                                    y-start_y+screen_min_y,p->second.ch,
+                                    p->second.attrib);
+                    }
+            }
+        }
+    }
+    else {
+        for(int position : m_dirty) {
+            int x = start_x+position%width, y = start_y+position/width;
+            const Cell c = composite(x,y);
+            screen.put(x-start_x+screen_min_x,y-start_y+screen_min_y,
+                    c.ch,c.attrib);
+        }
+        for(const auto& l : m_layers) {
+            drew = drew or not l.dirty.empty();
+            for(std::uint64_t key : l.dirty) {
+                const int x = static_cast<std::uint32_t>(key);
+                const int y = key>>32;
+                const Cell c = composite(x,y);
+                screen.put(x-start_x+screen_min_x,y-start_y+screen_min_y,
+                        c.ch,c.attrib);
+            }
         }
     }
-    move(focus_y-start_y+screen_min_y,focus_x-start_x+screen_min_x);
+    m_dirty.clear();
+    for(auto& l : m_layers)
+        l.dirty.clear();
+    m_all_dirty = false;
+    if(m_max_tiles>0 and max_x>start_x and max_y>start_y) {
+        //Read back stored tiles next to the view, as it may scroll to them.
+        const int min_tx = std::max(start_x/tile_size-1,0);
+        const int min_ty = std::max(start_y/tile_size-1,0);
+        const int max_tx = std::min((max_x-1)/tile_size+1,m_tiles_x-1);
+        const int max_ty = std::min((max_y-1)/tile_size+1,m_tiles_y-1);
+        for(int ty=min_ty; ty<=max_ty; ++ty)
+            for(int tx=min_tx; tx<=max_tx; ++tx)
+                load_tile(ty*m_tiles_x+tx);
+        evict_tiles();
+    }
+    screen.set_cursor(focus_x-start_x+screen_min_x,
+            focus_y-start_y+screen_min_y);
+    return drew;
 }
 
 
-void Status_bar::add(const std::string& name)
+Status_bar::Handle Status_bar::add(utf8::string_ref name)
+{
+    m_stats.push_back(Stat{name.str(),to_wide(name),{},0,-1,false});
+    m_changed = true;
+    return Handle{static_cast<int>(m_stats.size()-1)};
+}
+void Status_bar::set(Handle stat, utf8::string_ref value, Colour c)
 {
-    m_stats.push_back(Stat{});
-    m_stats.back().name = utf8_wchar.from_bytes(name);
-    m_stats.back().value_attrib = 0;
+    if(stat.index<0 or stat.index>=m_stats.size())
+        throw ui::Exception{"Unknown statistic being set on Status_bar."};
+    Stat& st = m_stats[stat.index];
+    const std::size_t old_size = st.value.size();
+    utf8::decode(value,st.value); //Reuses the storage of the old value.
+    st.value_attrib = colour_attrib(c);
+    if(st.value.size()!=old_size)
+        m_changed = true; //Moves the stats after it.
+    else if(not st.changed) {
+        st.changed = true;
+        m_changed_stats.push_back(stat.index);
+    }
 }
-void Status_bar::set(const std::string& name, const std::string& value,
-        Colour c)
+void Status_bar::set(utf8::string_ref name, utf8::string_ref value, Colour c)
 {
-    auto w_name = utf8_wchar.from_bytes(name);
     auto st = find_if(begin(m_stats),end(m_stats),
-            [&w_name](const Stat& s) { return s.name==w_name; });
+            [&name](const Stat& s) { return s.utf8_name==name; });
     if(st==m_stats.end())
         throw ui::Exception{"Unknown statistic being set on Status_bar."};
-    st->value = utf8_wchar.from_bytes(value);
-    st->value_attrib = colour_attrib(c);
+    set(Handle{static_cast<int>(st-m_stats.begin())},value,c);
 }
-void Status_bar::set_title(const std::string& title)
+void Status_bar::set_title(utf8::string_ref title)
 {
-    m_title = utf8_wchar.from_bytes(title);
+    utf8::decode(title,m_title);
+    m_changed = true;
 }
-void Status_bar::refresh(int x, int y, int height, int width)
+bool Status_bar::refresh(Screen_buffer& screen, int x, int y,
+        int height, int width)
 {
     if(x<0 or y<0 or height<0 or width<0)
         throw Bad_dimensions{"Status_bar::refresh: Bad dimensions supplied."};
+    const int layout[3]{x,y,width};
+    if(not m_changed and std::equal(layout,layout+3,m_layout)) {
+        //Only values that changed, which are in the same place.
+        bool drew = false;
+        for(int i : m_changed_stats) {
+            Stat& stat = m_stats[i];
+            if(stat.value_x>=0) {
+                screen.put(stat.value_x,y,stat.value,stat.value_attrib);
+                drew = true;
+            }
+            stat.changed = false;
+        }
+        m_changed_stats.clear();
+        return drew;
+    }
+    m_changed = false;
+    std::copy(layout,layout+3,m_layout);
+    for(int i : m_changed_stats)
+        m_stats[i].changed = false;
+    m_changed_stats.clear();
     static const std::wstring item_spacer{L"  "};
     static const std::wstring value_gap{L": "};
-    move(y,x);
-    clrtoeol();
+    screen.clear_to_eol(x,y);
     int pos = 0;
+    int screen_x = x;
     if(not m_title.empty() and m_title.size()<width) {
         pos += m_title.size()+item_spacer.size();
-        addwstr(m_title.data());
-        addwstr(item_spacer.data());
+        screen_x = screen.put(screen_x,y,m_title);
+        screen_x = screen.put(screen_x,y,item_spacer);
     }
-    for(const auto& stat : m_stats) {
+    for(auto& stat : m_stats)
+        stat.value_x = -1;
+    for(auto& stat : m_stats) {
         int new_pos = pos+stat.name.size()+value_gap.size()
             +stat.value.size()+item_spacer.size();
         if(new_pos>=width)
             break;
         pos = new_pos;
         //Insert text on screen.
-        addwstr(stat.name.data());
-        addwstr(value_gap.data());
-        attron(stat.value_attrib);
-        addwstr(stat.value.data());
-        attroff(stat.value_attrib);
-        addwstr(item_spacer.data());
+        screen_x = screen.put(screen_x,y,stat.name);
+        screen_x = screen.put(screen_x,y,value_gap);
+        stat.value_x = screen_x;
+        screen_x = screen.put(screen_x,y,stat.value,stat.value_attrib);
+        screen_x = screen.put(screen_x,y,item_spacer);
     }
+    return true;
 }
 
-void List_overlay::push_item(const std::string& s, Colour c)
+void List_overlay::push_item(utf8::string_ref s, Colour c)
+{
+    items.push_back(Item{to_wide(s),colour_attrib(c)});
+    m_max_len = std::max<int>(m_max_len,items.back().value.size());
+}
+void List_overlay::push_heading(utf8::string_ref s)
 {
-    items.push_back(Item{utf8_wchar.from_bytes(s),colour_attrib(c)});
+    items.push_back(Item{L" "+to_wide(s)+L" ",attrib::standout});
+    m_max_len = std::max<int>(m_max_len,items.back().value.size());
 }
-void List_overlay::push_heading(const std::string& s)
+void List_overlay::set_provider(int count, Provider provider, int max_width)
 {
-    items.push_back(Item{L" "+utf8_wchar.from_bytes(s)+L" ",A_STANDOUT});
+    if(count<0)
+        throw ui::Exception{"List_overlay::set_provider: Negative count."};
+    m_provider = std::move(provider);
+    m_provided_count = count;
+    m_provided_max_width = max_width;
 }
-void List_overlay::set_title(const std::string& s)
+void List_overlay::set_title(utf8::string_ref s)
 {
-    m_title = L" "+utf8_wchar.from_bytes(s)+L" ";
+    m_title = L" "+to_wide(s)+L" ";
 }
-void List_overlay::refresh(int x, int y, int height, int width)
+void List_overlay::refresh(Screen_buffer& screen, int x, int y,
+        int height, int width)
 {
     if(x<0 or y<0 or height<0 or width<0)
         throw Bad_dimensions{"List_overlay::refresh: "
             "Negative height/width supplied."};
-    if(items.empty())
+    const int count = m_provider? m_provided_count : items.size();
+    if(count==0)
         throw ui::Exception{"List_overlay has no items to display."};
-    int max_len = 0;
-    for(const Item& i : items)
-        if(i.value.size()>max_len)
-            max_len = i.value.size();
-    int indent = max_len<width? (width-max_len)/2 : 1;
-    int title_indent = (width-indent-m_title.size())/2;
     int page_height = height-2; //Excluding title and page count.
-    int page_count = std::ceil(items.size()/double(page_height));
-    if(m_page>page_count) //If attempting to show a non-existent page.
-        m_page = page_count;
+    int page_count = std::ceil(count/double(page_height));
+    //If attempting to show a non-existent page, or shown before first_page().
+    m_page = std::max(1,std::min(m_page,page_count));
     m_on_last_page = page_count==m_page;
-    int start_ln{0}, end_ln{static_cast<int>(items.size())};
+    int start_ln{0}, end_ln{count};
     if(page_count>1) {
         start_ln = (m_page-1)*page_height;
         end_ln = std::min(end_ln, m_page*page_height);
     }
+    const Item* page_items;
+    int max_len = m_max_len;
+    if(m_provider) { //Ask for only the items on the page.
+        m_page_items.resize(end_ln-start_ln);
+        max_len = m_provided_max_width;
+        for(int i=start_ln; i<end_ln; ++i) {
+            m_provided.text.clear();
+            m_provided.colour = Colour::normal;
+            m_provided.heading = false;
+            m_provider(i,m_provided);
+            Item& item = m_page_items[i-start_ln];
+            utf8::decode(m_provided.text,item.value);
+            item.attrib = colour_attrib(m_provided.colour);
+            if(m_provided.heading) {
+                item.value.insert(0,1,L' ');
+                item.value += L' ';
+                item.attrib = attrib::standout;
+            }
+            if(m_provided_max_width<0)
+                max_len = std::max<int>(max_len,item.value.size());
+        }
+        page_items = m_page_items.data();
+    }
+    else
+        page_items = items.data()+start_ln;
+    int indent = max_len<width? (width-max_len)/2 : 1;
+    int title_indent = (width-indent-m_title.size())/2;
     //Clear background.
     auto end_screen_ln = end_ln-start_ln+2;
-    for(int i=0; i<end_screen_ln; ++i) {
-        move(i,indent-1);
-        clrtoeol();
-    }
-    if(m_title.size()>0 and title_indent>=0) {
-        move(0,indent+title_indent);
-        attron(A_STANDOUT|A_BOLD);
-        addwstr(m_title.data());
-        attroff(A_STANDOUT|A_BOLD);
-    }
+    for(int i=0; i<end_screen_ln; ++i)
+        screen.clear_to_eol(indent-1,i);
+    if(m_title.size()>0 and title_indent>=0)
+        screen.put(indent+title_indent,0,m_title,attrib::standout|attrib::bold);
     for(int i=start_ln; i<end_ln; ++i) {
-        auto ln = items[i].value;
-        if(ln.size()>width-2)
-            ln = ln.substr(0,width-5)+L"...";
-        move(i-start_ln+1,indent);
-        attron(items[i].attrib);
-        addwstr(ln.data());
-        attroff(items[i].attrib);
+        const Item& item = page_items[i-start_ln];
+        const int screen_y = i-start_ln+1;
+        if(item.value.size()>width-2) { //Truncate, without copying.
+            int end_x = indent;
+            for(int j=0; j<width-5; ++j)
+                screen.put(end_x++,screen_y,item.value[j],item.attrib);
+            for(int j=0; j<3; ++j)
+                screen.put(end_x++,screen_y,L'.',item.attrib);
+        }
+        else
+            screen.put(indent,screen_y,item.value,item.attrib);
     }
     std::wstring page_detail = L"(page "+std::to_wstring(m_page)+L" of "+
         std::to_wstring(page_count)+L")";
-    move(end_screen_ln-1,width-1-page_detail.size());
-    addwstr(page_detail.data());
+    int page_end = screen.put(width-1-page_detail.size(),end_screen_ln-1,
+            page_detail);
+    screen.set_cursor(page_end,end_screen_ln-1);
 }
@@ -1,12 +1,25 @@
 //Wrapper around ncurses to simplify usage.
 //  Interally mainly std::wstring is used. This is to support unicode output
 //  (ncurses uses wchar_t for it, not char).
-//  The public API is std::string (UTF-8) to simplify usage, as the wchar_t is
-//   only needed by ncurses.
+//  The public API is UTF-8 to simplify usage, as the wchar_t is only needed by
+//   ncurses. Text is taken as utf8::string_ref, so std::string, string
+//   literals or a pointer and length can be given without allocating.
+//  The terminal itself is reached through a Backend (see backend.h).
+#ifndef UI_H
+#define UI_H
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
 #include <vector>
 #include <string>
 #include <stdexcept>
 #include <functional>
+#include <list>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include "utf8.h"
 
 namespace ui {
 
@@ -23,70 +36,596 @@ struct Bad_dimensions : Exception {
     using Exception::Exception;
 };
 
-class Level_view {
+//Display attributes of a Cell (see namespace attrib).
+using Attrib = std::int64_t;
+
+//A colour beyond those of Colour: one of the 256 of xterm (the first 16
+//  being the terminal's own palette, then a 6x6x6 cube and 24 greys), or
+//  24-bit RGB. Terminals without it show the nearest colour they have.
+class Term_colour {
 public:
-    Level_view() = default;
-    void resize(int height, int width)
+    //The terminal's default colour.
+    constexpr Term_colour() = default;
+    static constexpr Term_colour index(int i)
+    {   return Term_colour{index_kind,i&0xFF};  }
+    static constexpr Term_colour rgb(int r, int g, int b)
+    {   return Term_colour{rgb_kind,(r&0xFF)<<16|(g&0xFF)<<8|(b&0xFF)};  }
+    constexpr bool is_default() const
+    {   return m_kind==default_kind;    }
+    constexpr bool is_index() const
+    {   return m_kind==index_kind;  }
+    constexpr bool is_rgb() const
+    {   return m_kind==rgb_kind;    }
+    //Of index().
+    constexpr int number() const
+    {   return m_value; }
+    //Of rgb(), or the colour of an index in xterm's palette (the default
+    //  being black).
+    constexpr int red() const
+    {   return rgb_value()>>16; }
+    constexpr int green() const
+    {   return rgb_value()>>8&0xFF; }
+    constexpr int blue() const
+    {   return rgb_value()&0xFF;    }
+    //The nearest of the 256 colours.
+    constexpr Term_colour nearest_index() const
+    {
+        return m_kind!=rgb_kind? *this : index(nearest_cube_index(red(),
+                    green(),blue()));
+    }
+    //The nearest of the first 8 (the colours of Colour), for terminals with
+    //  no more. -1 for the default.
+    constexpr int nearest_basic() const
+    {
+        return m_kind==default_kind? -1 : m_kind==index_kind and m_value<16?
+            m_value&7 : (red()>127)|(green()>127)<<1|(blue()>127)<<2;
+    }
+    //As held in an Attrib, in 26 bits.
+    constexpr Attrib bits() const
+    {   return Attrib{m_kind}<<24|m_value;  }
+    static constexpr Term_colour from_bits(Attrib bits)
+    {   return Term_colour{int(bits>>24&3),int(bits&0xFFFFFF)};   }
+    friend constexpr bool operator==(Term_colour a, Term_colour b)
+    {   return a.m_kind==b.m_kind and a.m_value==b.m_value; }
+    friend constexpr bool operator!=(Term_colour a, Term_colour b)
+    {   return not (a==b);  }
+private:
+    enum { default_kind, index_kind, rgb_kind };
+    constexpr Term_colour(int kind, int value)
+        :m_kind{kind}, m_value{value}
+    {}
+    static constexpr int cube_level(int v) //Of xterm's 6 levels.
+    {   return v<48? 0 : v<115? 1 : (v-35)/40;  }
+    static constexpr int cube_value(int level)
+    {   return level==0? 0 : 55+level*40;   }
+    static constexpr int square(int v)
+    {   return v*v; }
+    static constexpr int distance(int r, int g, int b, int r2, int g2,
+            int b2)
+    {   return square(r-r2)+square(g-g2)+square(b-b2);  }
+    static constexpr int nearest_cube_index(int r, int g, int b)
     {
-        if(height<0 or width<0)
-            throw Bad_dimensions{
-                "Level_view::resize: Negative height/width supplied."};
-        m_width = width;
-        m_height = height;
-        int new_size = m_height*m_width;
-        m_grid.resize(new_size,' ');
-        m_attribs.resize(new_size,0);
+        //The nearest in the cube, unless the nearest grey is nearer.
+        return distance(r,g,b,cube_value(cube_level(r)),
+                    cube_value(cube_level(g)),cube_value(cube_level(b)))
+                <=distance(r,g,b,grey(r,g,b),grey(r,g,b),grey(r,g,b))?
+            16+36*cube_level(r)+6*cube_level(g)+cube_level(b)
+            : 232+nearest_grey((r+g+b)/3);
     }
+    static constexpr int grey(int r, int g, int b)
+    {   return grey_value(nearest_grey((r+g+b)/3)); }
+    static constexpr int nearest_grey(int v)
+    {   return v<8? 0 : v>238? 23 : (v-3)/10;   }
+    static constexpr int grey_value(int i)
+    {   return 8+10*i;  }
+    constexpr int rgb_value() const
+    {
+        return m_kind==rgb_kind? m_value : m_kind==default_kind? 0
+            : m_value<16? basic_rgb(m_value) : m_value<232?
+            cube_value((m_value-16)/36)<<16|cube_value((m_value-16)/6%6)<<8
+                |cube_value((m_value-16)%6)
+            : grey_value(m_value-232)*0x010101;
+    }
+    static constexpr int basic_rgb(int i) //As xterm shows them.
+    {
+        return i==7? 0xE5E5E5 : i==8? 0x7F7F7F : i<8?
+            (i&1? 0xCD0000 : 0)|(i&2? 0xCD00 : 0)|(i&4? (i==4? 0xEE : 0xCD) : 0)
+            : (i&1? 0xFF0000 : 0)|(i&2? 0xFF00 : 0)|(i&4? (i==12? 0x5C5CFF
+                    : 0xFF) : 0);
+    }
+
+    int m_kind{default_kind};
+    int m_value{0};
+};
+
+//Display attributes of a Cell: the value of a Colour in the low bits,
+//  combined with these flags, or the colours set by colours().
+namespace attrib {
+constexpr Attrib colour_mask = 0xFF;
+constexpr Attrib bold = 1<<8;
+constexpr Attrib dim = 1<<9;
+constexpr Attrib standout = 1<<10;
+constexpr int fg_shift = 11;
+constexpr int bg_shift = 37;
+constexpr Attrib fg_mask = Attrib{0x3FFFFFF}<<fg_shift;
+constexpr Attrib bg_mask = Attrib{0x3FFFFFF}<<bg_shift;
+//Foreground fg on background bg, in place of a Colour.
+constexpr Attrib colours(Term_colour fg, Term_colour bg=Term_colour{})
+{   return fg.bits()<<fg_shift|bg.bits()<<bg_shift; }
+//Those set by colours().
+constexpr Term_colour fg(Attrib a)
+{   return Term_colour::from_bits(a>>fg_shift);    }
+constexpr Term_colour bg(Attrib a)
+{   return Term_colour::from_bits(a>>bg_shift);    }
+}
+
+//Whether c is one of the values of Colour, Colour::white being the last.
+constexpr bool is_colour(Colour c)
+{   return static_cast<unsigned>(c)<=static_cast<unsigned>(Colour::white);  }
+
+namespace detail {
+constexpr unsigned colour_count = static_cast<unsigned>(Colour::white)+1;
+//The Attrib of each Colour, made at compile time, then Colour::normal for
+//  anything not a Colour.
+struct Colour_table {
+    Attrib attrib[colour_count+1];
+};
+constexpr Colour_table make_colour_table()
+{
+    Colour_table t{};
+    for(unsigned c=0; c<colour_count; ++c)
+        t.attrib[c] = c;
+    return t;
+}
+constexpr Colour_table colour_table = make_colour_table();
+}
+//Attributes showing a Colour, without branches (or throwing).
+constexpr Attrib colour_attrib(Colour c)
+{
+    return detail::colour_table.attrib[std::min(static_cast<unsigned>(c),
+            detail::colour_count)];
+}
+
+//A single character cell on the screen.
+struct Cell {
+    wchar_t ch{L' '};
+    Attrib attrib{0}; //Display attributes (see namespace attrib).
+};
+inline bool operator==(const Cell& a, const Cell& b)
+{   return a.ch==b.ch and a.attrib==b.attrib; }
+inline bool operator!=(const Cell& a, const Cell& b)
+{   return not (a==b);  }
+
+//Grid of cells covering the screen.
+//  Display keeps two of these: what is on the terminal and what should be.
+//  Only the cells that differ between them are sent to the terminal.
+//  All writes are clipped to the grid.
+class Screen_buffer {
+public:
+    void resize(int height, int width);
+    //Set every cell to c.
+    void fill(const Cell& c);
+    void put(int x, int y, wchar_t ch, Attrib attrib=0)
+    {
+        if(x>=0 and y>=0 and x<m_width and y<m_height)
+            m_cells[y*m_width+x] = Cell{ch,attrib};
+    }
+    //Write a string starting at (x,y), returns the column after it.
+    int put(int x, int y, const std::wstring& s, Attrib attrib=0);
+    //Blank from (x,y) to the end of the line.
+    void clear_to_eol(int x, int y);
+    const Cell& at(int x, int y) const
+    {   return m_cells[y*m_width+x];    }
+    Cell& at(int x, int y)
+    {   return m_cells[y*m_width+x];    }
+    //Position of the blinking cursor.
+    void set_cursor(int x, int y)
+    {   m_cursor_x = x; m_cursor_y = y;   }
+    int cursor_x() const
+    {   return m_cursor_x;  }
+    int cursor_y() const
+    {   return m_cursor_y;  }
+    int width() const
+    {   return m_width; }
+    int height() const
+    {   return m_height;    }
+private:
+    std::vector<Cell> m_cells;
+    int m_width{0}, m_height{0};
+    int m_cursor_x{0}, m_cursor_y{0};
+};
+
+//What the last call to Display::show_changes sent to the terminal.
+struct Frame_stats {
+    int cells{0}; //Cells written.
+    std::size_t text_bytes{0}; //UTF-8 bytes of the characters in those cells.
+    //Everything sent, escape sequences included, if the backend counts it
+    //  (see Backend::bytes_sent), otherwise 0.
+    std::size_t terminal_bytes{0};
+    int calls{0}; //Backend output calls made (moves, attribute changes, text).
+    int visited{0}; //Cells compared with what is on the terminal.
+    int attrib_changes{0};
+};
+
+//Time from keys being read by Display::run to the frame showing what they
+//  did being sent to the terminal, in microseconds.
+struct Input_latency {
+    long frames{0}; //Frames drawn in response to input.
+    double last_us{0}, mean_us{0}, max_us{0};
+};
+
+//Heap allocations (operator new, on any thread) so far. Only counted if
+//  built with UI_FRAME_PROFILE defined, which replaces the global operator
+//  new and delete; otherwise 0.
+long allocation_count();
+
+//Where the time of one Display::show_changes went, and what it output.
+struct Frame_profile {
+    double total_us{0};
+    double message_us{0}, status_us{0}, level_us{0}, overlay_us{0};
+    //Comparing with the terminal and writing to it, or handing the frame to
+    //  the render thread.
+    double output_us{0};
+    //These are of the last frame drawn, when threaded.
+    long cells_visited{0}, cells_emitted{0};
+    long attrib_changes{0};
+    //As Frame_stats::text_bytes and terminal_bytes.
+    long text_bytes{0}, terminal_bytes{0};
+    long allocations{0}; //See allocation_count.
+};
+
+//The profiles of the last frames shown by a Display (see
+//  Display::set_profiling), optionally also written to a file.
+class Frame_profiler {
+public:
+    //Keeps the profiles of the last window frames.
+    explicit Frame_profiler(std::size_t window=1024);
+    //Of the last frame, all 0 if none.
+    const Frame_profile& last() const
+    {   return m_last;  }
+    long frames() const
+    {   return m_frames;    }
+    //The p-th percentile (0 to 100) of field over the frames kept, 0 if
+    //  there are none. For example percentile(&Frame_profile::total_us,99).
+    template<class T>
+    double percentile(T Frame_profile::* field, double p) const
+    {
+        std::vector<double> values;
+        values.reserve(m_window.size());
+        for(const auto& f : m_window)
+            values.push_back(f.*field);
+        return percentile(values,p);
+    }
+    //Write every following profile to path, as a JSON array of objects if
+    //  it ends in ".json", otherwise as CSV with a header line. Throws
+    //  ui::Exception if it cannot be created. An empty path stops writing.
+    void dump_to(const std::string& path);
+    void clear();
+private:
+    friend class Display;
+    struct Close_dump {
+        bool json;
+        void operator()(std::FILE* f) const;
+    };
+    static double percentile(std::vector<double>& values, double p);
+    //Start and finish collecting m_frame.
+    void begin();
+    void end(const Frame_stats& stats);
+    void add(const Frame_profile& f);
+
+    bool m_enabled{false};
+    Frame_profile m_frame; //Being collected.
+    std::chrono::steady_clock::time_point m_start;
+    long m_start_allocations{0};
+    Frame_profile m_last;
+    std::vector<Frame_profile> m_window; //A ring once full.
+    std::size_t m_window_size;
+    long m_frames{0};
+    std::unique_ptr<std::FILE,Close_dump> m_dump{nullptr,Close_dump{false}};
+    long m_dumped{0}; //Profiles written to m_dump.
+};
+
+//A glyph to draw at a position, for drawing many at once.
+struct Entity {
+    int x, y;
+    char32_t glyph;
+    Colour colour;
+};
+//n entities as separate arrays (colour may be nullptr for all normal).
+struct Entity_arrays {
+    const int* x;
+    const int* y;
+    const char32_t* glyph;
+    const Colour* colour;
+    std::size_t n;
+};
+
+//The level, stored in tiles of tile_size x tile_size cells.
+//  A tile is only allocated when something is rendered in it. With a backing
+//  store set, tiles far from the focus are written to it once more than a
+//  given number are in memory, and read back when next needed.
+class Level_view {
+public:
+    static constexpr int tile_size = 64;
+
+    Level_view() = default;
+    //Cells keep their position, those outside the new size are lost.
+    void resize(int height, int width);
     void resize(const std::vector<std::string>& grid);
     void render(const std::vector<std::string>& grid);
     void render(int x, int y, char ch, Colour c=Colour::normal);
-    void render(int x, int y, const std::string& ch, Colour c=Colour::normal);
+    void render(int x, int y, utf8::string_ref ch, Colour c=Colour::normal);
     void render(int x, int y, wchar_t ch, Colour c=Colour::normal);
+    //With any attributes, such as those of attrib::colours().
+    void render(int x, int y, wchar_t ch, Attrib a);
+    //Render n decoded code points from (x,y) rightwards.
+    void render(int x, int y, const char32_t* row, int n,
+            Colour c=Colour::normal);
+    //Render many entities at once, checking all of them before drawing any.
+    //  Throws std::out_of_range if any is outside the level.
+    void render(const Entity* entities, std::size_t n);
+    void render(const Entity_arrays& entities);
+    //What is at (x,y) below any layers.
+    Cell at(int x, int y);
+
+    //Identifies a layer added with add_layer.
+    struct Layer {
+        int index;
+    };
+    //Layers hold cells drawn over the level, such as items or actors.
+    //  Those with a higher z are drawn over those with a lower one, and all
+    //  are drawn over what render(x,y,...) draws. Only the cells changed in
+    //  a layer are redrawn, so moving an actor costs two cells.
+    Layer add_layer(utf8::string_ref name, int z);
+    //The layer added with name. Throws ui::Exception if there is none.
+    Layer layer(utf8::string_ref name) const;
+    void render(Layer l, int x, int y, char ch, Colour c=Colour::normal);
+    void render(Layer l, int x, int y, utf8::string_ref ch,
+            Colour c=Colour::normal);
+    void render(Layer l, int x, int y, wchar_t ch, Colour c=Colour::normal);
+    void render(Layer l, int x, int y, wchar_t ch, Attrib a);
+    void render(Layer l, const Entity* entities, std::size_t n);
+    void render(Layer l, const Entity_arrays& entities);
+    //Remove the layer's cell at (x,y), uncovering what is below.
+    void erase(Layer l, int x, int y);
+    //Remove all of the layer's cells.
+    void clear(Layer l);
+
     //Sets position of blinking cursor.
     void set_focus(int x, int y)
     {   focus_x = x; focus_y = y;   }
-    //Clear level view contents (retains size).
+    //Clear level view contents (retains size and layers).
     void clear();
+    //Keep at most max_tiles tiles in memory, evicting those furthest from
+    //  the focus to the file at path (a temporary file if path is empty).
+    //  Tiles in the area last refreshed are never evicted.
+    void set_backing_store(const std::string& path, int max_tiles);
+    //Have the next refresh redraw every visible cell, not just changed ones.
+    void invalidate()
+    {
+        m_all_dirty = true;
+        m_dirty.clear();
+        for(auto& l : m_layers)
+            l.dirty.clear();
+    }
     //Draw to screen. It is recommended that only Display calls this.
-    void refresh(int screen_min_x, int screen_min_y, int height, int width);
+    //  Only cells changed since the last refresh are drawn, unless the
+    //  viewport has moved or invalidate() has been called. Returns whether
+    //  any were.
+    bool refresh(Screen_buffer& screen, int screen_min_x, int screen_min_y,
+            int height, int width);
+    //Position in the level of the top left cell drawn by the last refresh.
+    int view_x() const
+    {   return m_last_view[0];  }
+    int view_y() const
+    {   return m_last_view[1];  }
     //Returns dimensions as previously set.
     int width() const
     {   return m_width; }
     int height() const
     {   return m_height; }
+    //Tiles currently in memory.
+    int resident_tiles() const
+    {   return m_resident.size();   }
+    //Bytes used by the cells and the palette, for measuring memory use.
+    std::size_t memory_used() const;
 private:
-    std::vector<wchar_t> m_grid; //Uses wchar_t for ncurses.
-    std::vector<int> m_attribs; //Display attributes (bold, color, etc.).
+    //Cells are indexes into m_palette.
+    using Packed_cell = std::uint16_t;
+    static constexpr Packed_cell blank = 0; //Space with no attributes.
+    static constexpr int ascii_colours = 17; //Attributes with a fast lookup.
+    static constexpr Packed_cell not_interned = 0xFFFF;
+    //In m_extended, as it has colours beyond those of Colour.
+    static constexpr Packed_cell extended = 0xFFFE;
+    struct Tile {
+        std::vector<Packed_cell> cells; //Empty unless in memory.
+        long slot{-1}; //Place in the backing store, if it has been written.
+        bool changed{false}; //Since it was last written.
+    };
+    struct Close_file {
+        void operator()(std::FILE* f) const
+        {   std::fclose(f); }
+    };
+    //Index of the palette entry for (ch,attrib), adding one if needed.
+    Packed_cell intern(wchar_t ch, Attrib attrib)
+    {
+        if(ch>=0 and ch<0x80 and attrib>=0 and attrib<ascii_colours
+                and not m_ascii_index.empty()) {
+            Packed_cell p = m_ascii_index[ch*ascii_colours+attrib];
+            if(p!=not_interned)
+                return p;
+        }
+        return intern_new(ch,attrib);
+    }
+    Packed_cell intern_new(wchar_t ch, Attrib attrib);
+    //The cell p stands for at (x,y).
+    const Cell& unpack(Packed_cell p, int x, int y) const
+    {
+        return p==extended? m_extended.find(position_key(x,y))->second
+            : m_palette[p];
+    }
+    void set_cell(int x, int y, Packed_cell c);
+    int tile_index(int x, int y) const
+    {   return y/tile_size*m_tiles_x+x/tile_size; }
+    //Cells of the tile, or nullptr if it has never been rendered to.
+    const Packed_cell* load_tile(int index);
+    void allocate_tile(int index);
+    //Evict tiles until no more than m_max_tiles are in memory, except keep.
+    void evict_tiles(int keep=-1);
+    //Whether (x,y) was drawn by the last refresh.
+    bool in_view(int x, int y) const
+    {
+        return x>=m_last_view[0] and y>=m_last_view[1]
+            and x<m_last_view[0]+m_last_view[5]
+            and y<m_last_view[1]+m_last_view[4];
+    }
+    struct Layer_data {
+        std::string name;
+        int z;
+        std::unordered_map<std::uint64_t,Cell> cells; //By position_key.
+        std::vector<std::uint64_t> dirty; //Changed since the last refresh.
+    };
+    static std::uint64_t position_key(int x, int y)
+    {
+        return static_cast<std::uint64_t>(static_cast<std::uint32_t>(y))<<32
+            | static_cast<std::uint32_t>(x);
+    }
+    Layer_data& layer_data(Layer l);
+    //Throws unless every entity can be drawn.
+    template<class Entities>
+    void check_entities(const Entities& e, std::size_t n) const;
+    template<class Entities>
+    void render_entities(const Entities& e, std::size_t n);
+    template<class Entities>
+    void render_entities(Layer_data& l, const Entities& e, std::size_t n);
+    //The cell shown at (x,y): from the highest layer with one there, or
+    //  the level if none have.
+    Cell composite(int x, int y);
+    void mark_layer_dirty(Layer_data& l, int x, int y)
+    {
+        if(m_all_dirty or not in_view(x,y))
+            return;
+        if(l.dirty.size()>=std::size_t(m_last_view[4]*m_last_view[5]/4))
+            invalidate();
+        else
+            l.dirty.push_back(position_key(x,y));
+    }
+    void mark_dirty(int x, int y)
+    {
+        if(m_all_dirty or not in_view(x,y))
+            return;
+        //Past a certain point redrawing everything is cheaper.
+        if(m_dirty.size()>=std::size_t(m_last_view[4]*m_last_view[5]/4))
+            invalidate();
+        else //Relative to the view, so it fits in an int for any level.
+            m_dirty.push_back((y-m_last_view[1])*m_last_view[5]
+                    +x-m_last_view[0]);
+    }
+    //Working space for render_entities, kept to avoid allocating.
+    std::vector<std::uint32_t> m_batch_tiles, m_batch_cells, m_batch_sorted;
+    std::vector<std::uint32_t> m_batch_counts;
+    std::vector<Layer_data> m_layers; //In the order added.
+    std::vector<int> m_layer_order; //Indexes into m_layers, highest z first.
+    std::vector<Tile> m_tiles;
+    int m_tiles_x{0}, m_tiles_y{0};
+    std::vector<int> m_resident; //Indexes of the tiles in memory.
+    //Backing store for evicted tiles, with slots that can be reused.
+    std::unique_ptr<std::FILE,Close_file> m_store;
+    std::vector<long> m_free_slots;
+    long m_store_slots{0};
+    int m_max_tiles{0}; //Zero if there is no backing store.
+    //Each distinct glyph and attribute pair in the level.
+    std::vector<Cell> m_palette{Cell{L' ',0}};
+    struct Cell_hash {
+        std::size_t operator()(const Cell& c) const
+        {
+            return std::hash<std::uint64_t>{}(static_cast<std::uint64_t>(
+                        c.attrib)*0x9E3779B97F4A7C15u^std::uint32_t(c.ch));
+        }
+    };
+    std::unordered_map<Cell,Packed_cell,Cell_hash> m_palette_index;
+    //Cells with colours beyond those of Colour, by position_key, kept out
+    //  of the palette so that any number of shades can be shown over time.
+    //  Entries of cells since overwritten by a batch may linger until the
+    //  level is cleared, but are only looked at for cells marked extended.
+    std::unordered_map<std::uint64_t,Cell> m_extended;
+    //Palette entries of ASCII glyphs with plain colours, as they are most of
+    //  a level (not_interned if not in the palette yet).
+    std::vector<Packed_cell> m_ascii_index;
     int m_width{0}, m_height{0};
     int focus_x{0}, focus_y{0};
+    //Damage tracking: visible cells changed since the last refresh.
+    std::vector<int> m_dirty;
+    bool m_all_dirty{true};
+    //Where the last refresh drew (start_x, start_y, screen x, screen y,
+    //  height, width). If any change everything is redrawn.
+    int m_last_view[6]{-1,-1,-1,-1,-1,-1};
 };
 
+//Line of stats, e.g. "Title  HP: 10  Gold: 5", as many as fit.
+//  Where each value goes is worked out again only if something changes
+//  size, otherwise setting a value just redraws that value.
 class Status_bar {
 public:
+    //Identifies a stat added with add(), until clear() is called.
+    struct Handle {
+        int index;
+    };
     Status_bar() = default;
-    void add(const std::string& name);
-    void set(const std::string& name, const std::string& value,
+    Handle add(utf8::string_ref name);
+    //Setting by handle does not search or allocate (once the value's
+    //  storage has grown to fit).
+    void set(Handle stat, utf8::string_ref value,
             Colour value_c=Colour::normal);
-    void set_title(const std::string& title);
+    void set(utf8::string_ref name, utf8::string_ref value,
+            Colour value_c=Colour::normal);
+    void set_title(utf8::string_ref title);
     void clear()
-    {   m_stats.clear();  }
-    void refresh(int screen_x, int screen_y, int height, int width);
+    {   m_stats.clear(); m_changed_stats.clear(); m_changed = true;  }
+    //Redraw on the next refresh even if nothing has changed.
+    void invalidate()
+    {   m_changed = true;   }
+    //Returns whether anything was drawn.
+    bool refresh(Screen_buffer& screen, int screen_x, int screen_y,
+            int height, int width);
 private:
     struct Stat {
+        std::string utf8_name; //For finding the stat without converting.
         std::wstring name;
         std::wstring value;
-        int value_attrib;
+        Attrib value_attrib;
+        int value_x; //Screen column of the value, -1 if it did not fit.
+        bool changed; //Whether in m_changed_stats.
     };
     std::vector<Stat> m_stats;
+    std::vector<int> m_changed_stats; //Values to redraw.
     std::wstring m_title;
+    bool m_changed{true}; //Redraw everything, working out the layout.
+    int m_layout[3]{-1,-1,-1}; //Screen x, y and width laid out for.
 };
 
 class List_overlay {
 public:
+    //An item supplied by a Provider.
+    struct Provided_item {
+        std::string text; //UTF-8.
+        Colour colour{Colour::normal};
+        bool heading{false};
+    };
+    //Fills in item number index (from 0) for display. The item is reused,
+    //  so its text's storage can be too.
+    using Provider = std::function<void(int index, Provided_item& item)>;
+
     //Items are displayed in the order added.
-    void push_item(const std::string& s, Colour c=Colour::normal);
-    void push_heading(const std::string& s);
-    void set_title(const std::string& s);
+    void push_item(utf8::string_ref s, Colour c=Colour::normal);
+    void push_heading(utf8::string_ref s);
+    //Display count items from provider instead of those pushed. Only those
+    //  on the page shown are asked for, so the list can be any size.
+    //  The list is centred for max_width, if given, otherwise for the
+    //  widest item on the page. An empty provider goes back to the items
+    //  pushed.
+    void set_provider(int count, Provider provider, int max_width=-1);
+    void set_title(utf8::string_ref s);
     //Change which page is displayed.
     void next_page()
     {   ++m_page; }
@@ -97,65 +636,497 @@ public:
     bool on_last_page() const
     {   return m_on_last_page;  }
 
-    void refresh(int screen_x, int screen_y, int height, int width);
+    void refresh(Screen_buffer& screen, int screen_x, int screen_y,
+            int height, int width);
 private:
     struct Item {
         std::wstring value;
-        int attrib;
+        Attrib attrib;
     };
     std::vector<Item> items;
+    int m_max_len{0}; //Of the pushed items.
+    Provider m_provider;
+    int m_provided_count{0};
+    int m_provided_max_width{-1};
+    Provided_item m_provided; //Reused for each item asked for.
+    std::vector<Item> m_page_items; //Those provided for the page shown.
     std::wstring m_title;
     int m_page{0};
     bool m_on_last_page{false};
 };
 
+//A key press, small enough to pass by value. Either a code point or one of
+//  the Special keys. Ctrl+letter is the upper case letter with the ctrl
+//  modifier (so Tab is ctrl('i')), while Escape is U+001B and Enter '\n'.
+class Key {
+public:
+    //Keys without a code point, numbered after the last one.
+    //  In the same order as Backend::Key_code.
+    enum Special : char32_t {
+        up=0x110000, down, left, right, backspace, delete_key, home, end,
+        page_up, page_down, insert,
+        f0, //f0+n is Fn.
+        unknown=f0+64
+    };
+    enum Modifier : std::uint8_t {
+        ctrl=1
+    };
+    constexpr Key(char32_t code=unknown, std::uint8_t modifiers=0)
+        :m_code(code), m_modifiers(modifiers) {}
+    constexpr char32_t code() const
+    {   return m_code;  }
+    constexpr std::uint8_t modifiers() const
+    {   return m_modifiers; }
+    constexpr bool special() const
+    {   return m_code>=up;  }
+    //The code and modifiers in one number, ordering and identifying keys.
+    constexpr std::uint32_t value() const
+    {   return m_code|std::uint32_t{m_modifiers}<<24;   }
+private:
+    char32_t m_code;
+    std::uint8_t m_modifiers;
+};
+constexpr bool operator==(Key a, Key b)
+{   return a.value()==b.value();    }
+constexpr bool operator!=(Key a, Key b)
+{   return a.value()!=b.value();    }
+constexpr bool operator<(Key a, Key b)
+{   return a.value()<b.value(); }
+
+//Ctrl held with c, e.g. ctrl('x').
+constexpr Key ctrl(char32_t c)
+{   return Key(c>='a' and c<='z'? c-'a'+'A' : c,Key::ctrl);   }
+//Function key Fn.
+constexpr Key function_key(int n)
+{   return Key(Key::f0+n);    }
+
+//Name of k as returned by Display::get_key(): the UTF-8 of a code point
+//  or, for example, "Esc", "Up", "F1" or "^X".
+std::string key_name(Key k);
+
+//A value (e.g. an action) for a key.
+template<class T>
+struct Key_binding {
+    Key key;
+    T value;
+};
+
+//Finds what is bound to a key with a single lookup: ASCII keys by indexing
+//  a table, others by binary search. Built from a list (which can be a
+//  constexpr array) of Key_binding, where the first binding of a key is used.
+template<class T>
+class Key_map {
+public:
+    template<class It>
+    Key_map(It begin, It end)
+    {
+        std::fill(std::begin(m_ascii),std::end(m_ascii),-1);
+        for(It i=begin; i!=end; ++i) {
+            if(i->key.value()>=ascii)
+                m_others.push_back(*i);
+            else if(m_ascii[i->key.value()]<0) {
+                m_ascii[i->key.value()] = m_ascii_values.size();
+                m_ascii_values.push_back(i->value);
+            }
+        }
+        std::stable_sort(m_others.begin(),m_others.end(),
+                [](const Key_binding<T>& a, const Key_binding<T>& b) {
+                    return a.key<b.key;
+                });
+    }
+    template<std::size_t N>
+    explicit Key_map(const Key_binding<T> (&bindings)[N])
+        :Key_map(bindings,bindings+N) {}
+    Key_map(std::initializer_list<Key_binding<T>> bindings)
+        :Key_map(bindings.begin(),bindings.end()) {}
+    //The value bound to k, or nullptr if there is none.
+    const T* find(Key k) const
+    {
+        if(k.value()<ascii) {
+            const int i = m_ascii[k.value()];
+            return i<0? nullptr : &m_ascii_values[i];
+        }
+        auto b = std::lower_bound(m_others.begin(),m_others.end(),k,
+                [](const Key_binding<T>& b, Key k) {
+                    return b.key<k;
+                });
+        return b!=m_others.end() and b->key==k? &b->value : nullptr;
+    }
+private:
+    static constexpr std::uint32_t ascii = 0x80;
+    std::int16_t m_ascii[ascii];
+    std::vector<T> m_ascii_values;
+    std::vector<Key_binding<T>> m_others; //Sorted by key.
+};
+
+//Keys to complete typed text with, such as item or monster names.
+//  The keys are kept as UTF-8 in one block, with their offsets sorted by
+//  key (on first use after keys are added). The keys starting with some
+//  text are then a range of the offsets, found by a Search.
+class Completion_index {
+public:
+    Completion_index() = default;
+    explicit Completion_index(const std::vector<std::string>& keys);
+    //Empty keys and those already added are ignored.
+    void add(utf8::string_ref key);
+    std::size_t size() const;
+    //Key i in sorted order.
+    utf8::string_ref key(std::size_t i) const;
+
+    //The keys starting with text typed a code point at a time. Each code
+    //  point narrows the range of keys with a binary search within it, and
+    //  the ranges before are kept so removing the last is O(1).
+    //  Only valid while no keys are added to the index.
+    class Search {
+    public:
+        explicit Search(const Completion_index& index);
+        //Add a code point (as UTF-8) to the text.
+        void push(utf8::string_ref cp);
+        //Remove the last code point added, if any.
+        void pop();
+        const std::string& text() const
+        {   return m_text;  }
+        //Number of code points in the text.
+        std::size_t size() const
+        {   return m_steps.size()-1;    }
+        //Number of keys that start with the text.
+        std::size_t count() const
+        {   return m_steps.back().last-m_steps.back().first;  }
+        //Key i of those that start with the text.
+        utf8::string_ref match(std::size_t i) const
+        {   return m_index->key(m_steps.back().first+i);    }
+    private:
+        struct Step {
+            std::size_t first, last; //Range of keys.
+            std::size_t text_size; //Up to and including the code point.
+        };
+        const Completion_index* m_index;
+        std::string m_text;
+        std::vector<Step> m_steps; //The first for no text.
+    };
+private:
+    void sort() const;
+    std::string m_arena; //Every key, one after another.
+    struct Key_range {
+        std::uint32_t offset, size;
+        //The first bytes of the key, so most of a search stays in m_keys.
+        unsigned char start[8];
+    };
+    mutable std::vector<Key_range> m_keys;
+    mutable bool m_sorted{true};
+};
+
+//Messages waiting to be shown, and a history of those queued.
+//  Both are of fixed capacity: pending messages are kept in a ring whose
+//  slots reuse their storage, the history as UTF-8 in a ring of bytes, so
+//  once warmed up queueing does not allocate. A message queued again while
+//  the last is still pending is counted instead, e.g. "You hit the rat. x5".
+class Message_log {
+public:
+    //A message in the history. text points into the log, so is only valid
+    //  until the next message is queued.
+    struct Entry {
+        utf8::string_ref text;
+        int count;
+    };
+
+    explicit Message_log(int max_pending=64, std::size_t history_bytes=16384,
+            int max_history=512);
+    //If max_pending messages are waiting the oldest is dropped from them,
+    //  though it stays in the history.
+    void queue(utf8::string_ref msg);
+    int pending() const
+    {   return m_pending_count; }
+    bool full() const
+    {   return m_pending_count==static_cast<int>(m_pending.size()); }
+    //The oldest pending message, with its count. There must be one.
+    const std::wstring& front() const
+    {   return m_pending[m_pending_head].text;  }
+    void pop();
+    //Number of messages in the history, the oldest being lost as room is
+    //  needed.
+    int history_size() const
+    {   return m_history_count; }
+    //Message i of the history, 0 being the most recent.
+    Entry history(int i) const;
+private:
+    struct Pending {
+        std::wstring text;
+        std::size_t length; //Of the text without the count.
+        int count;
+    };
+    struct Stored {
+        //Of the text, pos counting every byte ever written to m_arena so
+        //  that the text is at pos%m_arena.size() and overwritten once the
+        //  end passes pos+m_arena.size().
+        std::uint64_t pos;
+        std::size_t size;
+        std::size_t length; //Of the message, of which size bytes were kept.
+        int count;
+    };
+    std::vector<Pending> m_pending;
+    int m_pending_head{0}, m_pending_count{0};
+    std::vector<char> m_arena;
+    std::uint64_t m_arena_end{0}; //Where the next text goes.
+    std::vector<Stored> m_history;
+    int m_history_head{0}, m_history_count{0}; //Head is the oldest.
+};
+
+//Where a pane goes on the terminal (see Display::add_view). Negative x and
+//  y count back from the right and bottom edges (-1 the last column or
+//  row), and a height or width of 0 or less reaches that many rows or
+//  columns short of the bottom or right edge. So {-20,1,-1,20} is the 20
+//  columns at the right, from below the message line to above the status
+//  bar. Parts off the terminal are not shown.
+struct Pane_rect {
+    int x{0}, y{0};
+    int height{0}, width{0};
+};
+
+class Backend;
+class Frame_encoder;
+class Frame_sink;
+class Frame_recorder;
+class Spectator_server;
+
 class Display {
 public:
+    //Uses ncurses on the terminal.
     Display();
+    explicit Display(std::unique_ptr<Backend> backend);
     ~Display();
     Display(const Display&) = delete;
-    Display(Display&&) = default;
+    Display(Display&&);
     Display& operator=(Display&) = delete;
-    Display& operator=(Display&&) = default;
+    Display& operator=(Display&&);
 
-    void queue_message(std::string msg);
-    //Number of messages queued.
+    void queue_message(utf8::string_ref msg);
+    //Number of messages queued, counting the rest of one too long to be
+    //  shown at once.
     int messages_count() const
-    {   return messages.size();   }
+    {   return m_messages.pending()+(m_message_cut!=std::wstring::npos);  }
     //Move onto the next message.
-    void next_message()
-    {
-        if(not messages.empty())
-            messages.erase(messages.begin());
-    }
+    void next_message();
+    //Every message queued, most recent first.
+    const Message_log& message_log() const
+    {   return m_messages;  }
     void set_show_overlay(bool show)
     {   m_show_overlay = show;  }
     //Shows all changes made. Must be called to display them.
+    //  Only cells that differ from what is already on the terminal are sent.
     void show_changes();
+    //Have the next show_changes() repaint the whole terminal.
+    void redraw()
+    {   m_redraw = true;    }
+    //What the last show_changes() sent to the terminal. When threaded, what
+    //  was sent for the last frame drawn before it.
+    const Frame_stats& frame_stats() const
+    {   return m_frame_stats;   }
+    //Profile each show_changes() into profiler(). Only has an effect if
+    //  built with UI_FRAME_PROFILE defined; without it show_changes() has no
+    //  instrumentation at all.
+    void set_profiling(bool profile);
+    bool profiling() const
+    {   return m_profiler.m_enabled;    }
+    Frame_profiler& profiler()
+    {   return m_profiler;  }
+    //Record every frame shown to a file at path (see recording.h),
+    //  replacing any recording being made. An empty path stops recording.
+    void record(const std::string& path);
+    //The recording being made, nullptr if none. When threaded it is written
+    //  by the render thread, so only look at it after wait_for_render().
+    const Frame_recorder* recorder() const
+    {   return m_recorder.get();    }
+    //Send every frame shown to viewers connecting to a Unix domain socket
+    //  created at path (see spectator.h), replacing any already being sent
+    //  to. An empty path stops. The frames are encoded once, for both
+    //  viewers and any recording.
+    void spectate(const std::string& path);
+    //What the viewers are being sent, nullptr if none. Only look at it
+    //  after wait_for_render() when threaded, as for recorder().
+    const Spectator_server* spectators() const
+    {   return m_spectators.get();  }
+    //Show screen, clipped to the terminal, in place of the widgets until
+    //  the next show_changes(). For playing recordings.
+    void show_screen(const Screen_buffer& screen);
+    //Draw on a thread of its own, so that a slow terminal does not hold up
+    //  the caller. show_changes() then only hands the frame to the thread,
+    //  never waiting for it; frames handed over faster than the terminal
+    //  takes them are dropped. The backend must allow input on this thread
+    //  while another outputs (see Backend::concurrent_input).
+    void set_threaded(bool threaded);
+    bool threaded() const
+    {   return m_render_thread!=nullptr;    }
+    //Wait until the last frame shown has been drawn, when threaded.
+    void wait_for_render();
+    //Frames dropped since drawing was threaded.
+    long frames_dropped() const;
     //Get a key press.
     // All keys that produce printable output are returned as they are.
     // Escape is "Esc" and the arrow keys are "Up", "Down", "Left" and "Right".
     // Ctrl+X returns "^X".
     std::string get_key();
+    //Get a key press, as get_key() does, without building a string.
+    Key get_key_event();
+    //Wait up to timeout_ms (for ever if negative) for a key press. Returns
+    //  false if there was none, or the terminal was resized while waiting,
+    //  otherwise sets key.
+    bool poll_key_event(Key& key, int timeout_ms=0);
+    //Calls on_key for each key press until it returns false, showing the
+    //  changes at most max_fps times a second. All the keys typed ahead are
+    //  handled before the next frame, and frames are only drawn after keys
+    //  or timers, so held or pasted keys do not draw frames nobody sees.
+    void run(const std::function<bool(Key)>& on_key, int max_fps=60);
+    //Have f called every interval_ms while run() waits for keys, until it
+    //  returns false. A frame is drawn after it. Returns an id for
+    //  remove_timer.
+    int add_timer(int interval_ms, std::function<bool()> f);
+    void remove_timer(int id);
+    //For the frames drawn by run().
+    const Input_latency& input_latency() const
+    {   return m_input_latency; }
     std::string get_answer(std::string msg);
     std::string get_long_answer(std::string prompt="# ",
             std::function<std::string(std::string)> autocompleter={});
         //The string returned by autocompleter (if it starts with the input) is
         //used as the autocompletion and returned if the user presses [ENTER].
+    //As get_long_answer, completing with the keys in index that start with
+    //  what is typed. Tab (or Down) and Up cycle through them, Right takes
+    //  the one shown into the text and [ENTER] returns it.
+    std::string get_long_answer(const std::string& prompt,
+            const Completion_index& index);
 
     Level_view& level_view()
     {   return m_level_view;    }
+    //Where level_view() is shown, by default between the message line and
+    //  the status bar.
+    void set_level_rect(const Pane_rect& rect);
+    //Show another Level_view in rect, such as a minimap, a zoomed view of
+    //  a target, or a side panel of text. Each has damage tracking of its
+    //  own, and show_changes() only compares the rows of those that drew
+    //  something with the terminal, sending every pane in one update. Panes
+    //  are drawn in the order added, and should not overlap each other or
+    //  level_view(), as each only redraws what changes in it. Scrolling
+    //  level_view() on the terminal is only done while no pane shares its
+    //  rows. Throws ui::Exception if a view with name has been added.
+    Level_view& add_view(utf8::string_ref name, const Pane_rect& rect);
+    //The view added with name. Throws ui::Exception if there is none.
+    Level_view& view(utf8::string_ref name);
+    void set_view_rect(utf8::string_ref name, const Pane_rect& rect);
+    //The area the view covered is blanked, if nothing else is there.
+    void remove_view(utf8::string_ref name);
     Status_bar& status_bar()
     {   return m_status_bar;    }
     List_overlay& list_overlay()
     {   return m_list_overlay;  }
+    Backend& backend()
+    {   return *m_backend;  }
 private:
+    using Clock = std::chrono::steady_clock;
+    struct Timer {
+        int id;
+        Clock::time_point due;
+        Clock::duration interval;
+        std::function<bool()> f;
+        bool removed;
+    };
+    //The key starting with ch from read_key, reading the rest of it.
+    Key to_key(int ch);
+    //Run the timers that are due, returning whether there were any.
+    bool run_timers();
     void show_message(int max_width);
-    std::vector<std::wstring> messages;
+    //Rows top to before bottom show the level from (x,y). If only y
+    //  changes between frames, the rows are scrolled on the terminal rather
+    //  than rewritten.
+    struct Viewport {
+        int top{0}, bottom{0};
+        int x{0}, y{0};
+    };
+    struct Pane {
+        std::string name;
+        Pane_rect rect;
+        //Kept in place, as Display hands out references to it.
+        std::unique_ptr<Level_view> view;
+    };
+    //The pane named name. Throws ui::Exception if there is none.
+    Pane& pane(utf8::string_ref name, const char* who);
+    //rect on the terminal, clipped to it.
+    Pane_rect place(const Pane_rect& rect) const;
+    //Have rows top to before bottom compared with the terminal.
+    void mark_rows(int top, int bottom);
+    //Have every widget drawn again in full, blanking what they do not
+    //  cover, for when the panes move.
+    void relayout();
+    //What is on the terminal, and the sending of changes to it.
+    struct Terminal {
+        Screen_buffer front; //What is on the terminal.
+        Viewport front_view; //Of front.
+        std::wstring run; //Text of the run being output by flush_row.
+        //If there are sinks, every frame sent is encoded by encoder for
+        //  them.
+        Frame_encoder* encoder{nullptr};
+        std::vector<Frame_sink*> sinks;
+        //Send the differences between back, showing view, and front to the
+        //  terminal, or all of back if redraw. Only the rows set in rows
+        //  (all if it is null) are compared, unless redrawing.
+        Frame_stats flush(Backend& backend, const Screen_buffer& back,
+                const Viewport& view, bool redraw,
+                const std::vector<char>* rows=nullptr);
+        //Scroll the rows of front_view to match view, if the backend can
+        //  and that is all that changed. Returns whether it did.
+        bool scroll(Backend& backend, const Viewport& view);
+        //Send the changed cells of one row, attrib is the current attribute.
+        void flush_row(Backend& backend, const Screen_buffer& back, int y,
+                Attrib& attrib, Frame_stats& stats);
+        //Have the sinks do what is due between frames (see
+        //  Frame_sink::poll).
+        void poll();
+    };
+    class Render_thread;
+    //Give the terminal the recorder and viewers to send frames to.
+    void set_sinks();
+    //Poll the terminal's sinks, on the render thread if threaded.
+    void poll_sinks();
+    //Resize the screen buffers to match the terminal.
+    void fit_terminal();
+    //Send m_back to the terminal, or to the render thread. Only the rows
+    //  marked since the last frame need be compared.
+    void present();
+    //Write line at (x,0) from where it differs with what is there, the
+    //  first typed cells normal and the rest dim, blanking the cells from
+    //  its end to end (then set to its end). For get_long_answer.
+    void put_answer(int x, const std::wstring& line, std::size_t typed,
+            int& end);
+    //Before m_backend, so it is replaced first when moved into.
+    std::unique_ptr<Render_thread> m_render_thread;
+    std::unique_ptr<Backend> m_backend;
+    Terminal m_terminal; //Unless threaded.
+    Screen_buffer m_back; //What should be on the terminal.
+    Viewport m_back_view; //Of m_back.
+    //Rows of m_back changed since the last frame, one flag each. The render
+    //  thread compares every row, as frames may be dropped.
+    std::vector<char> m_rows_changed;
+    Frame_stats m_frame_stats;
+    Frame_profiler m_profiler;
+    std::unique_ptr<Frame_encoder> m_encoder; //For the recorder and viewers.
+    std::unique_ptr<Frame_recorder> m_recorder;
+    std::unique_ptr<Spectator_server> m_spectators;
+    bool m_redraw{true};
+    bool m_overlay_drawn{false}; //Whether the overlay was in the last frame.
+    bool m_resized{false}; //Seen while waiting for keys, for run to draw.
+    std::list<Timer> m_timers; //Kept in place while they run.
+    int m_next_timer_id{0};
+    Input_latency m_input_latency;
+    Message_log m_messages;
+    std::size_t m_message_offset{0}; //Of the part of the first message shown.
+    std::size_t m_message_cut{std::wstring::npos}; //Where the part ends.
     bool m_show_overlay{false};
     Level_view m_level_view;
+    Pane_rect m_level_rect{0,1,-1,0};
+    std::vector<Pane> m_panes;
     List_overlay m_list_overlay;
     Status_bar m_status_bar;
 };
 
 }//End namespace ui.
+#endif
@@ -0,0 +1,588 @@
+//Benchmarks for ui::Display.
+//  Run from the directory containing demo_level.txt.
+//  By default the in-memory Headless_backend is drawn to. With --ncurses the
+//  terminal is used (results then go to stderr, e.g. 2>results.txt).
+//  If built with UI_FRAME_PROFILE, the level benchmarks also report
+//  percentiles, and each of their frames is written to the file named by
+//  UI_BENCH_PROFILE (CSV, or JSON if it ends in .json) if that is set.
+#include "ui.h"
+#include "backend.h"
+#include "level_file.h"
+#include "recording.h"
+#include "spectator.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+std::vector<std::string> load_level(const std::string& path)
+{
+    std::vector<std::string> grid;
+    std::ifstream is{path};
+    for(std::string ln; getline(is,ln);)
+        grid.push_back(ln);
+    if(grid.empty())
+        throw std::runtime_error{"Unable to load "+path};
+    return grid;
+}
+
+//Rooms of floor surrounded by walls, joined by corridors.
+std::vector<std::string> synthetic_level(int height, int width)
+{
+    std::vector<std::string> grid(height,std::string(width,' '));
+    for(int y=0; y<height; ++y)
+        for(int x=0; x<width; ++x) {
+            if(y%10==0 or x%20==0)
+                grid[y][x] = (x%20==10 or y%10==5)? '+' : '#';
+            else if(y%10!=5 or x%20<15)
+                grid[y][x] = '.';
+        }
+    return grid;
+}
+
+struct Result {
+    double us{0}; //Microseconds.
+    double cells{0};
+    double text_bytes{0};
+    double terminal_bytes{0}; //If the backend counts them.
+    double calls{0};
+    //Of the total time, if profiled (see ui::Display::set_profiling).
+    bool profiled{false};
+    double p50_us{0}, p99_us{0};
+};
+
+//Averages per frame over frames calls of show_changes, each preceded by
+//  before_frame(frame_no).
+template<class F>
+Result run(ui::Display& d, int frames, F before_frame)
+{
+    Result r;
+    d.profiler().clear();
+    for(int i=0; i<frames; ++i) {
+        before_frame(i);
+        auto start = std::chrono::steady_clock::now();
+        d.show_changes();
+        std::chrono::duration<double,std::micro> t =
+            std::chrono::steady_clock::now()-start;
+        r.us += t.count();
+        r.cells += d.frame_stats().cells;
+        r.text_bytes += d.frame_stats().text_bytes;
+        r.terminal_bytes += d.frame_stats().terminal_bytes;
+        r.calls += d.frame_stats().calls;
+    }
+    r.us /= frames;
+    r.cells /= frames;
+    r.text_bytes /= frames;
+    r.terminal_bytes /= frames;
+    r.calls /= frames;
+    if(d.profiler().frames()>0) {
+        r.profiled = true;
+        r.p50_us = d.profiler().percentile(&ui::Frame_profile::total_us,50);
+        r.p99_us = d.profiler().percentile(&ui::Frame_profile::total_us,99);
+    }
+    return r;
+}
+
+void report(const std::string& name, const Result& r)
+{
+    std::cerr<<name<<": "<<r.us<<"us/frame ("<<1e6/r.us<<" frames/s), "
+        <<r.calls<<" calls, "<<r.cells<<" cells, "<<r.text_bytes
+        <<" text bytes";
+    if(r.terminal_bytes>0)
+        std::cerr<<", "<<r.terminal_bytes<<" bytes sent";
+    if(r.profiled)
+        std::cerr<<", p50 "<<r.p50_us<<"us, p99 "<<r.p99_us<<"us";
+    std::cerr<<'\n';
+}
+
+void bench_level(ui::Display& d, const std::string& name,
+        const std::vector<std::string>& grid, int frames)
+{
+    auto& lv = d.level_view();
+    lv.resize(grid);
+    lv.render(grid);
+    //Some colour, so rows are not a single run.
+    for(int y=0; y<lv.height(); y+=3)
+        for(int x=y%7; x<lv.width(); x+=7)
+            lv.render(x,y,'$',ui::Colour::yellow);
+    std::cerr<<name<<" memory: "<<double(lv.memory_used())
+        /(double(lv.width())*lv.height())<<" bytes/cell\n";
+    report(name+" full redraw",run(d,frames,[&](int) {
+        lv.set_focus(lv.width()/2,lv.height()/2);
+        d.redraw();
+    }));
+    report(name+" walking",run(d,frames,[&](int i) {
+        int x = i%lv.width(), y = i%lv.height();
+        lv.render(x,y,'@',ui::Colour::white);
+        lv.set_focus(x,y);
+    }));
+    //Only the rows uncovered are sent, once the terminal has scrolled.
+    report(name+" walking down",run(d,frames,[&](int i) {
+        lv.set_focus(lv.width()/2,i%lv.height());
+    }));
+    //An actor moving around on a layer, without scrolling.
+    auto actors = lv.add_layer("actors "+name,1);
+    lv.set_focus(0,0);
+    report(name+" actor moving",run(d,frames,[&](int i) {
+        lv.clear(actors);
+        lv.render(actors,i%20,i%10,'@',ui::Colour::white);
+    }));
+}
+
+//A HUD of a dozen stats updated every frame, by name and by handle.
+void bench_status(int frames)
+{
+    ui::Display d{std::make_unique<ui::Headless_backend>(50,160)};
+    std::vector<ui::Status_bar::Handle> stats;
+    std::vector<std::string> names;
+    for(int i=0; i<12; ++i) {
+        names.push_back("Stat"+std::to_string(i));
+        stats.push_back(d.status_bar().add(names.back()));
+    }
+    const char* values[]{"10","11","12","13"};
+    report("12 stats set by name",run(d,frames,[&](int frame) {
+        for(int i=0; i<12; ++i)
+            d.status_bar().set(names[i],values[(frame+i)%4]);
+    }));
+    report("12 stats set by handle",run(d,frames,[&](int frame) {
+        for(int i=0; i<12; ++i)
+            d.status_bar().set(stats[i],values[(frame+i)%4]);
+    }));
+}
+
+//Recording each frame of walking around a level, as Display::record does,
+//  timed apart from the frame.
+void bench_recording(int frames)
+{
+    const std::string path = "/tmp/ui_bench_recording";
+    auto grid = synthetic_level(500,500);
+    Result without;
+    for(bool recording : {false,true}) {
+        ui::Display d{std::make_unique<ui::Headless_backend>(50,160)};
+        auto& lv = d.level_view();
+        lv.resize(grid);
+        lv.render(grid);
+        d.status_bar().add("Turn");
+        if(recording)
+            d.record(path);
+        const Result r = run(d,frames,[&](int i) {
+            lv.render(i%lv.width(),i/2%lv.height(),'@',ui::Colour::white);
+            lv.set_focus(i%lv.width(),i/2%lv.height());
+            d.status_bar().set("Turn",std::to_string(i));
+        });
+        if(not recording) {
+            without = r;
+            continue;
+        }
+        report("walking diagonally, recorded",r);
+        const auto& rec = *d.recorder();
+        const double bytes = double(rec.bytes())/rec.frames();
+        std::cerr<<"recording it: "<<r.us-without.us<<"us/frame ("
+            <<(r.us/without.us-1)*100<<"% more), "<<bytes<<" bytes/frame, "
+            <<bytes*60*3600/1e6<<" MB/hour at 60 frames/s\n";
+        d.record("");
+    }
+    std::remove(path.c_str());
+}
+
+//Walking diagonally with n viewers watching, each reading what it is sent
+//  between frames (untimed).
+void bench_spectators(int frames, int n)
+{
+    const std::string path = "/tmp/ui_bench_spectators";
+    auto grid = synthetic_level(500,500);
+    ui::Display d{std::make_unique<ui::Headless_backend>(50,160)};
+    auto& lv = d.level_view();
+    lv.resize(grid);
+    lv.render(grid);
+    d.status_bar().add("Turn");
+    d.spectate(path);
+    std::vector<std::unique_ptr<ui::Spectator_client>> viewers;
+    for(int i=0; i<n; ++i)
+        viewers.push_back(std::make_unique<ui::Spectator_client>(path));
+    const Result r = run(d,frames,[&](int i) {
+        for(auto& v : viewers)
+            v->receive();
+        lv.render(i%lv.width(),i/2%lv.height(),'@',ui::Colour::white);
+        lv.set_focus(i%lv.width(),i/2%lv.height());
+        d.status_bar().set("Turn",std::to_string(i));
+    });
+    report("walking diagonally, "+std::to_string(n)+" viewers",r);
+    const auto& s = *d.spectators();
+    std::cerr<<"sending it: "<<s.bytes_sent()/(r.us*frames)
+        <<" MB/s to viewers, "<<double(s.bytes_sent())/frames/n
+        <<" bytes/frame each, "<<s.keyframes_sent()<<" keyframes, "
+        <<s.drops()<<" drops\n";
+    d.spectate("");
+}
+
+//A battle queueing a few hundred messages a frame, many repeated, all of
+//  which are then dismissed.
+void bench_messages(int frames)
+{
+    ui::Display d{std::make_unique<ui::Headless_backend>(50,160)};
+    const char* lines[]{"You hit the rat.","The rat bites!","You miss the rat.",
+        "The rat is killed! A long message that needs to be split to fit "
+        "on the line, as it is wider than the terminal by some way, which "
+        "takes a bit more text than might be expected."};
+    report("300 messages queued and dismissed",run(d,frames,[&](int frame) {
+        for(int i=0; i<300; ++i)
+            d.queue_message(lines[(frame+i/3)%4]);
+        while(d.messages_count()>0)
+            d.next_message();
+        d.queue_message(lines[frame%4]);
+    }));
+}
+
+//A movement key held down for a second, repeating every 5ms, with Display::run
+//  drawing at most 60 frames a second.
+void bench_held_key(ui::Display& d, ui::Headless_backend* backend)
+{
+    auto& lv = d.level_view();
+    int x = lv.width()/2, y = lv.height()/2;
+    int keys = 0, repeats = 0;
+    const long frames_before = backend->counters().frames;
+    auto start = std::chrono::steady_clock::now();
+    const int timer = d.add_timer(5,[&] {
+        backend->push_input(++repeats<200? "l" : "q");
+        return true;
+    });
+    d.run([&](ui::Key k) {
+        ++keys;
+        x = (x+1)%lv.width();
+        lv.set_focus(x,y);
+        return k!='q';
+    });
+    d.remove_timer(timer);
+    std::chrono::duration<double> t = std::chrono::steady_clock::now()-start;
+    const auto& latency = d.input_latency();
+    std::cerr<<"Held key: "<<keys<<" keys in "<<t.count()<<"s, "
+        <<backend->counters().frames-frames_before<<" frames, input latency "
+        <<latency.mean_us<<"us mean, "<<latency.max_us<<"us max\n";
+}
+
+//Completing over 50000 names a keystroke at a time, by a Completion_index
+//  and by an autocompleter function searching a sorted vector of them.
+void bench_completion()
+{
+    const char* kinds[]{"giant ","cave ","fire ","frost ","orc ","hill "};
+    const char* things[]{"rat","bat","troll","mage","lord","spider","worm"};
+    std::vector<std::string> names;
+    for(int i=0; names.size()<50000; ++i)
+        names.push_back(kinds[i%6]+std::string{things[(i/6)%7]}+" of level "
+                +std::to_string(i));
+    ui::Completion_index index{names};
+    std::sort(names.begin(),names.end());
+    //As get_long_answer calls it.
+    std::function<std::string(std::string)> autocompleter =
+        [&](std::string s) {
+            auto i = std::lower_bound(names.begin(),names.end(),s);
+            return i!=names.end() and i->compare(0,s.size(),s)==0? *i
+                : std::string{};
+        };
+    const std::string typed = "orc troll of level 12346";
+    const int repeats = 10000;
+    long found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int r=0; r<repeats; ++r) {
+        std::string res;
+        for(char c : typed) {
+            res += c;
+            found += autocompleter(res).size();
+        }
+    }
+    std::chrono::duration<double,std::nano> t =
+        std::chrono::steady_clock::now()-start;
+    std::cerr<<"Completion of 50000 names, autocompleter: "
+        <<t.count()/repeats/typed.size()<<"ns/keystroke\n";
+    start = std::chrono::steady_clock::now();
+    for(int r=0; r<repeats; ++r) {
+        ui::Completion_index::Search search{index};
+        for(char c : typed) {
+            search.push(utf8::string_ref{&c,1});
+            found += search.count()? search.match(0).size() : 0;
+        }
+    }
+    t = std::chrono::steady_clock::now()-start;
+    std::cerr<<"Completion of 50000 names, Completion_index: "
+        <<t.count()/repeats/typed.size()<<"ns/keystroke ("<<found<<")\n";
+}
+
+//A terminal taking 2ms to show each frame, as over a slow link.
+struct Slow_backend : ui::Headless_backend {
+    using Headless_backend::Headless_backend;
+    void flush() override
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{2});
+        Headless_backend::flush();
+    }
+};
+
+//Time show_changes takes the caller when walking over the demo level on a
+//  slow terminal, drawing on the caller's thread and on a thread of its own.
+void bench_threaded(int frames)
+{
+    ui::Display d{std::make_unique<Slow_backend>(50,160)};
+    auto& lv = d.level_view();
+    ui::load_level("demo_level.txt",lv);
+    for(bool threaded : {false,true}) {
+        d.set_threaded(threaded);
+        const long dropped = d.frames_dropped();
+        report(threaded? "Slow terminal, threaded" : "Slow terminal",
+                run(d,frames,[&](int i) {
+                    lv.set_focus(i%lv.width(),lv.height()/2);
+                }));
+        d.wait_for_render();
+        std::cerr<<"  "<<d.frames_dropped()-dropped<<" frames dropped\n";
+    }
+}
+
+//Walking over the demo level with a minimap of it and a side panel of
+//  stats beside the main view, the minimap's marker moving every frame
+//  and the panel changing every tenth.
+void bench_panes(int frames)
+{
+    ui::Display d{std::make_unique<ui::Headless_backend>(50,160)};
+    auto& lv = d.level_view();
+    ui::load_level("demo_level.txt",lv);
+    d.set_level_rect(ui::Pane_rect{0,1,-1,-40});
+    auto& map = d.add_view("minimap",ui::Pane_rect{-40,1,20,40});
+    map.resize(20,40);
+    auto& panel = d.add_view("panel",ui::Pane_rect{-40,21,-1,40});
+    panel.resize(27,40);
+    const auto marker = map.add_layer("marker",1);
+    report("Level, minimap and panel",run(d,frames,[&](int i) {
+        const int x = i%lv.width(), y = i%lv.height();
+        lv.set_focus(x,y);
+        map.clear(marker);
+        map.render(marker,x*map.width()/lv.width(),
+                y*map.height()/lv.height(),'@',ui::Colour::white);
+        if(i%10==0) {
+            const std::string turn = std::to_string(i/10);
+            for(int j=0; j<int(turn.size()); ++j)
+                panel.render(j,0,turn[j]);
+        }
+    }));
+    report("Minimap alone changing",run(d,frames,[&](int i) {
+        map.clear(marker);
+        map.render(marker,i%map.width(),i%map.height(),'@');
+    }));
+}
+
+//A heat map of smoothly shaded cells changing every frame, in new shades
+//  each frame, sent to the terminal as the 256 colours and as 24-bit colour.
+void bench_heat_map(int frames)
+{
+    std::FILE* null = std::fopen("/dev/null","w");
+    if(not null)
+        return;
+    for(const char* colorterm : {"","truecolor"}) {
+        setenv("COLORTERM",colorterm,1);
+        ui::Display d{std::make_unique<ui::Ansi_backend>(fileno(null),50,160)};
+        auto& lv = d.level_view();
+        lv.resize(49,160);
+        const std::size_t sent = d.backend().bytes_sent();
+        report(std::string{"Heat map, "}+(*colorterm? "24-bit" : "256 colours"),
+                run(d,frames,[&](int frame) {
+                    for(int y=0; y<lv.height(); ++y)
+                        for(int x=0; x<lv.width(); ++x) {
+                            const int heat = (x+y+frame)*4%256;
+                            const auto c = ui::Term_colour::rgb(heat,
+                                    frame%256,255-heat);
+                            lv.render(x,y,L'#',ui::attrib::colours(c));
+                        }
+                }));
+        std::cerr<<"  "<<double(d.backend().bytes_sent()-sent)/frames
+            <<" bytes/frame sent to the terminal\n";
+    }
+    unsetenv("COLORTERM");
+    std::fclose(null);
+}
+
+//Time to draw entities entities a frame, one render call each and in a batch.
+void bench_entities(ui::Display& d, int entities, int frames)
+{
+    auto& lv = d.level_view();
+    lv.resize(synthetic_level(500,500));
+    lv.set_focus(250,250);
+    const char32_t glyphs[]{U'g',U'o',U'k',U'D',U'@',U'£',U'Ж',U'&'};
+    const std::vector<std::string> utf8_glyphs{"g","o","k","D","@",u8"£",
+        u8"Ж","&"};
+    std::vector<ui::Entity> records;
+    std::vector<int> xs, ys;
+    std::vector<char32_t> cps;
+    std::vector<ui::Colour> colours;
+    std::vector<int> kinds;
+    unsigned seed = 1;
+    for(int i=0; i<entities; ++i) {
+        seed = seed*1103515245+12345;
+        const int x = (seed>>8)%lv.width(), y = (seed>>4)%lv.height();
+        const int kind = i%8;
+        const auto c = static_cast<ui::Colour>(1+i%16);
+        records.push_back(ui::Entity{x,y,glyphs[kind],c});
+        xs.push_back(x);
+        ys.push_back(y);
+        cps.push_back(glyphs[kind]);
+        colours.push_back(c);
+        kinds.push_back(kind);
+    }
+    const ui::Entity_arrays arrays{xs.data(),ys.data(),cps.data(),
+        colours.data(),xs.size()};
+    auto time = [&](const std::string& name, std::function<void()> draw) {
+        d.show_changes();
+        double us = 0;
+        for(int i=0; i<frames; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            draw();
+            std::chrono::duration<double,std::micro> t =
+                std::chrono::steady_clock::now()-start;
+            us += t.count();
+            d.show_changes();
+        }
+        std::cerr<<entities<<" entities, "<<name<<": "<<us/frames
+            <<"us/frame\n";
+    };
+    time("render(x,y,string_ref,Colour) each",[&] {
+        for(int i=0; i<entities; ++i)
+            lv.render(xs[i],ys[i],utf8_glyphs[kinds[i]],colours[i]);
+    });
+    time("render(Entity*,n)",[&] {
+        lv.render(records.data(),records.size());
+    });
+    time("render(Entity_arrays)",[&] {
+        lv.render(arrays);
+    });
+    auto layer = lv.add_layer("entities",1);
+    time("layer, render(Layer,x,y,string_ref,Colour) each",[&] {
+        lv.clear(layer);
+        for(int i=0; i<entities; ++i)
+            lv.render(layer,xs[i],ys[i],utf8_glyphs[kinds[i]],colours[i]);
+    });
+    time("layer, render(Layer,Entity*,n)",[&] {
+        lv.clear(layer);
+        lv.render(layer,records.data(),records.size());
+    });
+    lv.clear(layer);
+}
+
+//Time to load a level file and find its markers, as demo.cpp did before
+//  load_level and with load_level.
+void bench_load(const std::vector<std::string>& grid)
+{
+    char path[] = "/tmp/ui_bench_levelXXXXXX";
+    int fd = mkstemp(path);
+    if(fd<0)
+        throw std::runtime_error{"Unable to create a temporary level file."};
+    close(fd);
+    std::size_t bytes = 0;
+    {
+        std::ofstream os{path};
+        for(std::string ln : grid) {
+            for(std::size_t i=3; i<ln.size(); i+=37)
+                ln.replace(i,1,u8"£");
+            os<<ln<<'\n';
+            bytes += ln.size()+1;
+        }
+    }
+    const std::string level_name = std::to_string(grid[0].size())+"x"
+        +std::to_string(grid.size())+" level file ("
+        +std::to_string(bytes/1000000)+"MB)";
+    auto time = [&](const std::string& name, std::function<int()> load) {
+        auto start = std::chrono::steady_clock::now();
+        int markers = load();
+        std::chrono::duration<double,std::milli> t =
+            std::chrono::steady_clock::now()-start;
+        std::cerr<<level_name<<", "<<name<<": "<<t.count()<<"ms ("
+            <<markers<<" markers)\n";
+    };
+    ui::Level_view lv;
+    time("getline and offset_next",[&] {
+        std::vector<std::string> level;
+        std::vector<ui::Position> coins, doors;
+        std::ifstream is{path};
+        for(std::string ln; getline(is,ln);) {
+            const int y = level.size();
+            level.push_back(ln);
+            int x = 0;
+            for(int i=0; i<ln.size(); ++x) {
+                int offset = utf8::offset_next(ln[i]);
+                std::string p = ln.substr(i,offset);
+                if(p==u8"£")
+                    coins.push_back(ui::Position{x,y});
+                else if(p=="+")
+                    doors.push_back(ui::Position{x,y});
+                i += offset;
+            }
+        }
+        lv.resize(level);
+        lv.clear();
+        lv.render(level);
+        return int(coins.size()+doors.size());
+    });
+    std::vector<int> thread_counts{1};
+    if(std::thread::hardware_concurrency()>1)
+        thread_counts.push_back(std::thread::hardware_concurrency());
+    for(int threads : thread_counts)
+        time("load_level, "+std::to_string(threads)+" threads",[&] {
+            auto m = ui::load_level(path,lv,{u8"£","+"},threads);
+            return int(m[u8"£"].size()+m["+"].size());
+        });
+    std::remove(path);
+}
+
+}
+
+int main(int argc, char* argv[])
+try {
+    bool use_ncurses = argc>1 and std::strcmp(argv[1],"--ncurses")==0;
+    if(use_ncurses) {
+        --argc;
+        ++argv;
+        setenv("LINES","50",0);
+        setenv("COLUMNS","160",0);
+    }
+    const int frames = argc>1? std::atoi(argv[1]) : 200;
+    auto d = use_ncurses? ui::Display()
+        : ui::Display(std::make_unique<ui::Headless_backend>(50,160));
+    //Only has an effect if built with UI_FRAME_PROFILE.
+    d.set_profiling(true);
+    if(const char* path = std::getenv("UI_BENCH_PROFILE"))
+        d.profiler().dump_to(path);
+    d.status_bar().add("Health");
+    d.status_bar().set("Health","10/10",ui::Colour::green);
+    bench_level(d,"demo_level.txt",load_level("demo_level.txt"),frames);
+    bench_level(d,"500x500",synthetic_level(500,500),frames);
+    d.level_view().set_backing_store("",64);
+    bench_level(d,"4000x4000 (64 tiles kept)",
+            synthetic_level(4000,4000),frames);
+    bench_status(frames);
+    bench_messages(frames);
+    bench_recording(frames);
+    for(int n : {1,10,100})
+        bench_spectators(frames,n);
+    bench_threaded(frames);
+    bench_panes(frames);
+    bench_completion();
+    if(not use_ncurses) {
+        ui::Display held{std::make_unique<ui::Headless_backend>(50,160)};
+        ui::load_level("demo_level.txt",held.level_view());
+        bench_held_key(held,static_cast<ui::Headless_backend*>(&held.backend()));
+    }
+    bench_heat_map(frames/10+1);
+    bench_entities(d,100000,frames/10+1);
+    bench_load(synthetic_level(2000,2000));
+}
+catch (std::exception& e) {
+    std::cerr<<e.what()<<'\n';
+    return 1;
+}
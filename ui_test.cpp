@@ -0,0 +1,1388 @@
+//Regression tests for ui::Display, run against Headless_backend.
+//  Prints any failures and returns non-zero if there were some.
+#include "ui.h"
+#include "backend.h"
+#include "level_file.h"
+#include "recording.h"
+#include "spectator.h"
+#include "utf8.h"
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if(not ok) {
+        std::cerr<<"FAILED: "<<what<<'\n';
+        ++failures;
+    }
+}
+
+//The headless backend needs to be reachable after the Display owns it.
+struct Test_display {
+    Test_display(int height, int width)
+    {
+        auto b = std::make_unique<ui::Headless_backend>(height,width);
+        backend = b.get();
+        display = std::make_unique<ui::Display>(std::move(b));
+    }
+    ui::Headless_backend* backend;
+    std::unique_ptr<ui::Display> display;
+};
+
+//The code points of s, each found by utf8::at.
+std::vector<std::string> code_points(const std::string& s)
+{
+    std::vector<std::string> res;
+    for(int i=0; i<int(utf8::size(s)); ++i)
+        res.push_back(utf8::at(s,i));
+    return res;
+}
+
+//Whether is has the code points cps, by index, range and iteration.
+bool same_code_points(const utf8::indexed_string& is,
+        const std::vector<std::string>& cps)
+{
+    bool same = is.size()==cps.size();
+    std::string all;
+    for(std::size_t i=0; i<cps.size() and same; ++i) {
+        same = is.at(i)==cps[i];
+        all += cps[i];
+    }
+    same = same and is.str()==all;
+    for(std::size_t i=0; i<cps.size() and same; i+=13)
+        for(std::size_t n : {std::size_t(0),std::size_t(1),std::size_t(64),
+                std::size_t(150),utf8::indexed_string::npos}) {
+            std::string expected;
+            for(std::size_t j=i; j<cps.size() and j-i<n; ++j)
+                expected += cps[j];
+            same = same and is.substr(i,n)==expected;
+        }
+    std::size_t i = 0;
+    for(auto it=is.begin(); it!=is.end() and same; ++it, ++i)
+        same = i<cps.size() and *it==cps[i];
+    bool thrown = false;
+    try {
+        is.at(cps.size());
+    }
+    catch(std::out_of_range&) {
+        thrown = true;
+    }
+    return same and i==cps.size() and thrown;
+}
+
+const std::vector<std::string> level{
+    u8"#####",
+    u8"#.£.#",
+    u8"#####"
+};
+
+void test_indexed_string()
+{
+    //Code points of each length, over several of the offsets recorded.
+    std::string text;
+    for(int i=0; i<300; ++i)
+        text += std::vector<std::string>{"a",u8"Я",u8"是",u8"𝄞"}[i*7%11%4];
+    std::vector<std::string> cps = code_points(text);
+    utf8::indexed_string is{text};
+    check(cps.size()==300 and same_code_points(is,cps),
+            "Indexed string as utf8::at");
+    check(is.at(299)==cps[299] and is.at(5)==cps[5],
+            "Indexed string read out of order");
+    //Edits before and after the offsets recorded, each read to the end
+    //  first so there are offsets to be discarded.
+    auto edited = [&](std::size_t index, std::size_t count,
+            const std::string& s, const std::string& what) {
+        is.at(is.size()-1);
+        if(count==0)
+            is.insert(index,s);
+        else if(s.empty())
+            is.erase(index,count);
+        else
+            is.replace(index,count,s);
+        auto replacement = code_points(s);
+        cps.erase(cps.begin()+index,cps.begin()+
+                (count>cps.size()-index? cps.size() : index+count));
+        cps.insert(cps.begin()+index,replacement.begin(),replacement.end());
+        check(same_code_points(is,cps),what);
+    };
+    edited(10,0,u8"𝄞是Я","Insert before an offset recorded");
+    edited(200,0,std::string(70,'b'),"Insert after offsets recorded");
+    edited(60,10,"","Erase across an offset recorded");
+    edited(127,1,u8"ЯЯ","Replace just before an offset recorded");
+    edited(128,5,u8"是","Replace at an offset recorded");
+    edited(250,utf8::indexed_string::npos,"","Erase to the end");
+    edited(0,3,u8"𝄞","Replace the start");
+    is.append(u8"末");
+    cps.push_back(u8"末");
+    check(same_code_points(is,cps),"Append");
+    bool thrown = false;
+    try {
+        is.insert(3,"\xC0\x80");
+    }
+    catch(std::runtime_error&) {
+        thrown = true;
+    }
+    check(thrown and same_code_points(is,cps),
+            "Badly formed insert rejected, leaving the string");
+}
+
+void test_level_view()
+{
+    Test_display t{5,8};
+    auto& d = *t.display;
+    d.level_view().resize(level);
+    d.level_view().render(level);
+    d.level_view().render(1,1,'@',ui::Colour::white);
+    d.status_bar().add("HP");
+    d.status_bar().set("HP","9");
+    d.show_changes();
+    check(t.backend->text()==
+            "        \n"
+            "#####   \n"
+            u8"#@£.#   \n"
+            "#####   \n"
+            "HP: 9   ","Level and status bar drawn");
+    check(t.backend->screen().at(1,2).attrib
+            ==static_cast<int>(ui::Colour::white),"Colour of @");
+    check(d.frame_stats().cells==40,"First frame draws every cell");
+}
+
+//Cells share palette entries, which must not be confused.
+void test_level_palette()
+{
+    Test_display t{3,8};
+    auto& d = *t.display;
+    auto& lv = d.level_view();
+    lv.resize(1,8);
+    lv.render(0,0,'a',ui::Colour::red);
+    lv.render(1,0,'a',ui::Colour::green);
+    lv.render(2,0,u8"£",ui::Colour::red);
+    lv.render(3,0,u8"£",ui::Colour::red);
+    lv.render(4,0,L'\x4E00',ui::Colour::blue);
+    d.show_changes();
+    check(t.backend->row(1)==u8"aa££\u4E00   ","Interned glyphs drawn");
+    check(t.backend->screen().at(1,1).attrib==int(ui::Colour::green)
+            and t.backend->screen().at(3,1).attrib==int(ui::Colour::red),
+            "Interned colours drawn");
+    lv.clear();
+    lv.render(0,0,'b',ui::Colour::green);
+    d.show_changes();
+    check(t.backend->row(1)=="b       ","Palette reset by clear");
+}
+
+//Tiles evicted to the backing store must come back unchanged.
+void test_level_tiles()
+{
+    Test_display t{6,10};
+    auto& d = *t.display;
+    auto& lv = d.level_view();
+    lv.resize(4000,4000);
+    lv.set_backing_store("",9);
+    for(int i=0; i<60; ++i)
+        lv.render(i*64+i,i*64+1,wchar_t(L'a'+i%26),ui::Colour::green);
+    check(lv.resident_tiles()<=9,"Tiles evicted");
+    bool all_shown = true;
+    for(int i=7; i<60; i+=7) {
+        lv.set_focus(i*64+i,i*64+1);
+        d.show_changes();
+        const ui::Cell& c = t.backend->screen().at(5,3);
+        all_shown = all_shown and c.ch==wchar_t(L'a'+i%26)
+            and c.attrib==int(ui::Colour::green);
+    }
+    check(all_shown,"Evicted tiles paged back in");
+    check(lv.resident_tiles()<=9,"Tiles near the focus kept");
+    lv.resize(2,2);
+    lv.resize(100,100);
+    lv.set_focus(0,0);
+    d.show_changes();
+    check(t.backend->row(2)=="a         ","Resizing keeps cells inside");
+    lv.set_focus(65,65);
+    d.show_changes();
+    check(t.backend->screen().at(5,3).ch==L' ',"Resizing loses cells outside");
+}
+
+void test_load_level()
+{
+    char path[] = "/tmp/ui_test_levelXXXXXX";
+    int fd = mkstemp(path);
+    check(fd>=0,"Create temporary level file");
+    if(fd<0)
+        return;
+    close(fd);
+    std::ofstream{path}<<u8"#####\r\n#@£.#\n#£###\n";
+    Test_display t{5,8};
+    auto& d = *t.display;
+    auto m = ui::load_level(path,d.level_view(),{u8"£","@","+"},2);
+    check(d.level_view().width()==5 and d.level_view().height()==3,
+            "Level file size");
+    check(m[u8"£"].size()==2 and m[u8"£"][0].x==2 and m[u8"£"][0].y==1
+            and m[u8"£"][1].x==1 and m[u8"£"][1].y==2,"Markers found in order");
+    check(m["@"].size()==1 and m["+"].empty(),"Every marker in the index");
+    d.show_changes();
+    check(t.backend->row(2)==u8"#@£.#   ","Level file rendered");
+    std::ofstream{path}<<"###\n#\xC0\x80#\n";
+    bool thrown = false;
+    try {
+        ui::load_level(path,d.level_view());
+    }
+    catch(ui::Exception&) {
+        thrown = true;
+    }
+    check(thrown,"Badly formed level file rejected");
+
+    //Large enough to be split between threads, the same as read by one.
+    std::string big;
+    for(int y=0; y<4000; ++y) {
+        std::string line(40+y%61,'.');
+        line[y%37] = '@';
+        for(int x=0; x<y%5; ++x)
+            line += u8"£#";
+        big += line+(y%3? "\n" : "\r\n");
+    }
+    std::ofstream{path,std::ios::binary}<<big;
+    ui::Level_view one, split;
+    const std::vector<std::string> markers{u8"£","@"};
+    auto m1 = ui::load_level(path,one,markers,1);
+    auto m4 = ui::load_level(path,split,markers,4);
+    bool same = big.size()>4*64*1024 and one.height()==4000
+        and split.height()==one.height() and split.width()==one.width();
+    for(int y=0; y<one.height() and same; ++y)
+        for(int x=0; x<one.width() and same; ++x)
+            same = split.at(x,y)==one.at(x,y);
+    check(same,"Level split between threads read as by one");
+    bool found_same = m1.size()==m4.size();
+    for(const auto& m : markers)
+        found_same = found_same and m4[m].size()==m1[m].size()
+            and std::equal(m1[m].begin(),m1[m].end(),m4[m].begin(),
+                    [](ui::Position a, ui::Position b) {
+                        return a.x==b.x and a.y==b.y;
+                    });
+    check(found_same and m1["@"].size()==4000 and m1["@"][3999].y==3999,
+            "Markers split between threads found as by one");
+    const std::size_t bad = big.find('.',big.size()-200);
+    big.replace(bad,1,"\xC0\x80");
+    std::ofstream{path,std::ios::binary}<<big;
+    std::string error;
+    try {
+        ui::load_level(path,split,markers,4);
+    }
+    catch(ui::Exception& e) {
+        error = e.what();
+    }
+    const int bad_line = std::count(big.begin(),big.begin()+bad,'\n')+1;
+    check(error.find("line "+std::to_string(bad_line)+" of")
+            !=std::string::npos,"Badly formed line found by a later thread");
+    std::remove(path);
+}
+
+void test_layers()
+{
+    Test_display t{5,8};
+    auto& d = *t.display;
+    auto& lv = d.level_view();
+    lv.resize(level);
+    lv.render(level);
+    auto actors = lv.add_layer("actors",2);
+    auto items = lv.add_layer("items",1);
+    check(lv.layer("items").index==items.index,"Layer found by name");
+    lv.render(items,3,1,'!',ui::Colour::red);
+    lv.render(actors,1,1,'@');
+    d.show_changes();
+    check(t.backend->row(2)==u8"#@£!#   ","Layers drawn over the level");
+    for(int x=2; x<=3; ++x) {
+        lv.erase(actors,x-1,1);
+        lv.render(actors,x,1,'@');
+        d.show_changes();
+        check(d.frame_stats().cells==2,"Moving an actor redraws two cells");
+    }
+    check(t.backend->row(2)==u8"#.£@#   ","Higher layer drawn over lower");
+    lv.erase(actors,3,1);
+    d.show_changes();
+    check(t.backend->row(2)==u8"#.£!#   ","Erasing uncovers the layer below");
+    lv.render(3,1,'~');
+    d.show_changes();
+    check(t.backend->row(2)==u8"#.£!#   ","Level changes under a layer hidden");
+    lv.clear(items);
+    d.show_changes();
+    check(t.backend->row(2)==u8"#.£~#   ","Clearing a layer uncovers the level");
+}
+
+void test_entities()
+{
+    Test_display t{5,8};
+    auto& d = *t.display;
+    auto& lv = d.level_view();
+    lv.resize(level);
+    lv.render(level);
+    auto items = lv.add_layer("items",1);
+    const ui::Entity entities[]{
+        {3,1,U'!',ui::Colour::red}, {1,1,U'@',ui::Colour::white}
+    };
+    lv.render(entities,2);
+    d.show_changes();
+    check(t.backend->row(2)==u8"#@£!#   ","Entities drawn");
+    check(t.backend->screen().at(3,2).attrib==ui::colour_attrib(ui::Colour::red)
+            and lv.at(3,1)==ui::Cell{L'!',ui::colour_attrib(ui::Colour::red)},
+            "Entity colour as render() shows it");
+    const int xs[]{1,2}, ys[]{0,0};
+    const char32_t glyphs[]{U'a',U'\x4E00'};
+    const ui::Colour colours[]{ui::Colour::green,ui::Colour::blue};
+    lv.render(items,ui::Entity_arrays{xs,ys,glyphs,colours,2});
+    d.show_changes();
+    check(t.backend->row(1)==u8"#a\u4E00##   ","Entity arrays drawn on a layer");
+    check(t.backend->screen().at(2,1).attrib
+            ==ui::colour_attrib(ui::Colour::blue),"Entity colour on a layer");
+    const ui::Entity bad[]{{1,1,U'x',ui::Colour::normal},
+        {5,1,U'x',ui::Colour::normal}};
+    bool thrown = false;
+    try {
+        lv.render(bad,2);
+    }
+    catch(std::out_of_range&) {
+        thrown = true;
+    }
+    d.show_changes();
+    check(thrown and t.backend->row(2)==u8"#@£!#   ",
+            "Nothing drawn if an entity is outside the level");
+}
+
+void test_damage_tracking()
+{
+    Test_display t{5,8};
+    auto& d = *t.display;
+    d.level_view().resize(level);
+    d.level_view().render(level);
+    d.level_view().render(1,1,'@');
+    d.show_changes();
+    d.show_changes();
+    check(d.frame_stats().cells==0,"Nothing sent when nothing changed");
+    d.level_view().render(1,1,'.');
+    d.level_view().render(2,1,'@');
+    t.backend->reset_counters();
+    d.show_changes();
+    check(d.frame_stats().cells==2,"Only moved cells sent");
+    check(t.backend->counters().cells==2,"Backend only given moved cells");
+    check(t.backend->row(2)=="#.@.#   ","Moved @ shown");
+    d.redraw();
+    d.show_changes();
+    check(d.frame_stats().cells==40,"redraw() sends every cell");
+    check(t.backend->counters().clears==1,"redraw() clears the terminal");
+}
+
+//Moving the focus up and down a tall level scrolls the terminal.
+void test_scrolling()
+{
+    std::vector<std::string> tall;
+    for(int y=0; y<40; ++y)
+        tall.push_back("row "+std::to_string(y)+std::string(y%7,'#'));
+    auto show = [&](Test_display& t, int focus_x, int focus_y) {
+        t.display->level_view().set_focus(focus_x,focus_y);
+        t.display->show_changes();
+        return t.backend->text();
+    };
+    Test_display t{8,12}, fresh{8,12};
+    for(auto d : {t.display.get(),fresh.display.get()}) {
+        d->level_view().resize(40,24); //Wider than the screen.
+        d->level_view().render(tall);
+    }
+    show(t,0,10);
+    t.backend->reset_counters();
+    bool same = show(t,0,11)==show(fresh,0,11);
+    check(t.backend->counters().scrolls==1 and t.display->frame_stats().cells
+            <=2*12,"One row written after scrolling down");
+    same = same and show(t,0,8)==show(fresh,0,8);
+    check(t.backend->counters().scrolls==2 and t.display->frame_stats().cells
+            <=3*12,"Rows uncovered written after scrolling up");
+    check(same,"Same screen as drawing without scrolling");
+    show(t,30,8);
+    check(t.backend->counters().scrolls==2,"No scrolling moving sideways");
+    show(t,30,30);
+    check(t.backend->counters().scrolls==2,"No scrolling for a whole screen");
+}
+
+void test_panes()
+{
+    std::vector<std::string> tall;
+    for(int y=0; y<40; ++y)
+        tall.push_back("row "+std::to_string(y)+std::string(y%7,'#'));
+    Test_display t{8,20};
+    auto& d = *t.display;
+    d.level_view().resize(40,24);
+    d.level_view().render(tall);
+    d.level_view().set_focus(0,10);
+    d.status_bar().add("HP");
+    auto& map = d.add_view("minimap",ui::Pane_rect{-4,1,3,4});
+    map.resize(3,4);
+    map.render({"....","..@.","...."});
+    auto& panel = d.add_view("panel",ui::Pane_rect{-4,4,-1,4});
+    panel.resize(1,4);
+    const char32_t hp[]{U'H',U'P',U'1',U'0'};
+    panel.render(0,0,hp,4,ui::Colour::red);
+    d.set_level_rect(ui::Pane_rect{0,1,-1,-5});
+    d.show_changes();
+    check(t.backend->row(2)==u8"row 8#          ..@."
+            and t.backend->row(4)==u8"row 10###       HP10"
+            and t.backend->screen().at(16,4).attrib
+                ==ui::colour_attrib(ui::Colour::red),
+            "Panes drawn beside the level");
+    check(d.view("panel").width()==4 and t.backend->screen().cursor_x()==0
+            and t.backend->screen().cursor_y()==4,
+            "Cursor kept at the focus of the level view");
+    bool thrown = false;
+    try {
+        d.add_view("panel",ui::Pane_rect{});
+    }
+    catch(ui::Exception&) {
+        thrown = true;
+    }
+    check(thrown,"Panes named once");
+
+    //Only the rows of panes that drew something are compared.
+    map.render(2,1,'.');
+    map.render(3,1,'@');
+    d.show_changes();
+    check(d.frame_stats().cells==2 and d.frame_stats().visited==(1+3)*20,
+            "Pane changed alone");
+    d.show_changes();
+    check(d.frame_stats().visited==20,"Unchanged panes not compared");
+
+    //The level's rows are shared, so rewritten rather than scrolled.
+    Test_display fresh{8,20};
+    fresh.display->level_view().resize(40,24);
+    fresh.display->level_view().render(tall);
+    fresh.display->level_view().set_focus(0,11);
+    fresh.display->show_changes();
+    d.level_view().set_focus(0,11);
+    d.show_changes();
+    check(t.backend->counters().scrolls==0 and t.backend->row(2)
+            .compare(0,15,fresh.backend->row(2),0,15)==0,
+            "No scrolling while panes share the level's rows");
+
+    //The panes follow the edges of the terminal.
+    t.backend->resize(10,30);
+    d.show_changes();
+    check(t.backend->row(2).substr(26)=="...@"
+            and t.backend->row(4).substr(26)=="HP10","Panes kept at the edge");
+    d.remove_view("minimap");
+    d.set_level_rect(ui::Pane_rect{0,1,-1,0});
+    d.level_view().set_focus(0,11);
+    d.show_changes();
+    check(t.backend->row(2)=="row 8#"+std::string(24,' '),
+            "Level drawn over a pane removed");
+    thrown = false;
+    try {
+        d.view("minimap");
+    }
+    catch(ui::Exception&) {
+        thrown = true;
+    }
+    check(thrown,"Removed pane gone");
+
+    //Where no widget is, hiding the overlay blanks what it covered.
+    Test_display narrow{8,40};
+    narrow.display->set_level_rect(ui::Pane_rect{0,1,-1,10});
+    narrow.display->list_overlay().push_item("An overlay item that is long");
+    narrow.display->set_show_overlay(true);
+    narrow.display->show_changes();
+    narrow.display->set_show_overlay(false);
+    narrow.display->show_changes();
+    check(narrow.backend->row(1)==std::string(40,' ')
+            and narrow.backend->row(2)==std::string(40,' '),
+            "Overlay hidden outside the panes");
+}
+
+std::wstring screen_row(const ui::Screen_buffer& screen, int y)
+{
+    std::wstring res;
+    for(int x=0; x<screen.width(); ++x)
+        res += screen.at(x,y).ch;
+    return res;
+}
+
+void test_status_bar()
+{
+    ui::Screen_buffer screen;
+    screen.resize(1,25);
+    ui::Status_bar sb;
+    auto hp = sb.add("HP");
+    auto gold = sb.add("Gold");
+    auto xp = sb.add("XP");
+    sb.set(hp,"9");
+    sb.set(gold,"50");
+    sb.set(xp,"1");
+    sb.refresh(screen,0,0,1,25);
+    check(screen_row(screen,0)==L"HP: 9  Gold: 50  XP: 1   ",
+            "Stats that fit drawn");
+    //Only the changed value is redrawn when nothing moves.
+    screen.put(0,0,L'*');
+    sb.set(gold,"49",ui::Colour::red);
+    sb.refresh(screen,0,0,1,25);
+    check(screen_row(screen,0)==L"*P: 9  Gold: 49  XP: 1   "
+            and screen.at(13,0).attrib==int(ui::Colour::red),
+            "Same width value redrawn alone");
+    sb.set(hp,"10");
+    sb.set("Gold","500");
+    sb.refresh(screen,0,0,1,25);
+    check(screen_row(screen,0)==L"HP: 10  Gold: 500        ",
+            "Wider value moves the stats after it, dropping XP");
+}
+
+void test_overlay()
+{
+    Test_display t{6,20};
+    auto& d = *t.display;
+    d.level_view().resize(level);
+    d.level_view().render(level);
+    d.show_changes();
+    const std::string before = t.backend->text();
+    d.list_overlay().set_title("Items");
+    d.list_overlay().push_item("a - Cheese");
+    d.set_show_overlay(true);
+    d.show_changes();
+    check(t.backend->text().find("a - Cheese")!=std::string::npos,
+            "Overlay shown");
+    d.set_show_overlay(false);
+    d.show_changes();
+    check(t.backend->text()==before,"Hiding overlay restores the level");
+}
+
+void test_overlay_provider()
+{
+    Test_display t{6,20};
+    auto& d = *t.display;
+    int calls = 0;
+    d.list_overlay().set_provider(100000,
+            [&](int i, ui::List_overlay::Provided_item& item) {
+        ++calls;
+        item.text = "Item "+std::to_string(i);
+        item.heading = i%10==0;
+    },10);
+    d.set_show_overlay(true);
+    d.list_overlay().first_page();
+    d.show_changes();
+    check(calls==3,"Only the items on the page provided");
+    check(t.backend->row(1)=="      Item 0        ","Provided heading shown");
+    check(t.backend->row(2)=="     Item 1         ","Provided item shown");
+    d.list_overlay().next_page();
+    calls = 0;
+    d.show_changes();
+    check(calls==3 and t.backend->row(1)=="     Item 3         ",
+            "Next page provided");
+    check(t.backend->row(4).find("of 33334")!=std::string::npos,
+            "Page count from the item count");
+
+    //Shown without first_page(), the first page is.
+    Test_display fresh{6,20};
+    std::vector<int> asked;
+    fresh.display->list_overlay().set_provider(100,
+            [&](int i, ui::List_overlay::Provided_item& item) {
+        asked.push_back(i);
+        item.text = "Item "+std::to_string(i);
+    });
+    fresh.display->set_show_overlay(true);
+    fresh.display->show_changes();
+    check(asked==std::vector<int>{0,1,2}
+            and fresh.backend->row(4).find("page 1 of 34")!=std::string::npos,
+            "Provided overlay shown before first_page()");
+}
+
+void test_messages()
+{
+    Test_display t{3,30};
+    auto& d = *t.display;
+    d.queue_message("First.");
+    d.queue_message("Second.");
+    d.show_changes();
+    check(t.backend->row(0)=="First. --More--               ",
+            "--More-- shown when messages are queued");
+    d.next_message();
+    d.show_changes();
+    check(t.backend->row(0)=="Second.                       ",
+            "Next message shown");
+    d.show_changes();
+    check(t.backend->row(0)=="Second.                       ",
+            "--More-- not added again");
+
+    d.next_message();
+    for(int i=0; i<5; ++i)
+        d.queue_message("You hit the rat.");
+    d.queue_message(u8"A long message that won't fit.");
+    d.show_changes();
+    check(t.backend->row(0)=="You hit the rat. x5 --More--  ",
+            "Repeats counted");
+    d.next_message();
+    d.show_changes();
+    check(t.backend->row(0)=="A long message tha... --More--"
+            and d.messages_count()==2, "Long message cut");
+    d.next_message();
+    d.show_changes();
+    check(t.backend->row(0)=="t won't fit.                  "
+            and d.messages_count()==1, "Rest of long message shown");
+
+    const auto& log = d.message_log();
+    check(log.history_size()==4 and log.history(0).text=="A long message "
+            "that won't fit." and log.history(1).count==5
+            and log.history(3).text=="First.", "History, most recent first");
+}
+
+void test_message_log()
+{
+    ui::Message_log log{4,32,3};
+    for(int i=0; i<6; ++i)
+        log.queue(std::to_string(i));
+    check(log.pending()==4 and log.front()==L"2", "Oldest pending dropped");
+    log.pop();
+    log.queue("5");
+    check(log.pending()==3 and log.front()==L"3", "Repeat does not take a slot");
+    check(log.history_size()==3 and log.history(0).text=="5"
+            and log.history(0).count==2 and log.history(2).text=="3",
+            "History bounded by entries");
+
+    ui::Message_log arena{4,32,8};
+    for(auto msg : {"0123456789","abcdefghij","klmnopqrst","uvwxyzABCD"})
+        arena.queue(msg);
+    check(arena.history_size()==3 and arena.history(2).text=="abcdefghij"
+            and arena.history(0).text=="uvwxyzABCD",
+            "Oldest overwritten when the arena wraps");
+    arena.queue(u8"£££££££££££££££££");
+    check(arena.history_size()==1
+            and arena.history(0).text==u8"££££££££££££££££",
+            "Too long a message cut at a code point");
+    arena.queue(u8"£££££££££££££££££");
+    check(arena.history_size()==1 and arena.history(0).count==2,
+            "Repeat of too long a message counted");
+    //Of the same length, and the same as far as was kept.
+    arena.queue(u8"££££££££££££££££xy");
+    while(arena.pending()>1)
+        arena.pop();
+    check(arena.history_size()==1 and arena.history(0).count==1
+            and arena.front()==std::wstring(16,L'£')+L"xy",
+            "Too long a message differing after what was kept not a repeat");
+    bool thrown = false;
+    try {
+        log.history(3);
+    }
+    catch(std::out_of_range&) {
+        thrown = true;
+    }
+    check(thrown,"Out of range history");
+}
+
+void test_input()
+{
+    Test_display t{3,30};
+    auto& d = *t.display;
+    t.backend->push_input(u8"q£\n\x1b\x01");
+    t.backend->push_key(ui::Backend::key_up);
+    check(d.get_key()=="q","Printable key");
+    check(d.get_key()==u8"£","UTF-8 key");
+    check(d.get_key()=="\n","Enter");
+    check(d.get_key()=="Esc","Escape");
+    check(d.get_key()=="^A","Control key");
+    check(d.get_key()=="Up","Arrow key");
+
+    t.backend->push_input("dx\x7f" "e\t\n");
+    auto res = d.get_long_answer("# ",[](const std::string&) {
+        return std::string{"demo"};
+    });
+    check(res=="demo","Autocompletion accepted");
+}
+
+void test_completion()
+{
+    ui::Completion_index index{{"orc","orc captain",u8"orc £","ogre","rat",
+        "orc","giant rat",""}};
+    check(index.size()==6 and index.key(0)=="giant rat"
+            and index.key(2)=="orc" and index.key(3)=="orc captain",
+            "Keys sorted, duplicates and empty keys dropped");
+    ui::Completion_index::Search search{index};
+    check(search.count()==6,"Every key matches no text");
+    search.push("o");
+    search.push("r");
+    check(search.count()==3 and search.match(0)=="orc"
+            and search.match(2)==u8"orc £","Range narrowed");
+    search.push("c");
+    search.push(" ");
+    search.push(u8"£");
+    check(search.count()==1 and search.size()==5,"Multibyte code point");
+    search.push("x");
+    check(search.count()==0,"No match");
+    for(int i=0; i<4; ++i)
+        search.pop();
+    check(search.count()==3 and search.text()=="or","Range restored on pop");
+
+    Test_display t{3,30};
+    auto& d = *t.display;
+    t.backend->push_input("or\t\n");
+    check(d.get_long_answer("# ",index)=="orc captain","Tab cycles matches");
+    t.backend->push_input("gx");
+    t.backend->push_key(ui::Backend::key_backspace);
+    t.backend->push_key(ui::Backend::key_right);
+    t.backend->push_input("\n");
+    check(d.get_long_answer("# ",index)=="giant rat","Right takes the match");
+    t.backend->push_input("r");
+    t.backend->push_key(ui::Backend::key_up);
+    t.backend->push_input("\n");
+    check(d.get_long_answer("# ",index)=="rat","Up cycles back");
+
+    //Typing the next letter of the match shown only changes its colour.
+    t.backend->push_input("orc\n");
+    d.get_long_answer("# ",index);
+    check(d.frame_stats().cells==1,"Only the edited cells sent");
+}
+
+void test_key_events()
+{
+    Test_display t{3,30};
+    auto& d = *t.display;
+    t.backend->push_input(u8"q文");
+    t.backend->push_key(ui::Backend::key_page_down);
+    t.backend->push_key(ui::Backend::key_f0+12);
+    check(d.get_key_event()==ui::Key{'q'},"Printable key event");
+    check(d.get_key_event()==ui::Key{U'文'},"UTF-8 key event");
+    check(d.get_key_event()==ui::ctrl('x'),"Control key event");
+    check(d.get_key_event()==ui::Key{27},"Escape event");
+    check(d.get_key_event()==ui::Key::page_down,"Special key event");
+    check(d.get_key_event()==ui::function_key(12),"Function key event");
+    check(ui::key_name(ui::ctrl('x'))=="^X"
+            and ui::key_name(ui::Key::page_down)=="PageDown"
+            and ui::key_name(ui::function_key(12))=="F12"
+            and ui::key_name(U'文')==u8"文", "Key names");
+
+    enum class Action { left, right, quit };
+    static constexpr ui::Key_binding<Action> bindings[]{
+        {'h',Action::left}, {ui::Key::left,Action::left},
+        {'l',Action::right}, {ui::Key::right,Action::right},
+        {'q',Action::quit}, {ui::ctrl('c'),Action::quit}, {'q',Action::left},
+    };
+    const ui::Key_map<Action> keys{bindings};
+    check(*keys.find('h')==Action::left and *keys.find(ui::Key::right)
+            ==Action::right and *keys.find(ui::ctrl('C'))==Action::quit,
+            "Bound keys found");
+    check(*keys.find('q')==Action::quit,"First binding of a key used");
+    check(not keys.find('x') and not keys.find(ui::Key::up)
+            and not keys.find(ui::Key{'h',ui::Key::ctrl}),
+            "Unbound keys not found");
+}
+
+void test_event_loop()
+{
+    Test_display t{3,30};
+    auto& d = *t.display;
+    ui::Key key;
+    check(not d.poll_key_event(key,0),"No key within timeout");
+    t.backend->push_input("x");
+    check(d.poll_key_event(key,0) and key==ui::Key{'x'},"Key polled");
+
+    t.backend->push_input("lll");
+    std::vector<long> frame_of_key;
+    int ticks = 0;
+    d.add_timer(5,[&] {
+        return ++ticks<3;
+    });
+    const int removed = d.add_timer(1,[&] {
+        check(false,"Removed timer not run");
+        return true;
+    });
+    d.remove_timer(removed);
+    d.add_timer(80,[&] {
+        t.backend->push_input("q");
+        return false;
+    });
+    const long frames_before = t.backend->counters().frames;
+    d.run([&](ui::Key k) {
+        frame_of_key.push_back(t.backend->counters().frames);
+        return k!='q';
+    });
+    check(frame_of_key.size()==4 and frame_of_key[0]==frame_of_key[2],
+            "Keys typed ahead handled before a frame is drawn");
+    check(ticks==3,"Timer run until it returns false");
+    const long frames = t.backend->counters().frames-frames_before;
+    check(frames>=3 and frames<=6,"Frames drawn only after keys and timers");
+    const auto& latency = d.input_latency();
+    check(latency.frames==1 and latency.last_us>1000 and latency.last_us<1e6,
+            "Input latency up to the next frame due");
+}
+
+//A terminal that takes a while to show each frame.
+struct Slow_backend : ui::Headless_backend {
+    using Headless_backend::Headless_backend;
+    void flush() override
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        Headless_backend::flush();
+    }
+};
+
+void test_threaded()
+{
+    auto b = std::make_unique<Slow_backend>(3,20);
+    auto backend = b.get();
+    ui::Display d{std::move(b)};
+    d.set_threaded(true);
+    d.level_view().resize(level);
+    d.level_view().render(level);
+    d.status_bar().add("HP");
+    auto start = std::chrono::steady_clock::now();
+    for(int i=0; i<10; ++i) {
+        d.status_bar().set("HP",std::to_string(i));
+        d.show_changes();
+    }
+    std::chrono::duration<double> t = std::chrono::steady_clock::now()-start;
+    check(t.count()<0.1,"Frames handed over without waiting for the terminal");
+    d.wait_for_render();
+    check(d.frames_dropped()>0 and backend->counters().frames<10,
+            "Frames the terminal fell behind on dropped");
+    check(backend->row(2).find("HP: 9")!=std::string::npos
+            and backend->row(1).find("#####")!=std::string::npos,
+            "Last frame drawn");
+    d.status_bar().set("HP","10");
+    d.show_changes(); //Being drawn while the next two are shown.
+    d.redraw();
+    d.show_changes();
+    d.status_bar().set("HP","11");
+    d.show_changes();
+    d.set_threaded(false);
+    check(d.frames_dropped()==0 and backend->row(2).find("HP: 11")
+            !=std::string::npos,"Last frame drawn on stopping");
+    check(backend->counters().clears==2,"Redraw kept if its frame is dropped");
+    d.show_changes();
+    check(d.frame_stats().cells==0,"Unthreaded again with the terminal known");
+
+    bool thrown = false;
+    try {
+        struct Blocking : ui::Headless_backend {
+            bool concurrent_input() const override
+            {   return false;   }
+        };
+        ui::Display blocking{std::make_unique<Blocking>()};
+        blocking.set_threaded(true);
+    }
+    catch(ui::Exception&) {
+        thrown = true;
+    }
+    check(thrown,"Threading refused without concurrent input");
+}
+
+void test_profile()
+{
+    std::FILE* out = std::tmpfile();
+    if(not out) {
+        check(false,"Create temporary file for Ansi_backend");
+        return;
+    }
+    ui::Display d{std::make_unique<ui::Ansi_backend>(fileno(out),5,20)};
+    d.level_view().resize(level);
+    d.level_view().render(level);
+    d.level_view().render(1,1,'@',ui::Colour::white);
+    d.status_bar().add("HP");
+    d.set_profiling(true);
+    d.show_changes();
+    check(d.frame_stats().visited==100 and d.frame_stats().attrib_changes>0,
+            "Cells visited and attribute changes counted");
+    d.status_bar().set("HP","9");
+    const off_t written = lseek(fileno(out),0,SEEK_CUR);
+    d.show_changes();
+    const ui::Frame_stats& stats = d.frame_stats();
+    check(stats.text_bytes>0 and stats.terminal_bytes>stats.text_bytes
+            and off_t(stats.terminal_bytes)
+            ==lseek(fileno(out),0,SEEK_CUR)-written,
+            "Bytes sent counted, escape sequences included");
+#ifdef UI_FRAME_PROFILE
+    const std::string dump_path = "/tmp/ui_test_profile.json";
+    d.profiler().dump_to(dump_path);
+    d.show_changes();
+    d.profiler().dump_to("");
+    const ui::Frame_profile& p = d.profiler().last();
+    check(d.profiling() and d.profiler().frames()==3,"A profile per frame");
+    //Only the message line is compared when nothing else has changed.
+    check(p.cells_visited==20 and p.cells_emitted==0
+            and p.terminal_bytes==0 and p.total_us>=p.level_us,
+            "Profile of an unchanged frame");
+    check(d.profiler().percentile(&ui::Frame_profile::terminal_bytes,100)>100
+            and d.profiler().percentile(&ui::Frame_profile::cells_emitted,100)
+            ==100
+            and d.profiler().percentile(&ui::Frame_profile::cells_emitted,50)
+            <100,"Percentiles of the frames kept");
+    std::ifstream is{dump_path};
+    std::stringstream dump;
+    dump<<is.rdbuf();
+    check(dump.str().compare(0,14,"[\n{\"total_us\":")==0
+            and dump.str().find("\"cells_visited\":20")!=std::string::npos
+            and dump.str().substr(dump.str().size()-3)=="\n]\n",
+            "Profile written as JSON");
+    std::remove(dump_path.c_str());
+#else
+    check(not d.profiling() and d.profiler().frames()==0,
+            "No profiling unless built with UI_FRAME_PROFILE");
+#endif
+    std::fclose(out);
+}
+
+std::string screen_text(const ui::Screen_buffer& screen)
+{
+    std::string res;
+    char buf[4];
+    for(int y=0; y<screen.height(); ++y) {
+        for(int x=0; x<screen.width(); ++x) {
+            res.append(buf,utf8::encode(screen.at(x,y).ch,buf));
+            res += char('0'+screen.at(x,y).attrib%10);
+        }
+        res += '\n';
+    }
+    return res;
+}
+
+void test_recording()
+{
+    const std::string path = "/tmp/ui_test_recording";
+    std::vector<std::string> frames;
+    {
+        ui::Frame_recorder rec{path,3};
+        ui::Screen_buffer screen;
+        screen.resize(4,12);
+        for(int i=0; i<10; ++i) {
+            if(i==5)
+                screen.resize(5,10);
+            screen.put(i%10,i%4,L'@',i%3);
+            screen.put(0,3,std::wstring(8,L"#.£"[i%3]),1);
+            screen.set_cursor(i,1);
+            rec.add(screen,i*100);
+            frames.push_back(screen_text(screen));
+        }
+        check(rec.frames()==10 and rec.keyframes()==5,
+                "Keyframes every 3 frames and on resizing");
+    }
+    {
+        ui::Recording rec{path};
+        check(rec.frames()==10 and rec.duration_ms()==900,"Recording read");
+        bool same = true;
+        for(int i=0; i<10; ++i)
+            same = same and rec.next() and rec.frame()==i
+                and rec.time_ms()==i*100
+                and screen_text(rec.screen())==frames[i];
+        check(same and not rec.next(),"Every frame played back");
+        check(rec.screen().cursor_x()==9,"Cursor played back");
+        rec.seek(4);
+        same = rec.frame()==4 and screen_text(rec.screen())==frames[4];
+        rec.seek_time(750);
+        same = same and rec.frame()==7 and screen_text(rec.screen())
+            ==frames[7];
+        rec.seek(2);
+        same = same and rec.frame()==2 and screen_text(rec.screen())
+            ==frames[2];
+        check(same,"Seeking back and forth");
+    }
+    {
+        //Without the index, as if the program had crashed.
+        std::ifstream is{path,std::ios::binary};
+        std::string data{std::istreambuf_iterator<char>{is},{}};
+        const std::size_t index_size = 5*24+40;
+        std::ofstream{path,std::ios::binary}
+            <<data.substr(0,data.size()-index_size-3);
+        ui::Recording rec{path};
+        rec.seek(6);
+        check(rec.frames()==9 and rec.frame()==6
+                and screen_text(rec.screen())==frames[6],
+                "Recording read without its index");
+    }
+    //From what Display sends the terminal, scrolling included.
+    Test_display t{8,20};
+    auto& d = *t.display;
+    std::vector<std::string> tall;
+    for(int y=0; y<40; ++y)
+        tall.push_back("row "+std::to_string(y)+std::string(y%7,'#'));
+    d.record(path);
+    d.level_view().resize(40,24);
+    d.level_view().render(tall);
+    std::vector<std::string> shown;
+    for(int focus_y : {10,11,12,8,30}) {
+        d.level_view().set_focus(0,focus_y);
+        d.level_view().render(1,focus_y,'@',ui::Colour::red);
+        d.show_changes();
+        shown.push_back(t.backend->text());
+    }
+    check(d.recorder() and d.recorder()->frames()==5
+            and t.backend->counters().scrolls>0,"Display recorded");
+    d.record("");
+    ui::Recording rec{path};
+    Test_display replay{8,20};
+    bool same = true;
+    for(std::size_t i=0; i<shown.size(); ++i) {
+        same = same and rec.next();
+        replay.display->show_screen(rec.screen());
+        same = same and replay.backend->text()==shown[i];
+    }
+    check(same,"Recording shown as it was");
+    std::remove(path.c_str());
+}
+
+void test_spectating()
+{
+    const std::string path = "/tmp/ui_test_spectating";
+    Test_display t{8,20};
+    auto& d = *t.display;
+    std::vector<std::string> tall;
+    for(int y=0; y<40; ++y)
+        tall.push_back("row "+std::to_string(y)+std::string(y%7,'#'));
+    d.level_view().resize(40,24);
+    d.level_view().render(tall);
+    d.spectate(path);
+    d.record(path+".rec"); //Sharing what is encoded.
+    ui::Spectator_client early{path};
+    std::unique_ptr<ui::Spectator_client> late;
+    Test_display shown{8,20};
+    bool same = true;
+    for(int focus_y : {10,11,12,8,30}) {
+        if(focus_y==12)
+            late = std::make_unique<ui::Spectator_client>(path);
+        d.level_view().set_focus(0,focus_y);
+        d.show_changes();
+        for(auto client : {&early,late.get()}) {
+            if(not client)
+                continue;
+            same = same and client->receive();
+            shown.display->show_screen(client->screen());
+            same = same and shown.backend->text()==t.backend->text();
+        }
+    }
+    check(same,"Viewers shown every frame, scrolling included");
+    check(d.spectators()->viewers()==2 and early.frames()==5
+            and early.keyframes()==1 and late->frames()==3
+            and late->keyframes()==1,"Keyframes only for new viewers");
+    d.record("");
+    ui::Recording rec{path+".rec"};
+    rec.seek(4);
+    shown.display->show_screen(rec.screen());
+    check(shown.backend->text()==t.backend->text(),"Recorded while viewed");
+    std::remove((path+".rec").c_str());
+
+    //A viewer not reading falls behind without holding up the others.
+    ui::Spectator_server server{path+".slow",4096};
+    ui::Spectator_client fast{path+".slow"}, slow{path+".slow"};
+    ui::Frame_encoder encoder;
+    ui::Screen_buffer screen, last;
+    screen.resize(50,160);
+    for(int i=0; i<500 and server.drops()==0; ++i) {
+        for(int y=0; y<50; ++y)
+            for(int x=0; x<160; ++x)
+                screen.put(x,y,L"abc"[(i+x+y)%3],i%4);
+        encoder.begin_frame();
+        encoder.put_changes(screen,last);
+        encoder.end_frame(screen);
+        server.add(encoder);
+        fast.receive();
+    }
+    check(server.drops()>0 and fast.keyframes()==1,"Slow viewer dropped");
+    for(int i=0; i<1000 and slow.receive(); ++i)
+        server.poll();
+    check(screen_text(slow.screen())==screen_text(screen)
+            and slow.keyframes()==2,"Slow viewer sent a keyframe");
+    //Viewers connecting between frames let in and sent the last while
+    //  Display::run waits, on the render thread too when threaded.
+    for(bool threaded : {false,true}) {
+        d.set_threaded(threaded);
+        std::unique_ptr<ui::Spectator_client> idle;
+        std::thread viewer{[&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds{50});
+            idle = std::make_unique<ui::Spectator_client>(path);
+            for(int i=0; i<40 and idle->keyframes()==0; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds{5});
+                idle->receive();
+            }
+        }};
+        d.add_timer(400,[&] { //No frame drawn before this.
+            t.backend->push_input("q");
+            return false;
+        });
+        d.run([](ui::Key k) {   return k!='q';  });
+        viewer.join();
+        d.set_threaded(false);
+        shown.display->show_screen(idle->screen());
+        check(idle->keyframes()==1 and idle->frames()==1
+                and shown.backend->text()==t.backend->text(),
+                threaded? "Idle viewer sent a keyframe by the render thread"
+                : "Idle viewer sent a keyframe");
+    }
+    d.spectate("");
+    check(not early.receive(),"Viewers disconnected");
+}
+
+//Colours beyond those of Colour, from the attribute bits to each backend.
+void test_colours()
+{
+    using ui::Term_colour;
+    static_assert(Term_colour::rgb(255,0,0).nearest_index()
+            ==Term_colour::index(196),"Nearest of the colour cube");
+    static_assert(Term_colour::rgb(128,128,128).nearest_index()
+            ==Term_colour::index(244),"Nearest of the greys");
+    static_assert(Term_colour::index(10).nearest_basic()==2,
+            "Bright colours shown as the basic ones");
+    static_assert(ui::attrib::bg(ui::attrib::colours(Term_colour::index(3),
+                    Term_colour::rgb(1,2,3)))==Term_colour::rgb(1,2,3),
+            "Colours kept in the attribute");
+    static_assert(ui::colour_attrib(static_cast<ui::Colour>(1000))==0,
+            "Unknown colours shown as normal");
+    static_assert(ui::is_colour(ui::Colour::white)
+            and not ui::is_colour(static_cast<ui::Colour>(17))
+            and not ui::is_colour(static_cast<ui::Colour>(-1)),
+            "Colours known");
+
+    const ui::Attrib heat = ui::attrib::colours(Term_colour::rgb(255,0,0),
+            Term_colour::index(17))|ui::attrib::bold;
+    Test_display t{5,20};
+    auto& lv = t.display->level_view();
+    lv.resize(4,20);
+    lv.render(1,1,L'~',heat);
+    lv.render(lv.add_layer("effects",1),2,1,L'*',heat);
+    t.display->show_changes();
+    check(lv.at(1,1)==ui::Cell{L'~',heat},"Level shows a cell of any colour");
+    check(t.backend->screen().at(1,2)==ui::Cell{L'~',heat}
+            and t.backend->screen().at(2,2)==ui::Cell{L'*',heat},
+            "Colours reach the backend, layers included");
+    //Shades taking no room in the palette, so any number can be shown.
+    bool shaded = true;
+    lv.render(3,1,L'~',heat);
+    const std::size_t memory = lv.memory_used();
+    for(int i=0; i<70000 and shaded; ++i) {
+        const ui::Attrib shade = ui::attrib::colours(
+                Term_colour::rgb(i>>16,i>>8&0xFF,i&0xFF));
+        lv.render(3,1,L'~',shade);
+        shaded = lv.at(3,1)==ui::Cell{L'~',shade};
+        if(i%10000==0)
+            t.display->show_changes();
+    }
+    shaded = shaded and lv.memory_used()==memory;
+    lv.render(3,1,L'.');
+    check(shaded and lv.at(3,1)==ui::Cell{L'.',0},
+            "More shades over time than the palette holds");
+    //Entities drawn over them each frame leave nothing of them behind, in
+    //  any tile.
+    ui::Level_view big;
+    big.resize(200,200);
+    std::vector<ui::Entity> over;
+    for(int i=0; i<40; ++i)
+        over.push_back(ui::Entity{i*37%200,i*23%200,U'@',ui::Colour::white});
+    big.render(over.data(),over.size());
+    const std::size_t plain = big.memory_used();
+    for(int frame=0; frame<3; ++frame) {
+        for(const auto& o : over)
+            big.render(o.x,o.y,L'~',ui::attrib::colours(
+                        Term_colour::rgb(frame,o.x,o.y)));
+        big.render(over.data(),over.size());
+    }
+    check(big.memory_used()==plain and big.at(over[7].x,over[7].y)
+            ==ui::Cell{L'@',ui::colour_attrib(ui::Colour::white)},
+            "Shades drawn over by entities forgotten");
+    const std::string path = "/tmp/ui_test_colours.rec";
+    t.display->record(path);
+    t.display->redraw();
+    t.display->show_changes();
+    t.display->record("");
+    {
+        ui::Recording rec{path};
+        rec.seek(0);
+        check(rec.screen().at(2,2)==ui::Cell{L'*',heat},"Colours recorded");
+    }
+    std::remove(path.c_str());
+
+    //Pairs reassigned least recently used first once all are in use.
+    ui::Colour_pairs pairs{9,11};
+    bool assigned;
+    check(pairs.find(1,-1,assigned)==9 and assigned
+            and pairs.find(2,-1,assigned)==10 and assigned
+            and pairs.find(1,-1,assigned)==9 and not assigned
+            and pairs.find(3,4,assigned)==10 and assigned
+            and pairs.reassigned()==1 and pairs.size()==2,
+            "Colour pairs reused least recently used first");
+    check(ui::Colour_pairs{}.find(1,2,assigned)==0 and not assigned,
+            "No colour pairs to assign");
+
+    //Quantised to the 256 colours unless $COLORTERM says otherwise.
+    auto ansi_output = [](const char* colorterm, ui::Attrib a) {
+        std::string output;
+        std::FILE* out = std::tmpfile();
+        if(not out)
+            return output;
+        if(colorterm)
+            setenv("COLORTERM",colorterm,1);
+        else
+            unsetenv("COLORTERM");
+        {
+            ui::Ansi_backend b{fileno(out),2,10};
+            b.set_attrib(a);
+            b.write(L"x",1);
+            b.flush();
+        }
+        std::rewind(out);
+        char buf[256];
+        output.assign(buf,std::fread(buf,1,sizeof(buf),out));
+        std::fclose(out);
+        return output;
+    };
+    const char* saved = std::getenv("COLORTERM");
+    const std::string colorterm = saved? saved : "";
+    const ui::Attrib orange = ui::attrib::colours(Term_colour::rgb(255,135,0),
+            Term_colour::index(12));
+    check(ansi_output(nullptr,orange).find("\x1b[38;5;208;104mx")
+            !=std::string::npos,"256 colours sent as such");
+    check(ansi_output("truecolor",orange).find("\x1b[38;2;255;135;0;104mx")
+            !=std::string::npos,"24-bit colours sent as such");
+    if(saved)
+        setenv("COLORTERM",colorterm.c_str(),1);
+    else
+        unsetenv("COLORTERM");
+}
+
+//Ansi_backend reading keys from a pipe, and leaving SIGWINCH as it was.
+void test_ansi_input()
+{
+    int fds[2];
+    std::FILE* out = std::tmpfile();
+    if(not out or pipe(fds)!=0) {
+        check(false,"Create pipe and temporary file for Ansi_backend");
+        if(out)
+            std::fclose(out);
+        return;
+    }
+    struct sigaction previous{}, restored{};
+    previous.sa_handler = SIG_IGN;
+    sigaction(SIGWINCH,&previous,nullptr);
+    {
+        ui::Ansi_backend b{fileno(out),fds[0]};
+        const std::string typed = "\x1b[A\x1bx\x1b[";
+        check(write(fds[1],typed.data(),typed.size())==long(typed.size()),
+                "Write to pipe");
+        const std::vector<int> keys{b.read_key(0),b.read_key(0),
+            b.read_key(0),b.read_key(0),b.read_key(0),b.read_key(0)};
+        check(keys==std::vector<int>{ui::Backend::key_up,27,'x',27,'[',
+                ui::Backend::no_key},
+                "Escape then a key, an intro included, read as typed");
+        //Resizes signalled to this thread part way through a wait.
+        const pthread_t reader = pthread_self();
+        auto resize_then_type = [&](const std::string& typed) {
+            return std::thread{[&,typed] {
+                std::this_thread::sleep_for(std::chrono::milliseconds{5});
+                pthread_kill(reader,SIGWINCH);
+                std::this_thread::sleep_for(std::chrono::milliseconds{5});
+                if(not typed.empty() and write(fds[1],typed.data(),
+                            typed.size())!=long(typed.size()))
+                    std::abort();
+            }};
+        };
+        check(write(fds[1],"\x1b",1)==1,"Write to pipe");
+        auto typist = resize_then_type("[A");
+        const int key = b.read_key(1000);
+        typist.join();
+        check(key==ui::Backend::key_up,"Resize within an escape sequence");
+        b.height();
+        auto resizer = resize_then_type("");
+        const int resize = b.read_key(1000);
+        resizer.join();
+        check(resize==ui::Backend::key_resize and b.read_key(0)
+                ==ui::Backend::no_key,"Resize while waiting reported");
+    }
+    sigaction(SIGWINCH,nullptr,&restored);
+    check(restored.sa_handler==SIG_IGN,"SIGWINCH handler restored");
+    signal(SIGWINCH,SIG_DFL);
+    close(fds[0]);
+    close(fds[1]);
+    std::fclose(out);
+}
+
+//Output of Ansi_backend must match the golden file exactly.
+//  If UI_TEST_UPDATE_GOLDEN is set the golden file is rewritten instead.
+void test_ansi_golden(const std::string& data_dir)
+{
+    const std::string golden_path = data_dir+"/ui_test_ansi.golden";
+    std::FILE* out = std::tmpfile();
+    if(not out) {
+        check(false,"Create temporary file for Ansi_backend");
+        return;
+    }
+    {
+        ui::Display d{std::make_unique<ui::Ansi_backend>(fileno(out),5,20)};
+        d.level_view().resize(level);
+        d.level_view().render(level);
+        d.level_view().render(2,1,u8"£",ui::Colour::yellow);
+        d.level_view().render(1,1,'@',ui::Colour::white);
+        d.status_bar().add("HP");
+        d.status_bar().set("HP","9",ui::Colour::red);
+        d.queue_message("Hello.");
+        d.show_changes();
+        d.next_message();
+        d.level_view().render(1,1,'.');
+        d.level_view().render(3,1,'@',ui::Colour::white);
+        d.show_changes();
+        d.status_bar().set("HP","10",ui::Colour::green);
+        d.show_changes();
+        d.redraw();
+        d.show_changes();
+    }
+    std::rewind(out);
+    std::string output;
+    char buf[4096];
+    for(std::size_t n; (n = std::fread(buf,1,sizeof(buf),out))>0;)
+        output.append(buf,n);
+    std::fclose(out);
+    if(std::getenv("UI_TEST_UPDATE_GOLDEN")) {
+        std::ofstream{golden_path,std::ios::binary}<<output;
+        return;
+    }
+    std::ifstream is{golden_path,std::ios::binary};
+    std::stringstream golden;
+    golden<<is.rdbuf();
+    check(is and output==golden.str(),
+            "Ansi_backend output matches "+golden_path);
+}
+
+}
+
+//The directory containing the test data may be given as an argument.
+int main(int argc, char* argv[])
+{
+    const std::string data_dir = argc>1? argv[1] : ".";
+    test_indexed_string();
+    test_level_view();
+    test_level_palette();
+    test_level_tiles();
+    test_load_level();
+    test_layers();
+    test_entities();
+    test_damage_tracking();
+    test_scrolling();
+    test_panes();
+    test_status_bar();
+    test_overlay();
+    test_overlay_provider();
+    test_messages();
+    test_message_log();
+    test_input();
+    test_completion();
+    test_key_events();
+    test_event_loop();
+    test_threaded();
+    test_profile();
+    test_recording();
+    test_spectating();
+    test_colours();
+    test_ansi_input();
+    test_ansi_golden(data_dir);
+    if(failures==0)
+        std::cout<<"All tests passed.\n";
+    return failures==0? 0 : 1;
+}
@@ -1,6 +1,45 @@
+#ifndef UTF8_H
+#define UTF8_H
 #include <string>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "utf8_simd.h"
 namespace utf8 {
 
+//Reference to UTF-8 text owned elsewhere (std::string_view needs C++17).
+//  Lets functions take text without a std::string being made for it.
+class string_ref {
+public:
+    string_ref(const char* s)
+        :m_data{s}, m_size{std::strlen(s)} {}
+    string_ref(const char* s, std::size_t n)
+        :m_data{s}, m_size{n} {}
+    string_ref(const std::string& s)
+        :m_data{s.data()}, m_size{s.size()} {}
+    const char* data() const
+    {   return m_data;  }
+    std::size_t size() const
+    {   return m_size;  }
+    bool empty() const
+    {   return m_size==0;   }
+    char operator[](std::size_t i) const
+    {   return m_data[i];   }
+    const char* begin() const
+    {   return m_data;  }
+    const char* end() const
+    {   return m_data+m_size;   }
+    std::string str() const
+    {   return std::string(m_data,m_size);  }
+private:
+    const char* m_data;
+    std::size_t m_size;
+};
+inline bool operator==(string_ref a, string_ref b)
+{   return a.size()==b.size() and std::memcmp(a.data(),b.data(),a.size())==0; }
+inline bool operator!=(string_ref a, string_ref b)
+{   return not (a==b);  }
+
 inline int offset_next(char ch) //ch is the start of a code point.
 {
     auto c = static_cast<unsigned char>(ch);
@@ -23,12 +62,86 @@ inline bool starts_code_point(char ch) {
         or (c>=0xF0 and c<=0xF4);
 }
 
+//Decodes the code point starting at s[0] into cp, n bytes are available.
+//  Returns the number of bytes used.
+inline int decode_next(const char* s, std::size_t n, char32_t& cp)
+{
+    int len = offset_next(s[0]);
+    if(static_cast<std::size_t>(len)>n)
+        throw std::runtime_error{"Truncated UTF-8 sequence."};
+    static const unsigned char lead_mask[5]{0,0x7F,0x1F,0x0F,0x07};
+    cp = static_cast<unsigned char>(s[0])&lead_mask[len];
+    for(int i=1; i<len; ++i) {
+        auto c = static_cast<unsigned char>(s[i]);
+        if((c&0xC0)!=0x80)
+            throw std::runtime_error{"Badly formed UTF-8 sequence."};
+        cp = (cp<<6)|(c&0x3F);
+    }
+    static const char32_t min_cp[5]{0,0,0x80,0x800,0x10000};
+    if(cp<min_cp[len] or (cp>=0xD800 and cp<=0xDFFF) or cp>0x10FFFF)
+        throw std::runtime_error{"Badly formed UTF-8 sequence."};
+    return len;
+}
+
+//Whether s is well formed UTF-8. Overlong forms, surrogates and code points
+//  above U+10FFFF are rejected.
+inline bool valid(string_ref s)
+{
+    std::size_t count;
+    return simd::valid_count(s.data(),s.size(),count);
+}
+
+//Decodes s into out, which must have room for s.size() code points.
+//  Returns the number of code points written. Does not allocate.
+template<class Char>
+inline std::size_t decode(string_ref s, Char* out)
+{
+    std::size_t count;
+    if(not simd::valid_count(s.data(),s.size(),count))
+        throw std::runtime_error{"Badly formed UTF-8 sequence."};
+    return simd::decode_valid(s.data(),s.size(),out);
+}
+
+//Decodes s into out, reusing its storage.
+template<class Char>
+inline void decode(string_ref s, std::basic_string<Char>& out)
+{
+    out.resize(s.size());
+    out.resize(decode(s,&out[0]));
+}
+
+//Writes cp as UTF-8 to out (which must have room for 4 bytes).
+//  Returns the number of bytes written.
+inline int encode(char32_t cp, char* out)
+{
+    if(cp<0x80) {
+        out[0] = static_cast<char>(cp);
+        return 1;
+    }
+    else if(cp<0x800) {
+        out[0] = static_cast<char>(0xC0|(cp>>6));
+        out[1] = static_cast<char>(0x80|(cp&0x3F));
+        return 2;
+    }
+    else if(cp<0x10000) {
+        out[0] = static_cast<char>(0xE0|(cp>>12));
+        out[1] = static_cast<char>(0x80|((cp>>6)&0x3F));
+        out[2] = static_cast<char>(0x80|(cp&0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0|(cp>>18));
+    out[1] = static_cast<char>(0x80|((cp>>12)&0x3F));
+    out[2] = static_cast<char>(0x80|((cp>>6)&0x3F));
+    out[3] = static_cast<char>(0x80|(cp&0x3F));
+    return 4;
+}
+
 //Returns number of code points in a UTF-8 string.
-inline size_t size(const std::string& s)
+inline size_t size(string_ref s)
 {
-    size_t size=0;
-    for(int i=0; i<s.size(); ++size)
-        i += offset_next(s[i]);
+    std::size_t size;
+    if(not simd::valid_count(s.data(),s.size(),size))
+        throw std::runtime_error{"Badly formed UTF-8 sequence."};
     return size;
 }
 
@@ -52,4 +165,142 @@ inline std::string at(const std::string& s, int index)
         return s.substr(j,1);
 }
 
+//UTF-8 string that can be indexed by code point without scanning from the
+//  start. The byte offset of every 64th code point is recorded (as needed),
+//  so at() scans at most 63 code points. Edits only discard the offsets after
+//  the edit, which are found again when next needed.
+class indexed_string {
+public:
+    static const std::size_t npos = std::string::npos;
+    static const std::size_t crumb_interval = 64;
+
+    //Iterates over the code points, each as a string_ref to its bytes.
+    class const_iterator {
+    public:
+        explicit const_iterator(const char* p)
+            :m_p{p} {}
+        string_ref operator*() const
+        {   return string_ref(m_p,offset_next(*m_p));   }
+        const_iterator& operator++()
+        {   m_p += offset_next(*m_p); return *this;   }
+        bool operator==(const const_iterator& o) const
+        {   return m_p==o.m_p;  }
+        bool operator!=(const const_iterator& o) const
+        {   return m_p!=o.m_p;  }
+    private:
+        const char* m_p;
+    };
+
+    indexed_string() = default;
+    indexed_string(string_ref s)
+    {   assign(s);  }
+    //Throws std::runtime_error if s is not valid UTF-8.
+    void assign(string_ref s)
+    {
+        check(s);
+        m_str.assign(s.data(),s.size());
+        invalidate(0);
+    }
+    const std::string& str() const
+    {   return m_str;   }
+    bool empty() const
+    {   return m_str.empty();   }
+    //Number of code points.
+    std::size_t size() const
+    {
+        build_to(npos);
+        return m_size;
+    }
+    //Byte offset of code point index (size() gives the end of the string).
+    std::size_t offset(std::size_t index) const
+    {
+        const std::size_t crumb = index/crumb_interval;
+        build_to(crumb);
+        if(crumb>=m_crumbs.size())
+            throw std::out_of_range{"Non-existent code point in UTF-8 string."};
+        std::size_t pos = m_crumbs[crumb];
+        for(std::size_t i=crumb*crumb_interval; i<index; ++i) {
+            if(pos>=m_str.size())
+                throw std::out_of_range{
+                    "Non-existent code point in UTF-8 string."};
+            pos += offset_next(m_str[pos]);
+        }
+        return pos;
+    }
+    string_ref at(std::size_t index) const
+    {
+        std::size_t pos = offset(index);
+        if(pos>=m_str.size())
+            throw std::out_of_range{"Non-existent code point in UTF-8 string."};
+        return string_ref(m_str.data()+pos,offset_next(m_str[pos]));
+    }
+    //Code points [index,index+count), or to the end if there are fewer.
+    std::string substr(std::size_t index, std::size_t count=npos) const
+    {
+        std::size_t start = offset(index);
+        if(count==npos or index+count>=size())
+            return m_str.substr(start);
+        return m_str.substr(start,offset(index+count)-start);
+    }
+    const_iterator begin() const
+    {   return const_iterator(m_str.data());    }
+    const_iterator end() const
+    {   return const_iterator(m_str.data()+m_str.size());    }
+
+    //Edits, with index and count in code points.
+    void append(string_ref s)
+    {   insert(size(),s);   }
+    void insert(std::size_t index, string_ref s)
+    {   replace(index,0,s); }
+    void erase(std::size_t index, std::size_t count=npos)
+    {   replace(index,count,"");    }
+    void replace(std::size_t index, std::size_t count, string_ref s)
+    {
+        check(s);
+        std::size_t start = offset(index);
+        std::size_t end = count==npos or index+count>=size()? m_str.size()
+            : offset(index+count);
+        m_str.replace(start,end-start,s.data(),s.size());
+        invalidate(index);
+    }
+private:
+    static void check(string_ref s)
+    {
+        if(not valid(s))
+            throw std::runtime_error{"Badly formed UTF-8 sequence."};
+    }
+    //Forget the offsets of code points after index.
+    void invalidate(std::size_t index)
+    {
+        m_crumbs.resize(index/crumb_interval+1);
+        if(m_crumbs.size()==1)
+            m_crumbs[0] = 0;
+        m_complete = false;
+    }
+    //Record offsets until m_crumbs[crumb] exists or the end is reached.
+    void build_to(std::size_t crumb) const
+    {
+        while(not m_complete and m_crumbs.size()<=crumb) {
+            std::size_t pos = m_crumbs.back();
+            std::size_t n = 0;
+            for(; n<crumb_interval and pos<m_str.size(); ++n)
+                pos += offset_next(m_str[pos]);
+            if(n==crumb_interval and pos<m_str.size())
+                m_crumbs.push_back(pos);
+            else {
+                m_complete = true;
+                m_size = (m_crumbs.size()-1)*crumb_interval+n;
+                if(n==crumb_interval) //Ends exactly on a crumb.
+                    m_crumbs.push_back(pos);
+            }
+        }
+    }
+    std::string m_str;
+    //m_crumbs[i] is the byte offset of code point i*crumb_interval.
+    mutable std::vector<std::size_t> m_crumbs{0};
+    mutable bool m_complete{false};
+    mutable std::size_t m_size{0};
+};
+
 }
+#endif
@@ -0,0 +1,195 @@
+//Microbenchmarks of UTF-8 decoding, comparing utf8::decode with the
+//  std::wstring_convert previously used by ui.cpp.
+//  Reports time and heap allocations per operation (including code point
+//  lookup in long strings and reading key presses), then the throughput of each implementation of
+//  counting, validation and decoding.
+#include "ui.h"
+#include "backend.h"
+#include "utf8.h"
+#include <chrono>
+#include <codecvt>
+#include <cstdlib>
+#include <iostream>
+#include <locale>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef UI_FRAME_PROFILE
+//ui.cpp counts them already.
+#define allocations ui::allocation_count()
+#else
+static long allocations = 0;
+void* operator new(std::size_t n)
+{
+    ++allocations;
+    if(void* p = std::malloc(n))
+        return p;
+    throw std::bad_alloc{};
+}
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
+namespace {
+
+std::wstring_convert<std::codecvt_utf8<wchar_t>,wchar_t> utf8_wchar;
+
+//Stops the compiler removing the work being timed.
+volatile long sink;
+
+template<class F>
+void bench(const std::string& name, long iterations, F f)
+{
+    long start_allocations = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for(long i=0; i<iterations; ++i)
+        f(i);
+    std::chrono::duration<double,std::nano> t =
+        std::chrono::steady_clock::now()-start;
+    std::cout<<name<<": "<<t.count()/iterations<<"ns, "
+        <<double(allocations-start_allocations)/iterations<<" allocations\n";
+}
+
+//Code point count as utf8::size was before validation was added.
+std::size_t size_offset_next(const std::string& s)
+{
+    std::size_t size=0;
+    for(std::size_t i=0; i<s.size(); ++size)
+        i += utf8::offset_next(s[i]);
+    return size;
+}
+
+template<class F>
+void throughput(const std::string& name, const std::string& text, F f)
+{
+    const int repeats = 200;
+    auto start = std::chrono::steady_clock::now();
+    for(int i=0; i<repeats; ++i)
+        f();
+    std::chrono::duration<double> t = std::chrono::steady_clock::now()-start;
+    std::cout<<name<<": "<<text.size()*repeats/t.count()/1e6<<" MB/s\n";
+}
+
+void bench_throughput(const std::string& name, const std::string& line)
+{
+    using utf8::simd::Isa;
+    std::string text;
+    while(text.size()<1000000)
+        text += line;
+    std::vector<char32_t> out(text.size());
+    const char* isa_names[]{"scalar","ssse3","avx2"};
+    std::vector<Isa> isas{Isa::scalar};
+    if(utf8::simd::isa()==Isa::avx2)
+        isas.push_back(Isa::ssse3);
+    if(utf8::simd::isa()!=Isa::scalar)
+        isas.push_back(utf8::simd::isa());
+    throughput(name+" size, offset_next loop",text,[&] {
+        sink += size_offset_next(text);
+    });
+    for(Isa isa : isas) {
+        const std::string impl = std::string{", "}+isa_names[int(isa)];
+        throughput(name+" validate and count"+impl,text,[&] {
+            std::size_t count;
+            sink += utf8::simd::valid_count(text.data(),text.size(),count,isa);
+            sink += count;
+        });
+        throughput(name+" decode (after validation)"+impl,text,[&] {
+            sink += utf8::simd::decode_valid(text.data(),text.size(),
+                    out.data(),isa);
+        });
+    }
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    const long n = argc>1? std::atol(argv[1]) : 1000000;
+    const std::string glyph = u8"£";
+    const std::string value = "10/10";
+    const std::string line =
+        u8"Language Learning and Teaching Изучение и обучение иностранных языков";
+
+    bench("glyph, wstring_convert",n,[&](long) {
+        sink += utf8_wchar.from_bytes(glyph)[0];
+    });
+    bench("glyph, utf8::decode_next",n,[&](long) {
+        char32_t cp;
+        utf8::decode_next(glyph.data(),glyph.size(),cp);
+        sink += cp;
+    });
+
+    ui::Level_view lv;
+    lv.resize(100,100);
+    bench("Level_view::render(x,y,u8\"£\")",n,[&](long i) {
+        lv.render(i%100,(i/100)%100,u8"£",ui::Colour::yellow);
+        if(i%10000==0)
+            lv.invalidate(); //Keep the damage list bounded, as refresh would.
+    });
+
+    std::wstring out;
+    bench("status value, wstring_convert",n,[&](long) {
+        out = utf8_wchar.from_bytes(value);
+        sink += out.size();
+    });
+    bench("status value, utf8::decode",n,[&](long) {
+        utf8::decode(value,out);
+        sink += out.size();
+    });
+    bench("mixed line, wstring_convert",n,[&](long) {
+        out = utf8_wchar.from_bytes(line);
+        sink += out.size();
+    });
+    bench("mixed line, utf8::decode",n,[&](long) {
+        utf8::decode(line,out);
+        sink += out.size();
+    });
+
+    std::string long_line;
+    for(int i=0; i<50; ++i)
+        long_line += line;
+    const std::size_t long_size = utf8::size(long_line);
+    bench("code point of 3500, utf8::at",n/100,[&](long i) {
+        sink += utf8::at(long_line,i%long_size).size();
+    });
+    const utf8::indexed_string indexed{long_line};
+    bench("code point of 3500, utf8::indexed_string::at",n,[&](long i) {
+        sink += indexed.at(i%long_size).size();
+    });
+
+    //Reading and dispatching a key press, as demo.cpp's main loop did and
+    //  does now.
+    auto backend = new ui::Headless_backend{};
+    ui::Display d{std::unique_ptr<ui::Backend>{backend}};
+    enum Action { left, right, down, up, battle, inventory, coins, quit };
+    const ui::Key_map<Action> keys{{'h',left}, {ui::Key::left,left},
+        {'l',right}, {ui::Key::right,right}, {'j',down}, {ui::Key::down,down},
+        {'k',up}, {ui::Key::up,up}, {'b',battle}, {'i',inventory},
+        {U'£',coins}, {'q',quit}, {27,quit}};
+    const std::string typed[]{"l","h","j","k",u8"£","q"};
+    bench("key press, get_key and string compares",n,[&](long i) {
+        backend->push_input(typed[i%6]);
+        auto key = d.get_key();
+        int action = key=="h" or key=="Left"? left : key=="l" or key=="Right"?
+            right : key=="j" or key=="Down"? down : key=="k" or key=="Up"? up
+            : key=="b"? battle : key=="i"? inventory : key==u8"£"? coins
+            : key=="q" or key=="Esc"? quit : -1;
+        sink += action;
+    });
+    bench("key press, get_key_event and Key_map",n,[&](long i) {
+        backend->push_input(typed[i%6]);
+        auto action = keys.find(d.get_key_event());
+        sink += action? *action : -1;
+    });
+
+    bench_throughput("ASCII","Language Learning and Teaching ");
+    bench_throughput("Cyrillic",u8"Изучение и обучение иностранных языков ");
+    bench_throughput("CJK",u8"是一个专为语文教学而设计的电脑软件");
+}
@@ -0,0 +1,397 @@
+//Vectorised kernels used by utf8.h, with the implementation chosen at run
+//  time from what the CPU supports. Included by utf8.h, use that instead.
+//  Validation follows Keiser and Lemire, "Validating UTF-8 In Less Than One
+//  Instruction Per Byte": each byte and the high nibble of the next are looked
+//  up in three 16 entry tables whose intersection flags any error.
+#ifndef UTF8_SIMD_H
+#define UTF8_SIMD_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__x86_64__) or defined(__i386__)) and defined(__GNUC__)
+#define UTF8_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace utf8 {
+namespace simd {
+
+enum class Isa { scalar, ssse3, avx2 };
+
+//Scalar implementations, also used for the ends of strings.
+
+//Whether s is well formed UTF-8 (Unicode 7.0, table 3-7). Overlong forms,
+//  surrogates and code points above U+10FFFF are rejected.
+inline bool valid_scalar(const unsigned char* s, std::size_t n)
+{
+    std::size_t i = 0;
+    while(i<n) {
+        unsigned char c = s[i];
+        if(c<0x80) {
+            ++i;
+            continue;
+        }
+        int len;
+        unsigned char lo = 0x80, hi = 0xBF; //Range of the second byte.
+        if(c>=0xC2 and c<=0xDF)
+            len = 2;
+        else if(c>=0xE0 and c<=0xEF) {
+            len = 3;
+            if(c==0xE0)
+                lo = 0xA0;
+            else if(c==0xED)
+                hi = 0x9F;
+        }
+        else if(c>=0xF0 and c<=0xF4) {
+            len = 4;
+            if(c==0xF0)
+                lo = 0x90;
+            else if(c==0xF4)
+                hi = 0x8F;
+        }
+        else
+            return false;
+        if(n-i<static_cast<std::size_t>(len) or s[i+1]<lo or s[i+1]>hi)
+            return false;
+        for(int j=2; j<len; ++j)
+            if((s[i+j]&0xC0)!=0x80)
+                return false;
+        i += len;
+    }
+    return true;
+}
+
+//Number of bytes that start a code point.
+inline std::size_t count_scalar(const unsigned char* s, std::size_t n)
+{
+    std::size_t res = 0;
+    for(std::size_t i=0; i<n; ++i)
+        res += (s[i]&0xC0)!=0x80;
+    return res;
+}
+
+//Decodes valid UTF-8 (no checks are made).
+template<class Char>
+inline std::size_t decode_valid_scalar(const unsigned char* s, std::size_t n,
+        Char* out)
+{
+    Char* o = out;
+    const unsigned char* end = s+n;
+    while(s<end) {
+        unsigned char c = *s;
+        char32_t cp;
+        if(c<0x80) {
+            cp = c;
+            s += 1;
+        }
+        else if(c<0xE0) {
+            cp = (c&0x1F)<<6 | (s[1]&0x3F);
+            s += 2;
+        }
+        else if(c<0xF0) {
+            cp = (c&0x0F)<<12 | (s[1]&0x3F)<<6 | (s[2]&0x3F);
+            s += 3;
+        }
+        else {
+            cp = (c&0x07)<<18 | (s[1]&0x3F)<<12 | (s[2]&0x3F)<<6
+                | (s[3]&0x3F);
+            s += 4;
+        }
+        *o++ = static_cast<Char>(cp);
+    }
+    return o-out;
+}
+
+#ifdef UTF8_SIMD_X86
+
+//Error flags for the lookup tables.
+enum : std::uint8_t {
+    too_short = 1<<0, //Lead byte not followed by a continuation.
+    too_long = 1<<1, //ASCII followed by a continuation.
+    overlong_3 = 1<<2,
+    too_large = 1<<3,
+    surrogate = 1<<4,
+    overlong_2 = 1<<5,
+    too_large_1000 = 1<<6,
+    overlong_4 = 1<<6,
+    two_conts = 1<<7, //Two continuations, an error unless in a 3/4 byte form.
+    carry = too_short|too_long|two_conts
+};
+
+#define UTF8_SIMD_TABLES(set) \
+    const auto byte_1_high_table = set( \
+        too_long, too_long, too_long, too_long, \
+        too_long, too_long, too_long, too_long, \
+        two_conts, two_conts, two_conts, two_conts, \
+        too_short|overlong_2, \
+        too_short, \
+        too_short|overlong_3|surrogate, \
+        too_short|too_large|too_large_1000|overlong_4); \
+    const auto byte_1_low_table = set( \
+        carry|overlong_3|overlong_2|overlong_4, \
+        carry|overlong_2, \
+        carry, carry, \
+        carry|too_large, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000|surrogate, \
+        carry|too_large|too_large_1000, \
+        carry|too_large|too_large_1000); \
+    const auto byte_2_high_table = set( \
+        too_short, too_short, too_short, too_short, \
+        too_short, too_short, too_short, too_short, \
+        too_long|overlong_2|two_conts|overlong_3|too_large_1000|overlong_4, \
+        too_long|overlong_2|two_conts|overlong_3|too_large, \
+        too_long|overlong_2|two_conts|surrogate|too_large, \
+        too_long|overlong_2|two_conts|surrogate|too_large, \
+        too_short, too_short, too_short, too_short)
+
+__attribute__((target("ssse3")))
+inline __m128i set_table_ssse3(int a0, int a1, int a2, int a3, int a4, int a5,
+        int a6, int a7, int a8, int a9, int a10, int a11, int a12, int a13,
+        int a14, int a15)
+{
+    return _mm_setr_epi8(a0,a1,a2,a3,a4,a5,a6,a7,a8,a9,a10,a11,a12,a13,a14,a15);
+}
+
+//Validates s, counting the bytes that start a code point into count.
+__attribute__((target("ssse3,popcnt")))
+inline bool valid_count_ssse3(const unsigned char* s, std::size_t n,
+        std::size_t& count)
+{
+    UTF8_SIMD_TABLES(set_table_ssse3);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    //Lead bytes at the end of a block that need more bytes than it has.
+    const __m128i incomplete_max = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,
+            -1,-1,-1,-1,-1,char(0xF0-1),char(0xE0-1),char(0xC0-1));
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    std::size_t continuations = 0;
+    for(std::size_t i=0; i<n; i+=16) {
+        __m128i input;
+        if(n-i>=16)
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s+i));
+        else { //Pad the end with ASCII.
+            unsigned char tail[16]{};
+            std::memcpy(tail,s+i,n-i);
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tail));
+        }
+        continuations += __builtin_popcount(_mm_movemask_epi8(
+                    _mm_cmplt_epi8(input,_mm_set1_epi8(-64))));
+        if(_mm_movemask_epi8(input)==0) { //All ASCII.
+            error = _mm_or_si128(error,prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        }
+        else {
+            __m128i prev1 = _mm_alignr_epi8(input,prev_input,15);
+            __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table,
+                    _mm_and_si128(_mm_srli_epi16(prev1,4),nibble));
+            __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table,
+                    _mm_and_si128(prev1,nibble));
+            __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table,
+                    _mm_and_si128(_mm_srli_epi16(input,4),nibble));
+            __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high,
+                        byte_1_low),byte_2_high);
+            __m128i prev2 = _mm_alignr_epi8(input,prev_input,14);
+            __m128i prev3 = _mm_alignr_epi8(input,prev_input,13);
+            //Top bit set where a 3rd or 4th byte of a sequence must be.
+            __m128i must23 = _mm_or_si128(
+                    _mm_subs_epu8(prev2,_mm_set1_epi8(char(0xE0-0x80))),
+                    _mm_subs_epu8(prev3,_mm_set1_epi8(char(0xF0-0x80))));
+            __m128i must23_80 = _mm_and_si128(must23,
+                    _mm_set1_epi8(char(0x80)));
+            error = _mm_or_si128(error,_mm_xor_si128(must23_80,special));
+            prev_incomplete = _mm_subs_epu8(input,incomplete_max);
+        }
+        prev_input = input;
+    }
+    error = _mm_or_si128(error,prev_incomplete);
+    count = n-continuations;
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error,_mm_setzero_si128()))
+        ==0xFFFF;
+}
+
+__attribute__((target("avx2")))
+inline __m256i set_table_avx2(int a0, int a1, int a2, int a3, int a4, int a5,
+        int a6, int a7, int a8, int a9, int a10, int a11, int a12, int a13,
+        int a14, int a15)
+{
+    return _mm256_setr_epi8(a0,a1,a2,a3,a4,a5,a6,a7,a8,a9,a10,a11,a12,a13,a14,
+            a15,a0,a1,a2,a3,a4,a5,a6,a7,a8,a9,a10,a11,a12,a13,a14,a15);
+}
+
+__attribute__((target("avx2,popcnt")))
+inline bool valid_count_avx2(const unsigned char* s, std::size_t n,
+        std::size_t& count)
+{
+    UTF8_SIMD_TABLES(set_table_avx2);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i incomplete_max = _mm256_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,
+            -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+            -1,-1,-1,-1,-1,char(0xF0-1),char(0xE0-1),char(0xC0-1));
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    std::size_t continuations = 0;
+    for(std::size_t i=0; i<n; i+=32) {
+        __m256i input;
+        if(n-i>=32)
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s+i));
+        else {
+            unsigned char tail[32]{};
+            std::memcpy(tail,s+i,n-i);
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail));
+        }
+        continuations += _mm_popcnt_u32(_mm256_movemask_epi8(
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8(-64),input)));
+        if(_mm256_movemask_epi8(input)==0) {
+            error = _mm256_or_si256(error,prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+        }
+        else {
+            //The previous 32 bytes shifted along by 16, for alignr.
+            __m256i shifted = _mm256_permute2x128_si256(prev_input,input,0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input,shifted,15);
+            __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+                    _mm256_and_si256(_mm256_srli_epi16(prev1,4),nibble));
+            __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table,
+                    _mm256_and_si256(prev1,nibble));
+            __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+                    _mm256_and_si256(_mm256_srli_epi16(input,4),nibble));
+            __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high,
+                        byte_1_low),byte_2_high);
+            __m256i prev2 = _mm256_alignr_epi8(input,shifted,14);
+            __m256i prev3 = _mm256_alignr_epi8(input,shifted,13);
+            __m256i must23 = _mm256_or_si256(
+                    _mm256_subs_epu8(prev2,_mm256_set1_epi8(char(0xE0-0x80))),
+                    _mm256_subs_epu8(prev3,_mm256_set1_epi8(char(0xF0-0x80))));
+            __m256i must23_80 = _mm256_and_si256(must23,
+                    _mm256_set1_epi8(char(0x80)));
+            error = _mm256_or_si256(error,_mm256_xor_si256(must23_80,special));
+            prev_incomplete = _mm256_subs_epu8(input,incomplete_max);
+        }
+        prev_input = input;
+    }
+    error = _mm256_or_si256(error,prev_incomplete);
+    count = n-continuations;
+    return _mm256_testz_si256(error,error);
+}
+
+#undef UTF8_SIMD_TABLES
+
+//Decodes valid UTF-8, widening 16 ASCII bytes at a time (if Char is 32 bits).
+//  Other blocks of 16 bytes are decoded one code point at a time.
+template<class Char>
+__attribute__((target("sse2")))
+inline std::size_t decode_valid_sse2(const unsigned char* s, std::size_t n,
+        Char* out)
+{
+    const unsigned char* end = s+n;
+    Char* o = out;
+    const __m128i zero = _mm_setzero_si128();
+    while(sizeof(Char)==4 and end-s>=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        int mask = _mm_movemask_epi8(v);
+        if(mask==0) {
+            __m128i lo = _mm_unpacklo_epi8(v,zero);
+            __m128i hi = _mm_unpackhi_epi8(v,zero);
+            auto* dst = reinterpret_cast<__m128i*>(o);
+            _mm_storeu_si128(dst,_mm_unpacklo_epi16(lo,zero));
+            _mm_storeu_si128(dst+1,_mm_unpackhi_epi16(lo,zero));
+            _mm_storeu_si128(dst+2,_mm_unpacklo_epi16(hi,zero));
+            _mm_storeu_si128(dst+3,_mm_unpackhi_epi16(hi,zero));
+            s += 16;
+            o += 16;
+            continue;
+        }
+        //The last code point may end past the block, as the input is valid.
+        const unsigned char* block_end = s+16;
+        while(s<block_end) {
+            unsigned char c = *s;
+            if(c<0x80) {
+                *o++ = c;
+                s += 1;
+            }
+            else if(c<0xE0) {
+                *o++ = static_cast<Char>((c&0x1F)<<6 | (s[1]&0x3F));
+                s += 2;
+            }
+            else if(c<0xF0) {
+                *o++ = static_cast<Char>((c&0x0F)<<12 | (s[1]&0x3F)<<6
+                        | (s[2]&0x3F));
+                s += 3;
+            }
+            else {
+                o += decode_valid_scalar(s,4,o);
+                s += 4;
+            }
+        }
+    }
+    return (o-out)+decode_valid_scalar(s,end-s,o);
+}
+
+inline Isa detect_isa()
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") and __builtin_cpu_supports("popcnt"))
+        return Isa::avx2;
+    if(__builtin_cpu_supports("ssse3") and __builtin_cpu_supports("popcnt"))
+        return Isa::ssse3;
+    return Isa::scalar;
+}
+
+#else
+
+inline Isa detect_isa()
+{
+    return Isa::scalar;
+}
+
+#endif
+
+//Best implementation for this CPU, found on first use.
+inline Isa isa()
+{
+    static const Isa best = detect_isa();
+    return best;
+}
+
+//Whether s is valid UTF-8, if so count is set to its number of code points.
+inline bool valid_count(const char* s, std::size_t n, std::size_t& count,
+        Isa use=isa())
+{
+    auto us = reinterpret_cast<const unsigned char*>(s);
+#ifdef UTF8_SIMD_X86
+    if(use==Isa::avx2)
+        return valid_count_avx2(us,n,count);
+    if(use==Isa::ssse3)
+        return valid_count_ssse3(us,n,count);
+#endif
+    count = count_scalar(us,n);
+    return valid_scalar(us,n);
+}
+
+//Decodes valid UTF-8 (as checked by valid_count) into out.
+template<class Char>
+inline std::size_t decode_valid(const char* s, std::size_t n, Char* out,
+        Isa use=isa())
+{
+    auto us = reinterpret_cast<const unsigned char*>(s);
+#ifdef UTF8_SIMD_X86
+    if(use!=Isa::scalar)
+        return decode_valid_sse2(us,n,out);
+#endif
+    return decode_valid_scalar(us,n,out);
+}
+
+}//End namespace simd.
+}//End namespace utf8.
+#endif
@@ -0,0 +1,94 @@
+//Checks the vectorised UTF-8 kernels give the same results as the scalar ones.
+//  Prints any failures and returns non-zero if there were some.
+#include "utf8.h"
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+std::vector<utf8::simd::Isa> supported_isas()
+{
+    using utf8::simd::Isa;
+    std::vector<Isa> res{Isa::scalar};
+    if(utf8::simd::isa()==Isa::avx2)
+        res.push_back(Isa::ssse3);
+    if(utf8::simd::isa()!=Isa::scalar)
+        res.push_back(utf8::simd::isa());
+    return res;
+}
+
+//Compares every implementation with the scalar one on s.
+void check(const std::string& s)
+{
+    static const auto isas = supported_isas();
+    auto us = reinterpret_cast<const unsigned char*>(s.data());
+    const bool valid = utf8::simd::valid_scalar(us,s.size());
+    const std::size_t count = utf8::simd::count_scalar(us,s.size());
+    std::u32string expected(s.size(),U'\0');
+    if(valid)
+        expected.resize(utf8::simd::decode_valid_scalar(us,s.size(),
+                    &expected[0]));
+    for(auto isa : isas) {
+        std::size_t isa_count = 0;
+        bool isa_valid = utf8::simd::valid_count(s.data(),s.size(),isa_count,
+                isa);
+        std::u32string decoded(s.size(),U'\0');
+        if(isa_valid)
+            decoded.resize(utf8::simd::decode_valid(s.data(),s.size(),
+                        &decoded[0],isa));
+        if(isa_valid!=valid or (valid and (isa_count!=count
+                        or decoded!=expected))) {
+            if(++failures<=10) {
+                std::cerr<<"FAILED: implementation "<<int(isa)<<" on";
+                for(unsigned char c : s)
+                    std::cerr<<' '<<std::hex<<int(c)<<std::dec;
+                std::cerr<<'\n';
+            }
+        }
+    }
+}
+
+}
+
+int main()
+{
+    //Every 1 and 2 byte sequence at positions that cross the 16 and 32 byte
+    //  block boundaries, and every 3 byte one at the start and crossing both.
+    for(int offset : {0,14,30,31}) {
+        std::string pad(offset,'a');
+        for(int a=0; a<256; ++a) {
+            check(pad+char(a));
+            for(int b=0; b<256; ++b) {
+                check(pad+char(a)+char(b));
+                if(offset==0 or offset==30)
+                    for(int c=0; c<256; ++c)
+                        check(pad+char(a)+char(b)+char(c)+"tail");
+            }
+        }
+    }
+    //Random text mixing valid code points and random bytes.
+    std::mt19937 rng{42};
+    const std::vector<std::string> pieces{
+        "a", u8"Я", u8"是", u8"𝄞", "\xF4\x8F\xBF\xBF", "\xED\x9F\xBF",
+        "\xC0\x80", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xE0\x80\x80", "\x80",
+        "\xFF"
+    };
+    for(int i=0; i<200000; ++i) {
+        std::string s;
+        int len = rng()%80;
+        bool bad = rng()%4==0;
+        while(s.size()<len) {
+            int max_piece = bad? pieces.size() : 6;
+            s += pieces[rng()%max_piece];
+        }
+        check(s);
+    }
+    if(failures==0)
+        std::cout<<"All tests passed.\n";
+    return failures==0? 0 : 1;
+}